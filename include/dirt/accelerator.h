@@ -0,0 +1,197 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <dirt/leafprimitives.h>
+#include <dirt/surfacegroup.h>
+#include <functional>
+
+class BBHTree;
+template <int Width, bool Quantized = false> class BBHWideTree;
+class KdTree;
+class UniformGrid;
+
+/**
+    Splits a primitive at an axis-aligned plane for spatial splits.
+
+    Called as splitPrimitive(index, axis, position, left, right), it should
+    enclose the parts of primitive \c index below and above \c position
+    along \c axis in \c left and \c right (which start out empty). The
+    builder clips the results to the plane and the bounds of the reference
+    being split, so returning the bounds of the whole primitive on both sides
+    is always valid, but tighter bounds give better hierarchies.
+ */
+typedef std::function<void(uint32_t index, int axis, float position, Box3f & left, Box3f & right)>
+    BBHSplitFunction;
+
+/**
+    Base class of the acceleration structures over indexed primitives.
+
+    Subclasses build one spatial structure over a list of primitive bounds
+    (\ref buildPrimitives) and register it for traversal with \ref
+    setTraversal. The structure refers to the primitives by leaf slot: slot
+    \c i is the primitive with input index \c order[i], and the primitives
+    of each leaf occupy consecutive slots.
+
+    This class implements everything else on top of that: as an aggregate
+    of surfaces, \ref build reorders the children into leaf slots and tests
+    them through \ref m_leafPrimitives, and owners of other primitives, such
+    as the faces of a \ref Mesh, traverse the structure with their own tests
+    through \ref intersectPrimitives and friends.
+
+    The traversal templates dispatch on the registered structure with a
+    single \ref visit, and are defined in traversal.h, which needs the
+    definitions of all structures.
+ */
+class Accelerator : public SurfaceGroup
+{
+public:
+    Accelerator(const Scene & scene, const json & j = json::object()) : SurfaceGroup(scene, j) {}
+    ~Accelerator() override;
+
+    // the registered structure points into the subclass
+    Accelerator(const Accelerator &) = delete;
+    Accelerator & operator=(const Accelerator &) = delete;
+
+    /// Build the structure over the children (must be called before @ref intersect)
+    void build() override;
+
+    /// Refit the structure to the children in place, or rebuild it if \ref refitPrimitives declines
+    void refit() override;
+
+    /// Add the statistics of this structure (see \ref treeStats) and of the children
+    void addAccelerationStats(json & stats) const override;
+
+    /// Find the closest candidate hit among all surfaces registered with the Accelerator
+    bool intersectCandidate(const Ray3f &ray, HitInfo &hit) const override;
+
+    /// Return whether the ray hits any surface registered with the Accelerator
+    bool occluded(const Ray3f &ray) const override;
+
+    /// Find the closest candidate hits of a packet of rays among all surfaces registered with the Accelerator
+    uint32_t intersectPacketCandidates(RayPacket &packet, uint32_t activeMask, HitInfo *hits) const override;
+
+    /**
+        Build the structure over primitives with the given bounds.
+
+        On return, leaf slot \c i holds the primitive with input index
+        \c order[i]. Structures may reference a primitive from several
+        slots. Owners that can clip their primitives to a plane should pass
+        \c splitPrimitive, which tightens the bounds of spatial splits.
+     */
+    virtual void buildPrimitives(const vector<Box3f> & bounds, vector<uint32_t> & order,
+                                 const BBHSplitFunction & splitPrimitive = BBHSplitFunction()) = 0;
+
+    /**
+        Refit the structure built by \ref buildPrimitives to new primitive
+        bounds, given per leaf slot.
+
+        \return \c false if the owner should rebuild the structure instead,
+                which is all this base implementation does (unless there are
+                no primitives)
+     */
+    virtual bool refitPrimitives(const vector<Box3f> & bounds);
+
+    /// The primitive ranges (first, count) of all leaves of the structure, in the order of their primitives
+    virtual vector<std::pair<uint32_t, uint32_t>> leafRanges() const = 0;
+
+    /// Statistics of the structure (see \ref BBHTree::statistics), including the memory of its nodes ("node_bytes")
+    virtual json treeStats() const = 0;
+
+    /**
+        Intersect a ray against the structure built by \ref buildPrimitives.
+
+        See \ref BBHTree::intersect for the signature of \c intersectPrimitive.
+     */
+    template <typename PrimitiveFunc>
+    bool intersectPrimitives(const Ray3f &ray, HitInfo &hit, PrimitiveFunc && intersectPrimitive) const;
+
+    /// Occlusion query against the structure built by \ref buildPrimitives (see \ref BBHTree::occluded)
+    template <typename PrimitiveFunc>
+    bool occludedPrimitives(const Ray3f &ray, PrimitiveFunc && occludedPrimitive) const;
+
+    /// Like \ref intersectPrimitives, but testing whole leaves at once (see \ref BBHTree::intersectLeaves)
+    template <typename LeafFunc>
+    bool intersectLeaves(const Ray3f &ray, HitInfo &hit, LeafFunc && intersectLeaf) const;
+
+    /// Like \ref occludedPrimitives, but testing whole leaves at once (see \ref BBHTree::occludedLeaves)
+    template <typename LeafFunc>
+    bool occludedLeaves(const Ray3f &ray, LeafFunc && occludedLeaf) const;
+
+    /**
+        Packet query against the structure built by \ref buildPrimitives
+        (see \ref BBHTree::intersectPacket).
+
+        Packets are traced through the binary hierarchy registered with
+        \ref setPacketTree, or one ray at a time if there is none.
+     */
+    template <typename PacketFunc, typename PrimitiveFunc>
+    uint32_t intersectPacketPrimitives(RayPacket &packet, uint32_t activeMask, HitInfo *hits,
+                                       PacketFunc && intersectPrimitives,
+                                       PrimitiveFunc && intersectPrimitive) const;
+
+protected:
+    /// The kinds of structures that can be traversed
+    enum class Traversal
+    {
+        None,
+        Binary,
+        Wide4,
+        Wide8,
+        Quantized4,
+        Quantized8,
+        KdTree,
+        Grid
+    };
+
+    /// Register the structure that rays traverse (owned by the subclass), or none
+    void setTraversal(std::nullptr_t) {setTraversal(Traversal::None, nullptr);}
+    void setTraversal(const BBHTree * tree) {setTraversal(Traversal::Binary, tree);}
+    void setTraversal(const BBHWideTree<4> * tree) {setTraversal(Traversal::Wide4, tree);}
+    void setTraversal(const BBHWideTree<8> * tree) {setTraversal(Traversal::Wide8, tree);}
+    void setTraversal(const BBHWideTree<4, true> * tree) {setTraversal(Traversal::Quantized4, tree);}
+    void setTraversal(const BBHWideTree<8, true> * tree) {setTraversal(Traversal::Quantized8, tree);}
+    void setTraversal(const KdTree * tree) {setTraversal(Traversal::KdTree, tree);}
+    void setTraversal(const UniformGrid * grid) {setTraversal(Traversal::Grid, grid);}
+
+    /// Register the binary hierarchy that packets traverse (owned by the subclass), or none
+    void setPacketTree(const BBHTree * tree) {m_packetTree = tree;}
+
+    /**
+        Call \c visitor with the registered structure, as
+        visitor(const Structure &), and return its result, or \c false if
+        there is none. Defined in traversal.h.
+     */
+    template <typename Visitor>
+    bool visit(Visitor && visitor) const;
+
+    LeafPrimitives m_leafPrimitives;        ///< The children in each leaf slot, by type
+
+private:
+    void setTraversal(Traversal type, const void * structure)
+    {
+        m_traversalType = type;
+        m_traversal = structure;
+    }
+
+    Traversal m_traversalType = Traversal::None;
+    const void * m_traversal = nullptr;     ///< The structure rays traverse, of type m_traversalType
+    const BBHTree * m_packetTree = nullptr; ///< The hierarchy packets traverse, if any
+    bool m_duplicated = false;              ///< Whether the last build referenced some children more than once
+};
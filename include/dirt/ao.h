@@ -32,16 +32,26 @@ public:
     virtual Color3f Li(const Scene & scene, Sampler &sampler, const Ray3f& ray) const override
     {
         HitInfo hit;
-        if (!scene.intersect(ray, hit))
+        if (!scene.intersect(ray, hit, RayType::Camera))
+            return Color3f(0.0f);
+
+        return primaryLi(scene, sampler, ray, &hit);
+    }
+
+    virtual bool acceptsPrimaryHits() const override {return true;}
+
+    virtual Color3f primaryLi(const Scene & scene, Sampler &sampler, const Ray3f& ray, const HitInfo *hit) const override
+    {
+        if (!hit)
             return Color3f(0.0f);
 
         ScatterRecord record;
         Vec2f sample = sampler.next2D();
-        if (!hit.mat->sample(ray.d, hit, sample, record))
+        if (!hit->mat->sample(ray.d, *hit, sample, record))
             return Color3f(0.0f);
 
-        Ray3f shadowRay(hit.p, record.scattered, Epsilon, 1e30f);
-        if (scene.intersect(shadowRay, hit))
+        Ray3f shadowRay(hit->p, record.scattered, Epsilon, 1e30f);
+        if (scene.occluded(shadowRay))
             return Color3f(0.0f);
 
         return Color3f(1.0f);
@@ -0,0 +1,82 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <dirt/surfacegroup.h>
+
+/**
+    An accelerator that picks the acceleration structure for its children
+    when it is built.
+
+    This is the default when a scene has no "accelerator" block, and can be
+    requested explicitly:
+    \code
+        "accelerator": {"type": "auto", "probe": true, "probe_rays": 4096}
+    \endcode
+    By default the structure is chosen from the number and kind of the
+    children (see \ref heuristic). With "probe", every structure in
+    "candidates" (by default the heuristic choice and a few common
+    alternatives) is built, a small set of camera rays and random rays is
+    traced through each, and the one that traced the probe set fastest is
+    kept. The decision is always logged.
+
+    Meshes that request "auto" use an \ref Accelerator chosen by \ref heuristic for
+    their number of faces.
+ */
+class AutoAccelerator : public SurfaceGroup
+{
+public:
+    AutoAccelerator(const Scene & scene, const json & j = json::object());
+
+    /// Choose the acceleration structure and build it over the children
+    void build() override;
+
+    void refit() override;
+    bool intersect(const Ray3f &ray, HitInfo &hit) const override;
+    bool intersectCandidate(const Ray3f &ray, HitInfo &hit) const override;
+    bool occluded(const Ray3f &ray) const override;
+    uint32_t intersectPacketCandidates(RayPacket &packet, uint32_t activeMask, HitInfo *hits) const override;
+    void addAccelerationStats(json & stats) const override;
+
+    /**
+        Return the "accelerator" specification that suits \c numPrimitives
+        primitives, a fraction \c sphereFraction of which are spheres, whose
+        sizes vary by \c sizeVariation (the coefficient of variation of
+        their bounding box diagonals).
+
+        Tiny sets are left in a plain group, many similarly sized spheres
+        (e.g. particles) get a grid, and everything else gets an SAH BBH,
+        4-wide for larger sets.
+     */
+    static json heuristic(size_t numPrimitives, float sphereFraction = 0.f, float sizeVariation = 0.f);
+
+private:
+    /**
+        Build each candidate, trace the probe rays through it, and return
+        the fastest one, already built. \c choice holds the heuristic choice
+        on entry, and the specification of the fastest candidate on return.
+     */
+    shared_ptr<SurfaceGroup> probe(json & choice, float sphereFraction, string & reason) const;
+
+    const Scene & m_scene;
+    bool m_probe = false;                   ///< Whether to time candidates instead of trusting the heuristic
+    int m_probeRays = 4096;                 ///< Number of probe rays (half from the camera, half random)
+    json m_candidates;                      ///< Specifications to probe (null for the defaults)
+    shared_ptr<SurfaceGroup> m_chosen;      ///< The structure that was chosen, once built
+};
@@ -18,36 +18,607 @@
 
 #pragma once
 
-#include <dirt/surfacegroup.h>
+#include <dirt/accelerator.h>
 #include <dirt/progress.h>
 
-class BBHNode : public Surface
+class MappedFile;
+
+/// Parameters controlling how a BBH is constructed
+struct BBHSettings
 {
-    Box3f m_bounds;
-    shared_ptr<SurfaceBase> m_left;
-    shared_ptr<SurfaceBase> m_right;
+    /// Strategy used to split a node ("median" or "sah")
+    string splitMethod = "median";
+    /// Nodes with at most this many primitives become leaves
+    int maxLeafSize = 2;
+    /// Whether nodes with at most \ref maxLeafSize primitives are still split when the SAH predicts this is cheaper
+    bool sahLeaves = false;
+    /// Number of centroid bins evaluated per axis by the SAH splitter
+    int numBins = 16;
+    /// Cost of traversing an interior node relative to a primitive test
+    float traversalCost = 0.125f;
+    /// Branching factor of the hierarchy used for traversal (2, 4 or 8)
+    int width = 2;
+    /// Whether the wide hierarchy stores its child bounds quantized to 8 bits (requires a width of 4 or 8)
+    bool quantized = false;
+    /// Order of the wide nodes in memory ("depth_first" or "treelet", requires a width of 4 or 8)
+    string layout = "depth_first";
+    /// Number of threads used for construction (0 uses all hardware threads)
+    int threads = 0;
+    /// Whether the SAH builder may also split primitive references at spatial planes (SBVH)
+    bool spatialSplits = false;
+    /// Maximum number of primitive references, relative to the number of primitives, with spatial splits
+    float maxDuplication = 1.5f;
+};
 
-public:
-    BBHNode(vector<shared_ptr<SurfaceBase>> primitives, Progress & progress);
-    ~BBHNode();
+/// Timing information about the construction of a \ref BBHTree
+struct BBHBuildStats
+{
+    double milliseconds = 0.0;      ///< Wall-clock build time
+    int threads = 1;                ///< Number of threads available to the build
+    float utilization = 1.f;        ///< Fraction of the available thread time spent building
+};
+
+/// Cached bounds of a single primitive used while building the BBH
+struct BBHPrimitiveInfo
+{
+    uint32_t index;             ///< Index of the primitive in the input list
+    Box3f bounds;
+    Vec3f centroid;
+};
+
+/**
+    A single node of a flattened BBH (32 bytes).
+
+    Nodes are stored in depth-first order, so the first child of an interior
+    node immediately follows its parent in the node array and only the
+    offset of the second child needs to be stored. Leaves instead store the
+    range of primitives they contain.
+ */
+struct BBHLinearNode
+{
+    Box3f bounds;                       ///< Bounds of the node
+    union
+    {
+        uint32_t primitivesOffset;      ///< Leaf: index of the first primitive
+        uint32_t secondChildOffset;     ///< Interior: index of the second child
+    };
+    uint16_t numPrimitives = 0;         ///< Number of primitives (0 for interior nodes)
+    uint8_t axis = 0;                   ///< Split axis of interior nodes
+    uint8_t pad = 0;
 
-    bool intersect(const Ray3f &ray, HitInfo &hit) const override;
+    bool isLeaf() const {return numPrimitives > 0;}
+};
+
+static_assert(sizeof(BBHLinearNode) == 32, "BBHLinearNode should be 32 bytes");
+
+/**
+    Adapts a per-primitive intersection test into a leaf test.
 
-    Box3f localBBox() const override { return m_bounds; }
-    Box3f worldBBox() const override { return m_bounds; }
+    Hierarchies hand whole leaves to a callable with signature
+    bool(uint32_t first, uint32_t count, Ray3f & ray, HitInfo & hit), which
+    intersects the ray with the primitives in slots [first, first + count),
+    shortens \c ray.maxt to the closest hit and returns whether it found one.
+    This runs a test with signature bool(uint32_t, const Ray3f &, HitInfo &)
+    for each primitive in turn.
+ */
+template <typename PrimitiveFunc>
+struct BBHEachPrimitive
+{
+    PrimitiveFunc & intersectPrimitive;
+
+    bool operator()(uint32_t first, uint32_t count, Ray3f & ray, HitInfo & hit) const
+    {
+        bool hitSomething = false;
+        for (uint32_t i = first; i < first + count; ++i)
+        {
+            if (intersectPrimitive(i, ray, hit))
+            {
+                hitSomething = true;
+                ray.maxt = hit.t;
+            }
+        }
+        return hitSomething;
+    }
 };
 
-/// An axis-aligned bounding box hierarchy acceleration structure
-class BBH: public SurfaceGroup
+/**
+    Adapts a per-primitive occlusion test into a leaf test.
+
+    Leaf occlusion tests have signature bool(uint32_t first, uint32_t count,
+    const Ray3f & ray). This runs a test with signature
+    bool(uint32_t, const Ray3f &) for each primitive until one is hit.
+ */
+template <typename PrimitiveFunc>
+struct BBHAnyPrimitive
 {
-    shared_ptr<BBHNode> m_root;
+    PrimitiveFunc & occludedPrimitive;
 
+    bool operator()(uint32_t first, uint32_t count, const Ray3f & ray) const
+    {
+        for (uint32_t i = first; i < first + count; ++i)
+            if (occludedPrimitive(i, ray))
+                return true;
+        return false;
+    }
+};
+
+/**
+    A flattened bounding box hierarchy over an indexed set of primitives.
+
+    This class only deals with primitive bounds and indices, so it can be
+    shared by any aggregate that needs to accelerate ray queries against a
+    list of primitives.
+ */
+class BBHTree
+{
+public:
+    /// The maximum depth of the hierarchy (and size of the traversal stack)
+    static constexpr int MaxDepth = 64;
+
+    /**
+        Build the hierarchy over primitives with the given bounds.
+
+        On return, \ref order holds the primitive indices in the order the
+        leaves reference them, i.e. leaf primitive \c i is the primitive
+        with input index \c order[i].
+
+        Subtrees are built as parallel tasks, and the top levels bin and
+        partition their primitives in parallel. The resulting hierarchy does
+        not depend on the number of threads.
+
+        With \ref BBHSettings::spatialSplits, nodes may instead split the
+        primitives that straddle a plane into both children (see
+        \ref BBHSplitFunction; without \c splitPrimitive their bounds are
+        simply clipped). A primitive can then be referenced by several
+        leaves, so \c order may contain up to \ref BBHSettings::maxDuplication
+        times as many entries as there are primitives. Such builds run
+        serially.
+     */
+    BBHBuildStats build(const vector<Box3f> & bounds, const BBHSettings & settings,
+               Progress & progress, vector<uint32_t> & order,
+               const BBHSplitFunction & splitPrimitive = BBHSplitFunction());
+
+    /// Release the nodes of the hierarchy
+    void clear();
+
+    bool empty() const {return m_numNodes == 0;}
+
+    /// The nodes of the hierarchy in depth-first order
+    const BBHLinearNode * nodes() const {return m_nodes;}
+    size_t numNodes() const {return m_numNodes;}
+
+    /// Bounds of the whole hierarchy
+    Box3f bounds() const {return empty() ? Box3f() : m_nodes[0].bounds;}
+
+    /**
+        Recompute the bounds of all nodes bottom-up, in linear time, after
+        the primitives moved.
+
+        \c bounds holds the new bounds of each leaf primitive slot (i.e.
+        indexed like \c order in \ref build). The topology of the hierarchy
+        is kept, so its quality degrades as primitives move further.
+     */
+    void refit(const vector<Box3f> & bounds);
+
+    /// Replace the hierarchy by nodes constructed elsewhere (in depth-first order)
+    void setNodes(vector<BBHLinearNode> nodes);
+
+    /**
+        Replace the hierarchy by nodes stored in a memory-mapped file.
+
+        The nodes are used in place, and \c mapping is kept alive for as long
+        as the hierarchy uses them.
+     */
+    void setNodes(shared_ptr<const MappedFile> mapping, const BBHLinearNode * nodes, size_t numNodes);
+
+    /// Return the expected cost of tracing a random ray through the hierarchy
+    float sahCost(const BBHSettings & settings) const;
+
+    /**
+        Return statistics about the quality of the hierarchy as JSON.
+
+        Besides the SAH cost, this counts the nodes, leaves and primitive
+        references, and histograms the depths of the leaves and the number of
+        primitives per leaf. "overlap" sums the surface area shared by the
+        two children of each interior node, relative to the area of the
+        root: like the SAH cost, it estimates how often a random ray has to
+        visit both children.
+     */
+    json statistics(const BBHSettings & settings) const;
+
+    /**
+        Intersect a ray against the hierarchy.
+
+        Nodes are visited front-to-back: at each interior node the child on
+        the near side of the split plane (according to the sign of the ray
+        direction along the split axis) is visited first while the far child
+        is pushed onto a stack together with its entry distance. The ray is
+        shortened whenever a closer hit is found, so subtrees that start
+        beyond the current hit are skipped without being visited.
+
+        \param intersectPrimitive
+            Callable with signature bool(uint32_t, const Ray3f &, HitInfo &)
+            which intersects the ray with the primitive in the given (leaf
+            order) slot
+     */
+    template <typename PrimitiveFunc>
+    bool intersect(const Ray3f &ray, HitInfo &hit, PrimitiveFunc && intersectPrimitive) const
+    {
+        typedef typename std::remove_reference<PrimitiveFunc>::type Func;
+        return intersectLeaves(ray, hit, BBHEachPrimitive<Func>{intersectPrimitive});
+    }
+
+    /**
+        Intersect a ray against the hierarchy, testing whole leaves at once.
+
+        Like \ref intersect, but \c intersectLeaf is called once per visited
+        leaf (see \ref BBHEachPrimitive for its signature), so that it can
+        test all primitives of the leaf together.
+     */
+    template <typename LeafFunc>
+    bool intersectLeaves(const Ray3f &ray, HitInfo &hit, LeafFunc && intersectLeaf) const
+    {
+        float tNear = ray.mint, tFar = ray.maxt;
+        if (empty() || !m_nodes[0].bounds.intersect(PrecomputedRay3f(ray), tNear, tFar))
+            return false;
+
+        return intersectSubtree(0, ray, hit, intersectLeaf);
+    }
+
+    /**
+        Intersect a packet of rays against the hierarchy.
+
+        All active rays of the packet share a single traversal stack. Each
+        visited node is tested against all active rays at once, and only the
+        rays that hit the node (given their closest hits so far) continue
+        into its subtree. Children are visited in the front-to-back order of
+        the first active ray. Once fewer than \ref MinPacketRays rays remain
+        active, the packet has diverged and the remaining rays finish the
+        subtree one at a time.
+
+        \param intersectPrimitives
+            Callable with signature uint32_t(uint32_t, RayPacket &, uint32_t,
+            HitInfo *) which intersects the masked rays of the packet with
+            the primitive in the given slot (see \ref SurfaceBase::intersectPacket)
+        \param intersectPrimitive
+            Single-ray primitive test as in \ref intersect
+        \return A bit mask of the rays that hit a primitive
+     */
+    template <typename PacketFunc, typename PrimitiveFunc>
+    uint32_t intersectPacket(RayPacket &packet, uint32_t activeMask, HitInfo *hits,
+                             PacketFunc && intersectPrimitives,
+                             PrimitiveFunc && intersectPrimitive) const
+    {
+        if (empty())
+            return 0;
+
+        struct StackEntry
+        {
+            uint32_t node;
+            uint32_t mask;
+        };
+        typedef typename std::remove_reference<PrimitiveFunc>::type Func;
+        BBHEachPrimitive<Func> intersectLeaf{intersectPrimitive};
+
+        StackEntry stack[MaxDepth + 1];
+        int stackSize = 0;
+        stack[stackSize++] = {0, activeMask};
+        uint32_t hitMask = 0;
+        while (stackSize > 0)
+        {
+            StackEntry entry = stack[--stackSize];
+            const BBHLinearNode & node = m_nodes[entry.node];
+
+            // rays that miss the node, or already hit something closer, drop out
+            uint32_t mask = intersectPacketBounds(node.bounds, packet, entry.mask);
+            if (!mask)
+                continue;
+
+            if (popCount(mask) < MinPacketRays)
+            {
+                // the packet has diverged: finish this subtree one ray at a time
+                for (int i = 0; i < packet.size; ++i)
+                {
+                    if ((mask & (1u << i)) &&
+                        intersectSubtree(entry.node, packet.ray(i), hits[i], intersectLeaf))
+                    {
+                        packet.maxt[i] = hits[i].t;
+                        hitMask |= 1u << i;
+                    }
+                }
+            }
+            else if (node.isLeaf())
+            {
+                for (uint32_t i = node.primitivesOffset;
+                     i < node.primitivesOffset + node.numPrimitives; ++i)
+                    hitMask |= intersectPrimitives(i, packet, mask, hits);
+            }
+            else
+            {
+                nodes_visited += popCount(mask);
+                int first = 0;
+                while (!(mask & (1u << first)))
+                    ++first;
+
+                uint32_t nearChild = entry.node + 1, farChild = node.secondChildOffset;
+                if (packet.d[node.axis][first] < 0.f)
+                    std::swap(nearChild, farChild);
+                stack[stackSize++] = {farChild, mask};
+                stack[stackSize++] = {nearChild, mask};
+            }
+        }
+
+        return hitMask;
+    }
+
+    /**
+        Intersect a ray against the subtree rooted at node \c root, whose
+        bounds the ray is known to intersect. See \ref intersectLeaves.
+     */
+    template <typename LeafFunc>
+    bool intersectSubtree(uint32_t root, const Ray3f &_ray, HitInfo &hit, LeafFunc && intersectLeaf) const
+    {
+        // copy the ray so we can shorten it as we find closer hits
+        Ray3f ray = _ray;
+        bool hitSomething = false;
+        PrecomputedRay3f rd(ray);
+
+        struct StackEntry
+        {
+            uint32_t node;
+            float tNear;
+        };
+        StackEntry stack[MaxDepth];
+        int stackSize = 0;
+        uint32_t current = root;
+        while (true)
+        {
+            const BBHLinearNode & node = m_nodes[current];
+            if (node.isLeaf())
+            {
+                if (intersectLeaf(node.primitivesOffset, node.numPrimitives, ray, hit))
+                    hitSomething = true;
+            }
+            else
+            {
+                INCREMENT_NODES_VISITED;
+                uint32_t nearChild = current + 1, farChild = node.secondChildOffset;
+                if (rd.dirIsNeg[node.axis])
+                    std::swap(nearChild, farChild);
+
+                float tNearChild = ray.mint, tFarChild = ray.mint, tExit = ray.maxt;
+                bool hitNear = m_nodes[nearChild].bounds.intersect(rd, tNearChild, tExit);
+                tExit = ray.maxt;
+                bool hitFar = m_nodes[farChild].bounds.intersect(rd, tFarChild, tExit);
+                if (hitNear)
+                {
+                    if (hitFar)
+                        stack[stackSize++] = {farChild, tFarChild};
+                    current = nearChild;
+                    continue;
+                }
+                else if (hitFar)
+                {
+                    current = farChild;
+                    continue;
+                }
+            }
+
+            // pop the next subtree that still starts before the closest hit
+            while (stackSize > 0 && stack[stackSize-1].tNear > ray.maxt)
+                --stackSize;
+            if (stackSize == 0)
+                break;
+            current = stack[--stackSize].node;
+        }
+
+        return hitSomething;
+    }
+
+    /**
+        Determine whether the ray hits any primitive in the hierarchy.
+
+        Traversal stops as soon as any intersection is found.
+
+        \param occludedPrimitive
+            Callable with signature bool(uint32_t, const Ray3f &) which
+            returns whether the ray hits the primitive in the given slot
+     */
+    template <typename PrimitiveFunc>
+    bool occluded(const Ray3f &ray, PrimitiveFunc && occludedPrimitive) const
+    {
+        typedef typename std::remove_reference<PrimitiveFunc>::type Func;
+        return occludedLeaves(ray, BBHAnyPrimitive<Func>{occludedPrimitive});
+    }
+
+    /// Like \ref occluded, but testing whole leaves at once (see \ref BBHAnyPrimitive)
+    template <typename LeafFunc>
+    bool occludedLeaves(const Ray3f &ray, LeafFunc && occludedLeaf) const
+    {
+        if (empty())
+            return false;
+
+        PrecomputedRay3f rd(ray);
+        uint32_t stack[MaxDepth];
+        int stackSize = 0;
+        uint32_t current = 0;
+        while (true)
+        {
+            const BBHLinearNode & node = m_nodes[current];
+            float tMin = ray.mint, tMax = ray.maxt;
+            if (node.bounds.intersect(rd, tMin, tMax))
+            {
+                if (!node.isLeaf())
+                {
+                    INCREMENT_NODES_VISITED;
+                    stack[stackSize++] = node.secondChildOffset;
+                    current = current + 1;
+                    continue;
+                }
+
+                if (occludedLeaf(node.primitivesOffset, node.numPrimitives, ray))
+                    return true;
+            }
+
+            if (stackSize == 0)
+                return false;
+            current = stack[--stackSize];
+        }
+    }
+
+    /// Packets with fewer active rays than this are traced one ray at a time
+    static constexpr int MinPacketRays = 4;
+
+private:
+    /// Return the rays in \c activeMask that intersect \c box before their closest hit
+    static uint32_t intersectPacketBounds(const Box3f & box, const RayPacket & packet, uint32_t activeMask)
+    {
+        bool hit[RayPacket::MaxSize];
+        for (int i = 0; i < packet.size; ++i)
+        {
+            float tMin = packet.mint[i], tMax = packet.maxt[i];
+            for (int a = 0; a < 3; ++a)
+            {
+                float t0 = (box.pMin[a] - packet.o[a][i]) * packet.invD[a][i];
+                float t1 = (box.pMax[a] - packet.o[a][i]) * packet.invD[a][i];
+                float tNear = t0 < t1 ? t0 : t1, tFar = t0 < t1 ? t1 : t0;
+                // NaNs (from 0 * inf) leave the current interval unchanged
+                tMin = tNear > tMin ? tNear : tMin;
+                tMax = tFar < tMax ? tFar : tMax;
+            }
+            hit[i] = tMin <= tMax;
+        }
+
+        uint32_t mask = 0;
+        for (int i = 0; i < packet.size; ++i)
+            mask |= uint32_t(hit[i]) << i;
+        return mask & activeMask;
+    }
+
+    vector<BBHLinearNode> m_storage;            ///< Nodes built in memory
+    shared_ptr<const MappedFile> m_mapping;     ///< File the nodes are mapped from, if any
+    const BBHLinearNode * m_nodes = nullptr;    ///< Either m_storage.data() or a pointer into m_mapping
+    size_t m_numNodes = 0;
+};
+
+/**
+    An axis-aligned bounding box hierarchy acceleration structure
+
+    The hierarchy is configured through the "accelerator" block of the scene:
+    \code
+        "accelerator": {"type": "bbh", "split": "sah", "max_leaf_size": 4, "bins": 16}
+    \endcode
+    "split" selects either the random-axis "median" splitter (the default) or a
+    binned surface-area-heuristic ("sah") builder. Setting "width" to 4 or 8
+    collapses the binary hierarchy into a wide BBH whose nodes are
+    intersected with a single SIMD slab test. "threads" limits the number of
+    threads used for construction (by default, all hardware threads).
+
+    Nodes with at most "max_leaf_size" primitives become leaves. With
+    "sah_leaves": true, this is only an upper bound, and the SAH builder
+    still splits such nodes if that is predicted to be cheaper than testing
+    all of their primitives, given "traversal_cost" (the cost of a node
+    relative to a primitive). Leaf primitives are always stored contiguously,
+    so owners such as \ref Mesh test each leaf in a single linear scan.
+
+    For very large scenes, "quantized": true (with a "width" of 4 or 8)
+    stores the child bounds of the wide nodes as 8-bit offsets within their
+    parent (see \ref BBHQuantizedNode), and releases the binary hierarchy
+    once the wide one is built. This roughly halves the node memory of the
+    wide hierarchy and removes that of the binary one, at the price of
+    slightly looser bounds. Packets are then traced one ray at a time, and
+    moving children rebuild the hierarchy instead of refitting it.
+
+    Wide nodes are stored in depth-first order. "layout": "treelet"
+    instead groups them into treelets of the nodes most likely to be visited
+    together, according to their surface areas, each within a single memory
+    page, so that rays touch fewer cache lines and pages. (The binary
+    hierarchy always stores the first child of each node right after it.)
+
+    Large or thin primitives whose bounds overlap badly (e.g. the walls of
+    architectural scenes) degrade any partition of the primitives. The SAH
+    builder can then also split nodes at spatial planes, referencing the
+    primitives that straddle the plane from both children:
+    \code
+        "accelerator": {"type": "bbh", "split": "sah", "spatial_splits": true, "max_duplication": 1.5}
+    \endcode
+    "max_duplication" bounds the total number of references relative to the
+    number of primitives.
+
+    When children move (see \ref refit), the hierarchy is refit in linear
+    time instead of being rebuilt, until its SAH cost exceeds
+    "rebuild_threshold" (2 by default, 0 to never rebuild) times its cost
+    after the last build.
+
+    With "cache": "directory" (or true, for "bvh_cache" next to the scene
+    file), built hierarchies are stored on disk and memory-mapped by later
+    runs over the same primitives and parameters instead of being rebuilt
+    (see bbhcache.h). Since cached hierarchies are identified by the bounds
+    of their primitives, this cannot be combined with "spatial_splits",
+    which also depend on the shape of the primitives within their bounds.
+
+    The children are reordered during \ref build so that the primitives of
+    each leaf are stored contiguously, and a BBH can also index primitives
+    that are not child surfaces, such as the faces of a \ref Mesh (see
+    \ref Accelerator).
+ */
+class BBH: public Accelerator
+{
 public:
     BBH(const Scene & scene, const json & j = json::object());
+    ~BBH() override;
+
+    /**
+        Statistics of the hierarchy built by \ref buildPrimitives
+        (see \ref BBHTree::statistics), including the settings it was built
+        with and the memory of the nodes kept for traversal ("node_bytes").
+     */
+    json treeStats() const override;
+
+    vector<std::pair<uint32_t, uint32_t>> leafRanges() const override;
+
+    /**
+        Build the hierarchy over primitives with the given bounds.
+
+        On return, leaf primitive \c i is the primitive with input index
+        \c order[i] (see \ref BBHTree::build). Owners that can clip their
+        primitives to a plane should pass \c splitPrimitive, which tightens
+        the bounds of spatial splits.
+     */
+    void buildPrimitives(const vector<Box3f> & bounds, vector<uint32_t> & order,
+                         const BBHSplitFunction & splitPrimitive = BBHSplitFunction()) override;
+
+    /**
+        Refit the hierarchy built by \ref buildPrimitives to new primitive
+        bounds, given per leaf slot (see \ref BBHTree::refit).
+
+        \return \c false if refitting raised the SAH cost of the hierarchy
+                beyond "rebuild_threshold" times its cost when it was built,
+                in which case the owner should rebuild it
+     */
+    bool refitPrimitives(const vector<Box3f> & bounds) override;
+
+protected:
+    /**
+        Build \ref m_tree over primitives with the given bounds (see
+        \ref BBHTree::build). Derived classes may override this to construct
+        the hierarchy with a different algorithm.
+     */
+    virtual BBHBuildStats buildTree(const vector<Box3f> & bounds, Progress & progress,
+                                    vector<uint32_t> & order, const BBHSplitFunction & splitPrimitive);
 
-    /// Construct the BBH (must be called before @ref intersect)
-    void build() override;
+    /// Collapse \ref m_tree into the wide hierarchy selected by m_settings.width, if any, and traverse it
+    void collapseTree();
 
-    /// Intersect a ray against all surfaces registered with the Accelerator
-    bool intersect(const Ray3f &ray, HitInfo &hit) const override;
+    BBHTree m_tree;
+    shared_ptr<BBHWideTree<4>> m_tree4;     ///< Only built if m_settings.width == 4
+    shared_ptr<BBHWideTree<8>> m_tree8;     ///< Only built if m_settings.width == 8
+    shared_ptr<BBHWideTree<4, true>> m_quantizedTree4;  ///< Built instead of m_tree4 if m_settings.quantized
+    shared_ptr<BBHWideTree<8, true>> m_quantizedTree8;  ///< Built instead of m_tree8 if m_settings.quantized
+    json m_releasedTreeStats;               ///< Statistics of m_tree, if it was released for a quantized hierarchy
+    BBHSettings m_settings;
+    string m_cacheDirectory;                ///< Where built hierarchies are cached (empty to disable caching)
+    string m_cacheParameters;               ///< Accelerator parameters that identify a cached hierarchy
+    float m_builtCost = 0.f;                ///< SAH cost of m_tree when it was last built
+    float m_rebuildThreshold = 2.f;         ///< Relative SAH cost increase that triggers a rebuild (0 to never rebuild)
 };
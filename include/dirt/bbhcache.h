@@ -0,0 +1,57 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <dirt/bbh.h>
+
+/**
+    \file
+    Persistent on-disk cache of built BBHs.
+
+    A cache file stores the nodes of a \ref BBHTree together with the order
+    of the primitives its leaves reference. It is identified by a key that
+    hashes the accelerator parameters and the bounds of all primitives,
+    which captures the mesh files, transforms and everything else the
+    hierarchy depends on. Cache files are memory-mapped when loaded, and the
+    nodes are used in place.
+
+    Loading is not lazy: before a file is used, the whole file is checksummed,
+    every node is checked to link only within the file and to lie no deeper
+    than \ref BBHTree::MaxDepth, and the order is checked to reference every
+    primitive, all in a single pass over the file. What the mapping saves is
+    building the hierarchy and copying its nodes to the heap, and concurrent
+    renders share its pages.
+ */
+
+/// Return the cache key of a hierarchy built with \c parameters over primitives with the given bounds
+uint64_t bbhCacheKey(const string & parameters, const vector<Box3f> & bounds);
+
+/**
+    Load a hierarchy from the cache file \c filename.
+
+    \return \c false (leaving \c tree and \c order untouched) if the file does
+            not exist, or was written for a different key or number of
+            primitives
+ */
+bool loadBBHCache(const string & filename, uint64_t key, size_t numPrimitives,
+                  BBHTree & tree, vector<uint32_t> & order);
+
+/// Write a hierarchy over \c numPrimitives primitives to the cache file \c filename, and return whether this succeeded
+bool saveBBHCache(const string & filename, uint64_t key, size_t numPrimitives,
+                  const BBHTree & tree, const vector<uint32_t> & order);
@@ -60,6 +60,20 @@ struct Box
     Vec<N,T> center() const { return (pMin + pMax) / T(2);}
     Vec<N,T> diagonal() const { return pMax - pMin; }
 
+    /// Return the surface area of the box (sum of all pairwise face areas)
+    T surfaceArea() const
+    {
+        if (isEmpty())
+            return T(0);
+
+        Vec<N,T> d = diagonal();
+        T area = T(0);
+        for (size_t i = 0; i < N; ++i)
+            for (size_t j = i + 1; j < N; ++j)
+                area += d[i] * d[j];
+        return T(2) * area;
+    }
+
     /**
         Compute the intersection of a Ray with an Box
 
@@ -69,23 +83,48 @@ struct Box
     */
     bool intersect(const Ray<N,T> &ray) const
     {
-        T minT = ray.mint;
-        T maxT = ray.maxt;
+        T tNear;
+        return intersect(ray, tNear);
+    }
+
+    /**
+        Compute the intersection of a Ray with an Box
+
+        \param ray 		The ray along which to check for intersection
+        \param tNear     Set to the ray parameter at which the ray enters the box
+                        (clamped to the ray's [mint, maxt] segment)
+        \return 		\c true if there is an intersection
+    */
+    bool intersect(const Ray<N,T> &ray, T &tNear) const
+    {
+        T tFar = ray.maxt;
+        tNear = ray.mint;
+        return intersect(PrecomputedRay<N,T>(ray), tNear, tFar);
+    }
 
+    /// Return the lower (0) or upper (1) corner of the box
+    const Vec<N,T> & operator[](int i) const { return i ? pMax : pMin; }
+
+    /**
+        Clip a segment of a precomputed ray to the box, without branches or
+        divisions.
+
+        \param ray       The ray along which to check for intersection
+        \param tMin      The start of the segment, set to where it enters the box
+        \param tMax      The end of the segment, set to where it leaves the box
+        \return         \c true if the clipped segment is not empty
+    */
+    bool intersect(const PrecomputedRay<N,T> &ray, T &tMin, T &tMax) const
+    {
         for (size_t i = 0; i < N; ++i)
         {
-            T invD = T(1) / ray.d[i];
-            T t0 = (pMin[i] - ray.o[i]) * invD;
-            T t1 = (pMax[i] - ray.o[i]) * invD;
-            if (invD < 0.0f)
-                std::swap(t0, t1);
-
-            minT = t0 > minT ? t0 : minT;
-            maxT = t1 < maxT ? t1 : maxT;
-            if (maxT < minT)
-                return false;
+            T t0 = ((*this)[ray.dirIsNeg[i]][i] - ray.o[i]) * ray.invD[i];
+            T t1 = ((*this)[1 - ray.dirIsNeg[i]][i] - ray.o[i]) * ray.invD[i];
+            // NaNs (from 0 * inf) leave the current interval unchanged
+            tMin = t0 > tMin ? t0 : tMin;
+            tMax = t1 < tMax ? t1 : tMax;
         }
-        return true;
+        return tMin <= tMax;
     }
 };
 
@@ -109,6 +109,28 @@ inline float min(float a, float b)
     return (a < b) ? a : b;
 }
 
+/// Return the number of bits set in \c mask
+inline int popCount(uint32_t mask)
+{
+    int count = 0;
+    for (; mask; mask &= mask - 1)
+        ++count;
+    return count;
+}
+
+/// Return the index of the lowest bit set in \c mask (which must not be zero)
+inline int lowestBit(uint32_t mask)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    int index = 0;
+    for (; !(mask & 1u); mask >>= 1)
+        ++index;
+    return index;
+#endif
+}
+
 
 /**
     Clamps a value between two bounds.
@@ -339,9 +361,11 @@ filesystem::resolver & getFileResolver();
 // Acceleration structure stats parameters
 extern uint64_t intersection_tests;
 extern uint64_t rays_traced;
+extern uint64_t nodes_visited;          ///< Interior nodes of acceleration structures visited by rays
 
 #define INCREMENT_INTERSECTION_TESTS intersection_tests++
 #define INCREMENT_TRACED_RAYS rays_traced++
+#define INCREMENT_NODES_VISITED nodes_visited++
 
 
 
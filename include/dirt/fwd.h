@@ -20,6 +20,7 @@
 #pragma once
 
 // Forward declarations
+class Accelerator;
 class Background;
 class BBH;
 class Camera;
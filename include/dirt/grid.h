@@ -0,0 +1,265 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <dirt/bbh.h>
+
+/// Parameters controlling how a \ref UniformGrid is constructed
+struct GridSettings
+{
+    /// Target number of cells per primitive of the top-level grid
+    float density = 4.f;
+    /// Maximum number of cells along each axis of a grid
+    int maxResolution = 256;
+    /// Whether to refine dense cells by a nested grid
+    bool refine = false;
+    /// Cells that reference more primitives than this are refined (if \ref refine)
+    int refineThreshold = 16;
+    /// Target number of cells per primitive of nested grids
+    float nestedDensity = 1.f;
+    /// Cost of stepping to the next cell relative to a primitive test
+    float traversalCost = 0.125f;
+};
+
+/// A cell of a \ref UniformGrid
+struct GridCell
+{
+    /// Flag in \ref count marking cells that are refined by a nested grid
+    static constexpr uint32_t Refined = 1u << 31;
+
+    uint32_t offset;    ///< First primitive slot, or index of the nested grid if refined
+    uint32_t count;     ///< Number of primitives, or \ref Refined
+
+    bool isRefined() const {return count == Refined;}
+};
+
+/**
+    A uniform grid over primitives given by their bounds, with an optional
+    second level of grids nested in its densest cells.
+
+    The resolution is chosen so that the grid has about "density" cells per
+    primitive, with roughly cubical cells, and every primitive is referenced
+    by all cells its bounds overlap. Cells are filled with two counting
+    passes over the primitives, so the grid builds in linear time. Like
+    \ref BBHTree, slot \c i references primitive \c order[i], and the
+    primitives of each cell are stored contiguously.
+
+    Rays step through the cells they cross in front-to-back order with a
+    3D-DDA, and stop as soon as they found a hit inside the current cell.
+    This suits scenes of many similarly sized primitives, such as particles,
+    where the cells stay evenly filled.
+ */
+class UniformGrid
+{
+public:
+    /**
+        Build the grid over primitives with the given bounds.
+
+        \param order
+            On return, slot \c i references the primitive with input index
+            \c order[i]. Primitives that overlap several cells appear once
+            per cell.
+     */
+    BBHBuildStats build(const vector<Box3f> & bounds, const GridSettings & settings, Progress & progress,
+                        vector<uint32_t> & order);
+
+    void clear();
+    bool empty() const {return m_levels.empty();}
+
+    /// The cells of all grids, the top-level grid first
+    const vector<GridCell> & cells() const {return m_cells;}
+
+    /// Number of grids (the top-level grid and its nested grids)
+    size_t numGrids() const {return m_levels.size();}
+
+    /// Memory used by the cells and grids
+    size_t bytes() const {return m_cells.size() * sizeof(GridCell) + m_levels.size() * sizeof(Level);}
+
+    /// Return statistics about the grid, with the same keys as \ref BBHTree::statistics
+    json statistics(const GridSettings & settings) const;
+
+    /// Append the primitive range (first, count) of every non-empty cell to \c leaves, in primitive order
+    void leafRanges(vector<std::pair<uint32_t, uint32_t>> & leaves) const;
+
+    /// Intersect a ray against the grid, testing whole cells at once (see \ref BBHTree::intersectLeaves)
+    template <typename LeafFunc>
+    bool intersectLeaves(const Ray3f &_ray, HitInfo &hit, LeafFunc && intersectLeaf) const
+    {
+        PrecomputedRay3f rd(_ray);
+        float tMin = _ray.mint, tMax = _ray.maxt;
+        if (empty() || !m_levels[0].bounds.intersect(rd, tMin, tMax))
+            return false;
+
+        // copy the ray so we can shorten it as we find closer hits
+        Ray3f ray = _ray;
+        bool hitSomething = false;
+        traverse(m_levels[0], rd, tMin, tMax, [&](const GridCell & cell, float tExit)
+        {
+            if (intersectLeaf(cell.offset, cell.count, ray, hit))
+                hitSomething = true;
+            // cells are visited front to back, so a hit inside this cell is final
+            return ray.maxt <= tExit;
+        });
+        return hitSomething;
+    }
+
+    /// Determine whether the ray hits any primitive, testing whole cells at once (see \ref BBHTree::occludedLeaves)
+    template <typename LeafFunc>
+    bool occludedLeaves(const Ray3f &ray, LeafFunc && occludedLeaf) const
+    {
+        PrecomputedRay3f rd(ray);
+        float tMin = ray.mint, tMax = ray.maxt;
+        if (empty() || !m_levels[0].bounds.intersect(rd, tMin, tMax))
+            return false;
+
+        return traverse(m_levels[0], rd, tMin, tMax, [&](const GridCell & cell, float)
+        {
+            return occludedLeaf(cell.offset, cell.count, ray);
+        });
+    }
+
+private:
+    /// The top-level grid, or a grid nested in one of its cells
+    struct Level
+    {
+        Box3f bounds;
+        Vec3f cellSize;
+        Vec3f invCellSize;
+        int resolution[3];
+        uint32_t firstCell;     ///< Index of the first cell of this grid in m_cells
+
+        /// Cell containing coordinate x along axis a, clamped to the grid
+        int cellIndex(float x, int a) const
+        {
+            int c = int((x - bounds.pMin[a]) * invCellSize[a]);
+            return c < 0 ? 0 : (c >= resolution[a] ? resolution[a] - 1 : c);
+        }
+    };
+
+    /**
+        Step through the cells of a grid that the ray crosses between
+        \c tMin and \c tMax with a 3D-DDA, descending into nested grids, and
+        call visit(cell, tExit) on every non-empty cell, where \c tExit is
+        the distance at which the ray leaves it.
+
+        \return \c true as soon as \c visit returns \c true
+     */
+    template <typename VisitFunc>
+    bool traverse(const Level & level, const PrecomputedRay3f & rd, float tMin, float tMax, VisitFunc && visit) const
+    {
+        int cell[3], step[3], end[3];
+        float tNext[3];
+        for (int a = 0; a < 3; ++a)
+        {
+            // the entry point, from o + tMin / invD
+            cell[a] = level.cellIndex(rd.o[a] + tMin / rd.invD[a], a);
+            if (std::isinf(rd.invD[a]))
+            {
+                step[a] = 0;
+                end[a] = -1;
+            }
+            else
+            {
+                step[a] = rd.dirIsNeg[a] ? -1 : 1;
+                end[a] = rd.dirIsNeg[a] ? -1 : level.resolution[a];
+            }
+            tNext[a] = nextCrossing(level, rd, cell[a], step[a], a);
+        }
+
+        while (true)
+        {
+            int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+            float tExit = tNext[axis] < tMax ? tNext[axis] : tMax;
+
+            INCREMENT_NODES_VISITED;
+            const GridCell & c = m_cells[level.firstCell +
+                                         (cell[2] * level.resolution[1] + cell[1]) * level.resolution[0] + cell[0]];
+            if (c.isRefined())
+            {
+                const Level & nested = m_levels[c.offset];
+                float t0 = tMin, t1 = tExit;
+                if (nested.bounds.intersect(rd, t0, t1) && traverse(nested, rd, t0, t1, visit))
+                    return true;
+            }
+            else if (c.count > 0 && visit(c, tExit))
+                return true;
+
+            if (tNext[axis] >= tMax)
+                return false;
+            cell[axis] += step[axis];
+            if (cell[axis] == end[axis])
+                return false;
+            tMin = tNext[axis];
+            tNext[axis] = nextCrossing(level, rd, cell[axis], step[axis], axis);
+        }
+    }
+
+    /// Distance at which the ray crosses the boundary of a cell along one axis
+    static float nextCrossing(const Level & level, const PrecomputedRay3f & rd, int cell, int step, int a)
+    {
+        if (step == 0)
+            return std::numeric_limits<float>::infinity();
+        float plane = level.bounds.pMin[a] + (cell + (step > 0 ? 1 : 0)) * level.cellSize[a];
+        return (plane - rd.o[a]) * rd.invD[a];
+    }
+
+    vector<GridCell> m_cells;
+    vector<Level> m_levels;     ///< The top-level grid, then the nested grids
+};
+
+/**
+    A grid acceleration structure (see \ref UniformGrid)
+
+    \code
+        "accelerator": {"type": "grid", "density": 4, "refine": false}
+    \endcode
+    "density" is the target number of cells per primitive, and
+    "max_resolution" limits the number of cells along each axis.
+
+    With "refine", the grid becomes a two-level grid: the top-level grid is
+    coarse (by default, with about one cell per "refine_threshold"
+    primitives, 16 by default), and cells that reference more than
+    "refine_threshold" primitives are subdivided by a nested grid with
+    "nested_density" cells per primitive (1 by default), if that lowers the
+    expected number of primitive tests. This adapts to scenes with uneven
+    detail, where a single grid would either waste cells on empty space or
+    leave dense regions in few cells.
+
+    "traversal_cost" is the cost of stepping to the next cell relative to a
+    primitive test, which decides whether refining a cell pays off.
+
+    The grid builds in linear time, so it is also a good choice for scenes
+    that are rendered only once. Meshes can build it over their faces like
+    any other \ref Accelerator. Packets are traced one ray at a time, and
+    moving children rebuild the grid.
+ */
+class GridAccelerator : public Accelerator
+{
+public:
+    GridAccelerator(const Scene & scene, const json & j = json::object());
+
+    void buildPrimitives(const vector<Box3f> & bounds, vector<uint32_t> & order,
+                         const BBHSplitFunction & splitPrimitive = BBHSplitFunction()) override;
+    vector<std::pair<uint32_t, uint32_t>> leafRanges() const override;
+    json treeStats() const override;
+
+private:
+    UniformGrid m_grid;
+    GridSettings m_gridSettings;
+};
@@ -0,0 +1,69 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <dirt/mesh.h>
+
+/**
+    A transformed copy of a named mesh.
+
+    Meshes listed in the scene's "meshes" array are loaded once, together
+    with their own hierarchy (the bottom level) over their faces in mesh
+    space. An instance references such a mesh by name, and places it in the
+    scene with its own transformation and material:
+
+        "meshes": [{"name": "bunny", "filename": "bunny.obj"}],
+        "surfaces": [{"type": "instance", "mesh": "bunny", "transform": ..., "material": ...}]
+
+    Instances are intersected by transforming the ray into mesh space, so
+    placing a mesh many times costs only one Instance per placement. The
+    scene accelerator acts as the top-level hierarchy over all instances.
+ */
+class Instance : public Surface
+{
+public:
+    Instance(const Scene & scene, const json & j = json::object());
+
+    Box3f localBBox() const override;
+    void setTransform(const Transform & xform) override;
+    bool intersect(const Ray3f &ray, HitInfo &hit) const override;
+    bool intersectCandidate(const Ray3f &ray, HitInfo &hit) const override;
+    void finalizeHit(const Ray3f &ray, HitInfo &hit) const override;
+    bool occluded(const Ray3f &ray) const override;
+    uint32_t intersectPacketCandidates(RayPacket &packet, uint32_t activeMask, HitInfo *hits) const override;
+    bool isEmissive() const override {return m_material && m_material->isEmissive();}
+
+    /**
+        Sample/evaluate directions towards the instance in mesh space.
+
+        Solid angles are preserved by rotations, translations and uniform
+        scales, so these are exact unless the instance is scaled non-uniformly.
+     */
+    Vec3f sample(const Vec3f& o, const Vec2f &sample) const override;
+    float pdf(const Vec3f& o, const Vec3f& v) const override;
+
+protected:
+    /// Transform a hit record found in mesh space to world space
+    void hitToWorld(HitInfo &hit) const;
+
+    shared_ptr<const Mesh> m_mesh;          ///< The instanced mesh
+    Transform m_worldToMesh;                ///< Inverse of m_xform
+    shared_ptr<const Material> m_material;
+    shared_ptr<const MediumInterface> m_medium_interface;
+};
@@ -49,4 +49,30 @@ public:
            An estimate of the radiance in this direction
      */
     virtual Color3f Li(const Scene &scene, Sampler &sampler, const Ray3f &ray) const;
+
+    /**
+        Return whether this integrator can make use of camera ray hits that
+        were found ahead of time (see \ref primaryLi).
+
+        When this returns true, the scene traces camera rays in coherent
+        packets and passes the resulting hits to \ref primaryLi.
+     */
+    virtual bool acceptsPrimaryHits() const {return false;}
+
+    /**
+        Sample the incident radiance along a camera ray whose closest hit has
+        already been computed.
+
+        \param hit
+           The closest intersection along \c ray, or \c nullptr if the ray
+           does not hit the scene
+        \return
+           An estimate of the radiance in this direction
+
+        The base class implementation ignores \c hit and calls \ref Li.
+     */
+    virtual Color3f primaryLi(const Scene &scene, Sampler &sampler, const Ray3f &ray, const HitInfo *hit) const
+    {
+        return Li(scene, sampler, ray);
+    }
 };
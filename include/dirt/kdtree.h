@@ -0,0 +1,260 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <dirt/bbh.h>
+
+/// Parameters controlling how a \ref KdTree is constructed
+struct KdTreeSettings
+{
+    /// Cost of traversing an interior node relative to a primitive test
+    float traversalCost = 1.f / 80.f;
+    /// Fraction of the cost of a split that is waived if one of its sides is empty
+    float emptyBonus = 0.5f;
+    /// Nodes with at most this many primitives become leaves
+    int maxLeafSize = 1;
+    /// Maximum depth of the tree (0 chooses 8 + 1.3 log2(number of primitives))
+    int maxDepth = 0;
+};
+
+/**
+    A node of a \ref KdTree.
+
+    Interior nodes store their splitting plane; their first child (below the
+    plane) directly follows them, and the index of the second child is
+    stored along with the split axis. Leaves store their range of primitive
+    slots.
+ */
+struct KdTreeNode
+{
+    union
+    {
+        float split;                ///< Position of the splitting plane (interior nodes)
+        uint32_t primitivesOffset;  ///< First primitive slot (leaves)
+    };
+    uint32_t flags;                 ///< Split axis, or 3 for leaves, in the low 2 bits; above child or number of primitives in the rest
+
+    bool isLeaf() const {return (flags & 3u) == 3u;}
+    int axis() const {return int(flags & 3u);}
+    uint32_t aboveChild() const {return flags >> 2;}
+    uint32_t numPrimitives() const {return flags >> 2;}
+};
+
+/**
+    A kd-tree over primitives given by their bounds, built with the surface
+    area heuristic.
+
+    Splitting planes are placed at the bounds of the primitives, and
+    primitives that straddle a plane are referenced from both sides. Their
+    bounds are clipped to each side, by the optional \ref BBHSplitFunction,
+    so that the planes can cut close to the actual geometry. Like
+    \ref BBHTree, leaf slot \c i references primitive \c order[i], so the
+    primitives of each leaf can be stored contiguously.
+
+    Rays visit the cells they cross in front-to-back order, and stop as soon
+    as they found a hit before the next cell.
+ */
+class KdTree
+{
+public:
+    /// Maximum depth of any tree (and size of the traversal stack)
+    static constexpr int MaxDepth = 64;
+
+    /**
+        Build the tree over primitives with the given bounds.
+
+        \param order
+            On return, leaf slot \c i references the primitive with input
+            index \c order[i]. Primitives that straddle splitting planes
+            appear once per leaf that references them.
+     */
+    BBHBuildStats build(const vector<Box3f> & bounds, const KdTreeSettings & settings, Progress & progress,
+                        vector<uint32_t> & order, const BBHSplitFunction & splitPrimitive = BBHSplitFunction());
+
+    void clear() {m_nodes.clear(); m_nodes.shrink_to_fit(); m_bounds = Box3f();}
+    bool empty() const {return m_nodes.empty();}
+
+    /// The nodes of the tree in depth-first order
+    const vector<KdTreeNode> & nodes() const {return m_nodes;}
+
+    /// Bounds of the whole tree
+    const Box3f & bounds() const {return m_bounds;}
+
+    /// Return the expected cost of tracing a random ray through the tree
+    float sahCost(const KdTreeSettings & settings) const;
+
+    /// Return statistics about the tree, with the same keys as \ref BBHTree::statistics
+    json statistics(const KdTreeSettings & settings) const;
+
+    /// Append the primitive range (first, count) of every non-empty leaf to \c leaves, in primitive order
+    void leafRanges(vector<std::pair<uint32_t, uint32_t>> & leaves) const;
+
+    /// Intersect a ray against the tree, testing whole leaves at once (see \ref BBHTree::intersectLeaves)
+    template <typename LeafFunc>
+    bool intersectLeaves(const Ray3f &_ray, HitInfo &hit, LeafFunc && intersectLeaf) const
+    {
+        PrecomputedRay3f rd(_ray);
+        float tMin = _ray.mint, tMax = _ray.maxt;
+        if (m_nodes.empty() || !m_bounds.intersect(rd, tMin, tMax))
+            return false;
+
+        // copy the ray so we can shorten it as we find closer hits
+        Ray3f ray = _ray;
+        bool hitSomething = false;
+
+        StackEntry stack[MaxDepth];
+        int stackSize = 0;
+        uint32_t current = 0;
+        while (true)
+        {
+            // cells are visited front to back, so a hit before this cell is final
+            if (ray.maxt < tMin)
+                break;
+
+            const KdTreeNode & node = m_nodes[current];
+            if (!node.isLeaf())
+            {
+                INCREMENT_NODES_VISITED;
+                uint32_t first, second;
+                float tSplit = splitDistance(node, current, rd, first, second);
+
+                if (tSplit > tMax || tSplit <= 0.f)
+                    current = first;
+                else if (tSplit < tMin)
+                    current = second;
+                else
+                {
+                    stack[stackSize++] = {second, tSplit, tMax};
+                    current = first;
+                    tMax = tSplit;
+                }
+                continue;
+            }
+
+            if (node.numPrimitives() > 0 && intersectLeaf(node.primitivesOffset, node.numPrimitives(), ray, hit))
+                hitSomething = true;
+
+            if (stackSize == 0)
+                break;
+            const StackEntry & entry = stack[--stackSize];
+            current = entry.node;
+            tMin = entry.tMin;
+            tMax = entry.tMax;
+        }
+
+        return hitSomething;
+    }
+
+    /// Determine whether the ray hits any primitive, testing whole leaves at once (see \ref BBHTree::occludedLeaves)
+    template <typename LeafFunc>
+    bool occludedLeaves(const Ray3f &ray, LeafFunc && occludedLeaf) const
+    {
+        PrecomputedRay3f rd(ray);
+        float tMin = ray.mint, tMax = ray.maxt;
+        if (m_nodes.empty() || !m_bounds.intersect(rd, tMin, tMax))
+            return false;
+
+        StackEntry stack[MaxDepth];
+        int stackSize = 0;
+        uint32_t current = 0;
+        while (true)
+        {
+            const KdTreeNode & node = m_nodes[current];
+            if (!node.isLeaf())
+            {
+                INCREMENT_NODES_VISITED;
+                uint32_t first, second;
+                float tSplit = splitDistance(node, current, rd, first, second);
+
+                if (tSplit > tMax || tSplit <= 0.f)
+                    current = first;
+                else if (tSplit < tMin)
+                    current = second;
+                else
+                {
+                    stack[stackSize++] = {second, tSplit, tMax};
+                    current = first;
+                    tMax = tSplit;
+                }
+                continue;
+            }
+
+            if (node.numPrimitives() > 0 && occludedLeaf(node.primitivesOffset, node.numPrimitives(), ray))
+                return true;
+
+            if (stackSize == 0)
+                return false;
+            const StackEntry & entry = stack[--stackSize];
+            current = entry.node;
+            tMin = entry.tMin;
+            tMax = entry.tMax;
+        }
+    }
+
+private:
+    struct StackEntry
+    {
+        uint32_t node;
+        float tMin, tMax;
+    };
+
+    /// Distance to the splitting plane of an interior node, and its children in the order the ray crosses them
+    static float splitDistance(const KdTreeNode & node, uint32_t index, const PrecomputedRay3f & rd,
+                               uint32_t & first, uint32_t & second)
+    {
+        int axis = node.axis();
+        bool belowFirst = rd.o[axis] < node.split || (rd.o[axis] == node.split && rd.dirIsNeg[axis]);
+        first = belowFirst ? index + 1 : node.aboveChild();
+        second = belowFirst ? node.aboveChild() : index + 1;
+        return (node.split - rd.o[axis]) * rd.invD[axis];
+    }
+
+    vector<KdTreeNode> m_nodes;
+    Box3f m_bounds;
+};
+
+/**
+    A kd-tree acceleration structure (see \ref KdTree)
+
+    \code
+        "accelerator": {"type": "kdtree", "traversal_cost": 0.0125, "empty_bonus": 0.5, "max_leaf_size": 1}
+    \endcode
+    "traversal_cost" is the cost of a node relative to a primitive test,
+    "empty_bonus" the fraction of the cost of a split that is waived if it
+    cuts off empty space, and "max_depth" limits the depth of the tree (by
+    default, to 8 + 1.3 log2 of the number of primitives).
+
+    Meshes can build it over their faces like any other \ref Accelerator.
+    Packets are traced one ray at a time, and moving children rebuild the
+    tree.
+ */
+class KdTreeAccelerator : public Accelerator
+{
+public:
+    KdTreeAccelerator(const Scene & scene, const json & j = json::object());
+
+    void buildPrimitives(const vector<Box3f> & bounds, vector<uint32_t> & order,
+                         const BBHSplitFunction & splitPrimitive = BBHSplitFunction()) override;
+    vector<std::pair<uint32_t, uint32_t>> leafRanges() const override;
+    json treeStats() const override;
+
+private:
+    KdTree m_kdTree;
+    KdTreeSettings m_kdSettings;
+};
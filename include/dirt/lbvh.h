@@ -0,0 +1,58 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <dirt/bbh.h>
+
+/**
+    A linear bounding box hierarchy (LBVH) built from Morton codes.
+
+    The centroids of all primitives are quantized within their bounds and
+    interleaved into 30- or 63-bit Morton codes, which are sorted with a
+    radix sort. Each node then splits its range of sorted primitives where
+    the highest bit that differs between its first and last code changes,
+    so the hierarchy is built in (nearly) linear time. This builds much
+    faster than the SAH builder of \ref BBH, at the cost of lower quality.
+
+    An optional treelet restructuring pass (Karras and Aila, "Fast
+    Parallel Construction of High-Quality Bounding Volume Hierarchies",
+    HPG 2013) recovers most of the difference: small treelets of up to
+    "treelet_size" leaves are rebuilt with the topology of lowest SAH cost
+    found by dynamic programming.
+    \code
+        "accelerator": {"type": "lbvh", "morton_bits": 30, "restructure": true}
+    \endcode
+    All other keys (e.g. "max_leaf_size" or "width") have the same meaning as
+    for a \ref BBH, and the hierarchy is traversed in the same way.
+ */
+class LBVH : public BBH
+{
+public:
+    LBVH(const Scene & scene, const json & j = json::object());
+
+protected:
+    BBHBuildStats buildTree(const vector<Box3f> & bounds, Progress & progress,
+                            vector<uint32_t> & order, const BBHSplitFunction & splitPrimitive) override;
+
+private:
+    int m_mortonBits = 30;              ///< Bits per Morton code (30 or 63)
+    bool m_restructure = false;         ///< Whether to optimize treelets after the build
+    int m_treeletSize = 7;              ///< Maximum number of leaves of a restructured treelet
+    int m_restructureIterations = 3;    ///< Number of restructuring passes over the hierarchy
+};
@@ -0,0 +1,115 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <dirt/quad.h>
+#include <dirt/sphere.h>
+
+/**
+    The primitives of an acceleration structure, stored by type.
+
+    Every leaf slot of the structure refers to an entry in one of the
+    per-type arrays: spheres and quads are stored by value with their
+    world-to-local affine maps (see \ref SpherePrimitive and \ref
+    QuadPrimitive) and are tested with inlined code, while all other
+    surfaces (meshes, instances, nested aggregates, or spheres and quads with
+    projective transformations) go through the virtual \ref SurfaceBase
+    interface. Triangles are already tested in bulk by the leaves of each
+    \ref Mesh.
+
+    The arrays only describe the surfaces when \ref build is called, so they
+    need to be rebuilt when surfaces move.
+ */
+class LeafPrimitives
+{
+public:
+    /// Describe the surfaces in each leaf slot
+    void build(const vector<shared_ptr<SurfaceBase>> & surfaces);
+
+    /// Release all primitives
+    void clear();
+
+    /// See \ref SurfaceBase::intersectCandidate
+    bool intersectCandidate(uint32_t slot, const Ray3f &ray, HitInfo &hit) const
+    {
+        uint32_t ref = m_refs[slot], index = ref & IndexMask;
+        switch (ref >> TypeShift)
+        {
+            case SphereType: return m_spheres[index].intersectCandidate(ray, hit);
+            case QuadType:   return m_quads[index].intersectCandidate(ray, hit);
+            default:         return m_surfaces[index]->intersectCandidate(ray, hit);
+        }
+    }
+
+    /// See \ref SurfaceBase::intersect
+    bool intersect(uint32_t slot, const Ray3f &ray, HitInfo &hit) const
+    {
+        if (!intersectCandidate(slot, ray, hit))
+            return false;
+
+        hit.surface->finalizeHit(ray, hit);
+        return true;
+    }
+
+    /// See \ref SurfaceBase::occluded
+    bool occluded(uint32_t slot, const Ray3f &ray) const
+    {
+        uint32_t ref = m_refs[slot], index = ref & IndexMask;
+        switch (ref >> TypeShift)
+        {
+            case SphereType: return m_spheres[index].occluded(ray);
+            case QuadType:   return m_quads[index].occluded(ray);
+            default:         return m_surfaces[index]->occluded(ray);
+        }
+    }
+
+    /// See \ref SurfaceBase::intersectPacketCandidates
+    uint32_t intersectPacketCandidates(uint32_t slot, RayPacket &packet, uint32_t activeMask, HitInfo *hits) const
+    {
+        uint32_t ref = m_refs[slot];
+        if (ref >> TypeShift == SurfaceType)
+            return m_surfaces[ref & IndexMask]->intersectPacketCandidates(packet, activeMask, hits);
+
+        uint32_t hitMask = 0;
+        for (int i = 0; i < packet.size; ++i)
+        {
+            if (!(activeMask & (1u << i)) || !intersectCandidate(slot, packet.ray(i), hits[i]))
+                continue;
+
+            packet.maxt[i] = hits[i].t;
+            hitMask |= 1u << i;
+        }
+        return hitMask;
+    }
+
+private:
+    enum : uint32_t
+    {
+        SurfaceType = 0,
+        SphereType = 1,
+        QuadType = 2,
+        TypeShift = 30,
+        IndexMask = (1u << TypeShift) - 1
+    };
+
+    vector<uint32_t> m_refs;                ///< Type (in the top two bits) and index within its array of each slot
+    vector<SpherePrimitive> m_spheres;
+    vector<QuadPrimitive> m_quads;
+    vector<const SurfaceBase *> m_surfaces; ///< Surfaces without a specialized test
+};
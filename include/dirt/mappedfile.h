@@ -0,0 +1,50 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <dirt/common.h>
+
+/**
+    A read-only memory mapping of a whole file.
+
+    The operating system pages the contents of the file in on demand, so
+    mapping a large file is cheap and only the parts that are actually
+    accessed are read from disk.
+ */
+class MappedFile
+{
+public:
+    /// Map the file \c filename into memory. Throws a DirtException on failure.
+    explicit MappedFile(const string & filename);
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+
+    const uint8_t * data() const {return m_data;}
+    size_t size() const {return m_size;}
+
+private:
+    const uint8_t * m_data = nullptr;
+    size_t m_size = 0;
+#if defined(_WIN32)
+    void * m_file = nullptr;
+    void * m_mapping = nullptr;
+#endif
+};
@@ -24,30 +24,178 @@
 
 #pragma once
 
-#include <dirt/surface.h>
+#include <dirt/bbh.h>
 
 /**
-    A triangle mesh.
+    Precomputed data of consecutive faces of a \ref Mesh, in structure of
+    arrays layout, so that a ray can be tested against all of them at once.
 
-    This class stores a triangle mesh object and provides numerous functions
-    for querying the individual triangles. Subclasses of \c Mesh implement
+    The faces of each leaf of the hierarchy occupy consecutive lanes, so the
+    face index of each lane is implicit. Unused lanes have zero edges, which
+    no ray ever hits.
+ */
+struct TriangleBlock
+{
+#if defined(__AVX__)
+    static constexpr int Width = 8;
+#else
+    static constexpr int Width = 4;
+#endif
+
+    float v0[3][Width];                 ///< First vertex, per axis
+    float e1[3][Width];                 ///< Edge from the first to the second vertex
+    float e2[3][Width];                 ///< Edge from the first to the third vertex
+};
+
+/**
+    A mesh of triangles and quads.
+
+    This class stores a polygon mesh object and provides numerous functions
+    for querying the individual faces. Subclasses of \c Mesh implement
     the specifics of how to create its contents (e.g. by loading from an
     external file)
+
+    A mesh is a single surface: \ref build constructs an \ref Accelerator
+    over its faces (reordering \ref F so that the faces of each leaf are
+    contiguous), and rays are intersected with the faces directly, without
+    creating a surface object per triangle. The hierarchy is configured with the
+    "accelerator" block of the mesh, and if \ref accelerator is not set the
+    faces are intersected one by one.
+
+    The vertices and edges of all triangles are also stored in \ref
+    TriangleBlock form, so that each leaf of the hierarchy is intersected a
+    block of triangles at a time. Leaves never straddle blocks unnecessarily,
+    so a leaf of up to TriangleBlock::Width triangles costs a single block
+    test.
+
+    Quads (faces with a fourth vertex in \ref Q) are a single primitive and
+    are intersected as bilinear patches, which is exact for planar quads.
+    Within each leaf, they are stored after the triangles.
  */
-struct Mesh
+struct Mesh : public SurfaceBase
 {
 public:
 
 	bool empty() const {return F.empty() || V.empty();}
 
+    /// Build the hierarchy over the faces (this reorders \ref F, and duplicates faces split by spatial splits)
+    void build() override;
+
+    Box3f localBBox() const override {return m_bounds;}
+    bool intersect(const Ray3f &ray, HitInfo &hit) const override;
+    bool occluded(const Ray3f &ray) const override;
+
+    /// Find the closest face, recording it in \c hit.primitive and its barycentric (or patch) coordinates in \c hit.coords
+    bool intersectCandidate(const Ray3f &ray, HitInfo &hit) const override;
+    void finalizeHit(const Ray3f &ray, HitInfo &hit) const override;
+
+    /// Find the closest face of each ray, recording candidate hits as \ref intersectCandidate does
+    uint32_t intersectPacketCandidates(RayPacket &packet, uint32_t activeMask, HitInfo *hits) const override;
+
+    bool isEmissive() const override {return material && material->isEmissive();}
+
+    /// Add the statistics of the hierarchy over the faces, if any
+    void addAccelerationStats(json & stats) const override;
+
+    /// Sample a direction towards a point chosen uniformly over the area of the mesh
+    Vec3f sample(const Vec3f &o, const Vec2f &sample) const override;
+
+    /// Return the density of \ref sample, summed over all faces the ray through \c v hits
+    float pdf(const Vec3f &o, const Vec3f &v) const override;
+
+    /**
+        Move the vertices of the mesh, and refit its hierarchy to them.
+
+        \c positions (and \c normals, unless empty) replace \ref V (and
+        \ref N) and must have the same size. The hierarchy is rebuilt
+        instead if refitting degraded it too much (see \ref Accelerator::refitPrimitives).
+        Aggregates containing the mesh, or instances of it, need to be refit
+        afterwards (see \ref SurfaceGroup::refit). Quads remain single faces,
+        so they become curved bilinear patches if their vertices leave a plane.
+     */
+    void setVertices(const vector<Vec3f> & positions, const vector<Vec3f> & normals = vector<Vec3f>());
+
+    /// Bounds of face \c f
+    Box3f faceBounds(uint32_t f) const;
+
+    /// Area of face \c f
+    float faceArea(uint32_t f) const;
+
+    /// Enclose the parts of face \c f on either side of a plane in \c left and \c right (see \ref BBHSplitFunction)
+    void splitFace(uint32_t f, int axis, float position, Box3f & left, Box3f & right) const;
+
+    /// Uniformly sample a point on face \c f
+    Vec3f samplePoint(uint32_t f, const Vec2f &sample) const;
+
+    /// Whether face \c f is a quad
+    bool isQuad(uint32_t f) const {return !Q.empty() && Q[f] >= 0;}
+
+    /// Number of distinct faces (\ref F may store a face more than once, see \ref build)
+    uint32_t numFaces() const {return m_faceSlots.empty() ? uint32_t(F.size()) : uint32_t(m_faceSlots.size());}
+
+    /**
+        Intersect a ray with face \c f.
+
+        The hit record refers to \c surface, which is either the mesh itself
+        or a \ref Triangle referencing the face.
+     */
+    bool intersectFace(uint32_t f, const Ray3f &ray, HitInfo &hit, const SurfaceBase * surface) const;
+
+    /// Like \ref intersectFace, but only record \c f and the coordinates of the hit for \ref faceHit
+    bool intersectFaceCandidate(uint32_t f, const Ray3f &ray, HitInfo &hit, const SurfaceBase * surface) const;
+
+    /// Fill the hit record for a hit on face \c f at distance t and barycentric (or patch) coordinates (u,v)
+    void faceHit(uint32_t f, float t, float u, float v, HitInfo &hit, const SurfaceBase * surface) const;
+
+    /// Return whether the ray hits face \c f
+    bool occludedFace(uint32_t f, const Ray3f &ray) const;
+
+    /// Find candidate hits of the masked rays of a packet with face \c f (see \ref SurfaceBase::intersectPacketCandidates)
+    uint32_t intersectFacePacket(uint32_t f, RayPacket &packet, uint32_t activeMask, HitInfo *hits,
+                                 const SurfaceBase * surface) const;
+
     vector<Vec3f> V;                        ///< Vertex positions
     vector<Vec3f> N;                        ///< Vertex normals
     vector<Vec2f> UV;                       ///< Vertex texture coordinates
-    vector<Vec3i> F;                        ///< Faces
+    vector<Vec3i> F;                        ///< Faces (the first three vertices of quads)
+    vector<int32_t> Q;                      ///< Fourth vertex of each face, or -1 for triangles (empty if there are no quads)
 
     Transform m_xform = Transform();        ///< Local-to-world Transformation
     shared_ptr<const Material> material;     ///< One material for all faces
     shared_ptr<const MediumInterface> medium_interface;
+    shared_ptr<Accelerator> accelerator;    ///< Hierarchy over the faces (optional)
+
+protected:
+    /**
+        Intersect a ray with the faces [first, first + count) of a leaf using
+        the precomputed blocks (and then with its quads), and shorten
+        \c ray.maxt to the closest hit. Only records a candidate hit (see
+        \ref intersectCandidate).
+     */
+    bool intersectFaces(uint32_t first, uint32_t count, Ray3f &ray, HitInfo &hit) const;
+
+    /// Return whether the ray hits any of the faces [first, first + count)
+    bool occludedFaces(uint32_t first, uint32_t count, const Ray3f &ray) const;
+
+    /// Store the vertices of the triangles of each leaf in \ref m_blocks
+    void fillBlocks();
+
+    /// Number of triangles of the leaf [first, first + count), which precede its quads
+    uint32_t leafTriangles(uint32_t first, uint32_t count) const
+    {
+        return m_leafTriangles.empty() ? count : m_leafTriangles[first];
+    }
+
+    /// Compute \ref m_areaCdf and \ref m_area from the current vertices
+    void updateAreas();
+
+    Box3f m_bounds;                         ///< Bounds of all faces
+    vector<TriangleBlock> m_blocks;         ///< All faces, grouped into blocks per leaf
+    vector<uint32_t> m_leafLanes;           ///< First lane in m_blocks of the leaf starting at each slot of F
+    vector<uint32_t> m_leafTriangles;       ///< Number of triangles of the leaf starting at each slot of F (empty if there are no quads)
+    vector<uint32_t> m_faceSlots;           ///< A slot of each face in F, if spatial splits duplicated faces
+    vector<float> m_areaCdf;                ///< Normalized cumulative area of the distinct faces, for \ref sample
+    float m_area = 0.f;                     ///< Total area of the distinct faces
 };
 
 
@@ -59,6 +207,10 @@ public:
 	Box3f localBBox() const override;
 	Box3f worldBBox() const override;
 	bool intersect(const Ray3f &ray, HitInfo &hit) const override;
+    bool intersectCandidate(const Ray3f &ray, HitInfo &hit) const override;
+    void finalizeHit(const Ray3f &ray, HitInfo &hit) const override;
+    bool occluded(const Ray3f &ray) const override;
+    uint32_t intersectPacketCandidates(RayPacket &packet, uint32_t activeMask, HitInfo *hits) const override;
 
     bool isEmissive() const override {return m_mesh && m_mesh->material && m_mesh->material->isEmissive();}
     
@@ -29,10 +29,20 @@ public:
     {
         // Find the surface that is visible in the requested direction
         HitInfo hit;
-        if (!scene.intersect(ray, hit))
+        if (!scene.intersect(ray, hit, RayType::Camera))
+            return Color3f(0.0f);
+
+        return primaryLi(scene, sampler, ray, &hit);
+    }
+
+    virtual bool acceptsPrimaryHits() const override {return true;}
+
+    virtual Color3f primaryLi(const Scene & scene, Sampler &sampler, const Ray3f& ray, const HitInfo *hit) const override
+    {
+        if (!hit)
             return Color3f(0.0f);
 
         // Return the component-wise absolute value of the normal as a color
-        return Color3f(fabs(hit.sn.x), fabs(hit.sn.y), fabs(hit.sn.z));
+        return Color3f(fabs(hit->sn.x), fabs(hit->sn.y), fabs(hit->sn.z));
     }
 };
@@ -26,5 +26,10 @@
 
 #include <dirt/mesh.h>
 
-/// Loader for Wavefront OBJ triangle meshes
+/**
+    Loader for Wavefront OBJ meshes of triangles and quads.
+
+    Planar convex quads are kept as single faces (see \ref Mesh::Q), and
+    all other quads are split into two triangles.
+ */
 Mesh loadWavefrontOBJ(const std::string & filename, const Transform & xform);
\ No newline at end of file
@@ -0,0 +1,54 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <dirt/common.h>
+#include <thread>
+
+/// Return the number of threads to use by default (one per hardware thread)
+inline int defaultThreadCount()
+{
+    return max(1, int(std::thread::hardware_concurrency()));
+}
+
+/**
+    Run \c func over the index range [0, size), split into at most
+    \c numChunks contiguous chunks that are processed concurrently.
+
+    \c func is called as func(begin, end, chunk) once per chunk. The chunk
+    boundaries only depend on \c size and \c numChunks, and the first chunk
+    runs on the calling thread. Returns once all chunks are done.
+ */
+template <typename Func>
+void parallelFor(int64_t size, int numChunks, Func && func)
+{
+    numChunks = int(std::max<int64_t>(1, std::min<int64_t>(numChunks, size)));
+
+    vector<std::thread> threads;
+    for (int c = 1; c < numChunks; ++c)
+        threads.emplace_back([&func, size, numChunks, c]()
+        {
+            func(size * c / numChunks, size * (c + 1) / numChunks, c);
+        });
+
+    func(int64_t(0), size / numChunks, 0);
+
+    for (auto & thread : threads)
+        thread.join();
+}
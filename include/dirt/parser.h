@@ -31,6 +31,15 @@
  */
 void parseSurface(const Scene & scene, SurfaceBase * parent, const json & j);
 
+/**
+   Return a newly constructed acceleration structure by parsing the json
+   object \ref j. Children still need to be added before it is built.
+
+   \param  scene  The scene, passed to the accelerator constructor
+   \param  j      The "accelerator" specification to parse
+ */
+shared_ptr<SurfaceGroup> parseAccelerator(const Scene & scene, const json & j);
+
 /**
    Return a newly constructed Material by parsing the json object \ref j.
    
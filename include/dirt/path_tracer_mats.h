@@ -28,10 +28,10 @@ public:
     }
 
     Color3f recursiveColor(const Scene & scene, Sampler &sampler, const Ray3f& ray,
-                           int moreBounces) const
+                           int moreBounces, RayType type = RayType::Indirect) const
     {
         HitInfo hit;
-        if (!scene.intersect(ray, hit))
+        if (!scene.intersect(ray, hit, type))
             return scene.background(ray);
 
         ScatterRecord srec;
@@ -69,21 +69,23 @@ public:
     virtual Color3f Li(const Scene & scene, Sampler &sampler, const Ray3f& ray_) const override
     {
         if (m_recursive)
-            return recursiveColor(scene, sampler, ray_, m_maxBounces);
+            return recursiveColor(scene, sampler, ray_, m_maxBounces, RayType::Camera);
 
         HitInfo hit;
         Ray3f ray(ray_);
         Color3f throughput(1.f);
         Color3f result(0.f);
+        RayType rayType = RayType::Camera;
         int depth = 0;
 
         while (depth++ < m_maxBounces)
         {
-            if (!scene.intersect(ray, hit))
+            if (!scene.intersect(ray, hit, rayType))
             {
                 result += throughput * scene.background(ray);
                 break;
             }
+            rayType = RayType::Indirect;
 
             ScatterRecord srec;
             result += throughput * hit.mat->emitted(ray, hit);
@@ -44,12 +44,22 @@ public:
 
     Color3f recursiveColor(const Scene & scene, Sampler &sampler, const Ray3f& ray,
                            int moreBounces,
-                           float emissionWeight) const
+                           float emissionWeight,
+                           RayType type = RayType::Indirect) const
     {
         HitInfo hit;
-        if (!scene.intersect(ray, hit))
+        if (!scene.intersect(ray, hit, type))
             return scene.background(ray);
 
+        return shade(scene, sampler, ray, hit, moreBounces, emissionWeight);
+    }
+
+    /// Compute the color along \c ray given its closest hit \c hit
+    Color3f shade(const Scene & scene, Sampler &sampler, const Ray3f& ray,
+                  const HitInfo & hit,
+                  int moreBounces,
+                  float emissionWeight) const
+    {
         ScatterRecord srec;
         Color3f emitted = emissionWeight * hit.mat->emitted(ray, hit);
 
@@ -67,7 +77,8 @@ public:
         if (lightPdf > 0.f && luminance(bsdf) > 0.f)
         {
             float bsdfPdf = hit.mat->pdf(ray.d, lightRay.d, hit);
-            direct = bsdf * recursiveColor(scene, sampler, lightRay, 0, powerHeuristic(lightPdf, bsdfPdf)) / lightPdf;
+            direct = bsdf * recursiveColor(scene, sampler, lightRay, 0, powerHeuristic(lightPdf, bsdfPdf),
+                                           RayType::Shadow) / lightPdf;
         }
 
         // 3. now, get indirect illumination by sampling the BSDF
@@ -91,7 +102,17 @@ public:
 
     virtual Color3f Li(const Scene & scene, Sampler &sampler, const Ray3f& ray_) const override
     {
-        return recursiveColor(scene, sampler, ray_, m_maxBounces, 1.f);
+        return recursiveColor(scene, sampler, ray_, m_maxBounces, 1.f, RayType::Camera);
+    }
+
+    virtual bool acceptsPrimaryHits() const override {return true;}
+
+    virtual Color3f primaryLi(const Scene & scene, Sampler &sampler, const Ray3f& ray, const HitInfo *hit) const override
+    {
+        if (!hit)
+            return scene.background(ray);
+
+        return shade(scene, sampler, ray, *hit, m_maxBounces, 1.f);
     }
 
 private:
@@ -30,12 +30,22 @@ public:
     Color3f recursiveColor(const Scene & scene, Sampler & sampler,
     			   const Ray3f& ray,
                            int moreBounces,
-                           bool includeEmission) const
+                           bool includeEmission,
+                           RayType type = RayType::Indirect) const
     {
         HitInfo hit;
-        if (!scene.intersect(ray, hit))
+        if (!scene.intersect(ray, hit, type))
             return scene.background(ray);
 
+        return shade(scene, sampler, ray, hit, moreBounces, includeEmission);
+    }
+
+    /// Compute the color along \c ray given its closest hit \c hit
+    Color3f shade(const Scene & scene, Sampler &sampler, const Ray3f& ray,
+                  const HitInfo & hit,
+                  int moreBounces,
+                  bool includeEmission) const
+    {
         ScatterRecord srec;
         Color3f emitted = includeEmission ? hit.mat->emitted(ray, hit) : Color3f(0.f);
 
@@ -51,7 +61,7 @@ public:
         Color3f bsdf = hit.mat->eval(ray.d, lightRay.d, hit);
         Color3f direct(0.f);
         if (lightPdf > 0.f && luminance(bsdf) > 0.f)
-            direct = bsdf * recursiveColor(scene, sampler, lightRay, 0, true) / lightPdf;
+            direct = bsdf * recursiveColor(scene, sampler, lightRay, 0, true, RayType::Shadow) / lightPdf;
 
         // 3. now, get indirect illumination by sampling the BSDF
 	    sample = sampler.next2D();
@@ -77,7 +87,17 @@ public:
 
     virtual Color3f Li(const Scene & scene, Sampler &sampler, const Ray3f& ray_) const override
     {
-        return recursiveColor(scene, sampler, ray_, m_maxBounces, true);
+        return recursiveColor(scene, sampler, ray_, m_maxBounces, true, RayType::Camera);
+    }
+
+    virtual bool acceptsPrimaryHits() const override {return true;}
+
+    virtual Color3f primaryLi(const Scene & scene, Sampler &sampler, const Ray3f& ray, const HitInfo *hit) const override
+    {
+        if (!hit)
+            return scene.background(ray);
+
+        return shade(scene, sampler, ray, *hit, m_maxBounces, true);
     }
 
 private:
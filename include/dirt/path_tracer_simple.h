@@ -34,15 +34,17 @@ public:
         Color3f attenuation;
         Color3f throughput(1.f);
         Color3f result(0.f);
+        RayType rayType = RayType::Camera;
         int depth = 0;
 
         while (depth++ < m_maxBounces+1)
         {
-            if (!scene.intersect(ray, hit))
+            if (!scene.intersect(ray, hit, rayType))
             {
                 result += throughput * scene.background(ray);
                 break;
             }
+            rayType = RayType::Indirect;
 
             result += throughput * hit.mat->emitted(ray, hit);
             Vec2f sample = sampler.next2D();
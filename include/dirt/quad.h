@@ -21,6 +21,8 @@
 #include <dirt/surface.h>
 #include <dirt/surfacegroup.h>
 
+struct QuadPrimitive;
+
 /// A quad spanning (-m_size/2, m_size/2) in the (x,y)-plane at z=0
 class Quad : public Surface
 {
@@ -32,13 +34,69 @@ public:
 
     Box3f localBBox() const override;
     bool intersect(const Ray3f &ray, HitInfo &hit) const override;
+    bool intersectCandidate(const Ray3f &ray, HitInfo &hit) const override;
+    void finalizeHit(const Ray3f &ray, HitInfo &hit) const override;
+    bool occluded(const Ray3f &ray) const override;
     bool isEmissive() const override {return m_material && m_material->isEmissive();}
 
     float pdf(const Vec3f& o, const Vec3f& v) const override;
     Vec3f sample(const Vec3f& o, const Vec2f &sample) const override;
 
+    /// Describe the quad for leaf intersection, or return false if its transformation is projective
+    bool leafPrimitive(QuadPrimitive & primitive) const;
+
 protected:
     Vec2f m_size = Vec2f(1.f);
     shared_ptr<const Material> m_material;
     shared_ptr<const MediumInterface> m_medium_interface;
-};
\ No newline at end of file
+};
+// compute the ray parameter and local-space hit point of a local-space ray
+// with a quad spanning (-size, size) in the (x,y)-plane
+inline bool rayQuad(const Ray3f &tray, const Vec2f &size, float &t, Vec3f &p)
+{
+    if (tray.d.z == 0)
+        return false;
+    t = -tray.o.z / tray.d.z;
+    p = tray(t);
+
+    if (size.x < p.x || -size.x > p.x || size.y < p.y || -size.y > p.y)
+        return false;
+
+    // check if computed param is within ray.mint and ray.maxt
+    return t >= tray.mint && t <= tray.maxt;
+}
+
+/**
+    A \ref Quad reduced to what its intersection tests need: its
+    world-to-local affine map and half size (see \ref SpherePrimitive).
+ */
+struct QuadPrimitive
+{
+    AffineRayTransform worldToLocal;
+    Vec2f size;
+    const Quad * surface;
+
+    /// See \ref Quad::intersectCandidate
+    bool intersectCandidate(const Ray3f &ray, HitInfo &hit) const
+    {
+        INCREMENT_INTERSECTION_TESTS;
+        float t;
+        Vec3f p;
+        if (!rayQuad(worldToLocal(ray), size, t, p))
+            return false;
+
+        hit.t = t;
+        hit.coords = Vec2f(p.x, p.y);
+        hit.surface = surface;
+        return true;
+    }
+
+    /// See \ref Quad::occluded
+    bool occluded(const Ray3f &ray) const
+    {
+        INCREMENT_INTERSECTION_TESTS;
+        float t;
+        Vec3f p;
+        return rayQuad(worldToLocal(ray), size, t, p);
+    }
+};
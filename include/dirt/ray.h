@@ -87,3 +87,71 @@ using Ray2d   = Ray2<double>;
 
 using Ray3f   = Ray3<float>;
 using Ray3d   = Ray3<double>;
+
+/**
+    A ray prepared for slab tests against many axis-aligned boxes.
+
+    Stores the reciprocal of the direction and which of its components are
+    negative, so that traversals compute them once per ray instead of once
+    per box (see \ref Box::intersect).
+ */
+template <size_t N, typename T>
+struct PrecomputedRay
+{
+    Vec<N,T> o;         ///< The origin of the ray
+    Vec<N,T> invD;      ///< Reciprocal of the direction of the ray
+    int dirIsNeg[N];    ///< 1 for components of invD that are negative, 0 otherwise
+
+    explicit PrecomputedRay(const Ray<N,T> &ray) : o(ray.o)
+    {
+        for (size_t i = 0; i < N; ++i)
+        {
+            invD[i] = T(1) / ray.d[i];
+            dirIsNeg[i] = invD[i] < T(0);
+        }
+    }
+};
+
+using PrecomputedRay3f = PrecomputedRay<3, float>;
+
+/**
+    A small bundle of rays that are traced together.
+
+    Rays are stored as a structure of arrays so that a box or primitive can
+    be tested against all rays of the packet with a single (vectorizable)
+    loop. Packets are most efficient for coherent rays, e.g. the camera rays
+    through a small tile of neighboring pixels.
+ */
+struct RayPacket
+{
+    static constexpr int MaxSize = 16;
+
+    int size = 0;                   ///< Number of valid rays in the packet
+    float o[3][MaxSize];            ///< Ray origins, per axis
+    float d[3][MaxSize];            ///< Ray directions, per axis
+    float invD[3][MaxSize];         ///< Reciprocal ray directions, per axis
+    float mint[MaxSize];            ///< Minimum distance along each ray
+    float maxt[MaxSize];            ///< Maximum distance along each ray
+
+    /// Store \c ray in slot \c i of the packet
+    void set(int i, const Ray3f & ray)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            o[a][i] = ray.o[a];
+            d[a][i] = ray.d[a];
+            invD[a][i] = 1.f / ray.d[a];
+        }
+        mint[i] = ray.mint;
+        maxt[i] = ray.maxt;
+    }
+
+    /// Return the ray in slot \c i of the packet (without its medium)
+    Ray3f ray(int i) const
+    {
+        return Ray3f(Vec3f(o[0][i], o[1][i], o[2][i]), Vec3f(d[0][i], d[1][i], d[2][i]), mint[i], maxt[i]);
+    }
+
+    /// Bit mask with one bit set for each valid ray
+    uint32_t fullMask() const {return size >= 32 ? ~0u : (1u << size) - 1u;}
+};
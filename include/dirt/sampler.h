@@ -35,6 +35,18 @@ public:
   */
   virtual Vec2f next2D();
 
+  /**
+  *  Create an independent copy of this sampler, e.g. to evaluate several pixels at once.
+  */
+  virtual shared_ptr<Sampler> clone() const = 0;
+
+  /**
+  *  Get/set the index of the current sample within the entire image. Together with clone(),
+  *  this allows a copy of the sampler to continue the sample sequence of any pixel.
+  */
+  size_t globalSample() const {return currentGlobalSample;}
+  void setGlobalSample(size_t index) {currentGlobalSample = index;}
+
   // the number of samples **of** each pixel
   size_t samplesPerPixel; 
 
@@ -60,6 +72,8 @@ class IndependentSampler : public Sampler
 public:
   IndependentSampler(const json &j);
 
+  shared_ptr<Sampler> clone() const override {return make_shared<IndependentSampler>(*this);}
+
   float next1D() override;
 };
 
@@ -68,6 +82,8 @@ class StratifiedSampler : public Sampler
 public:
   StratifiedSampler(const json &j);
 
+  shared_ptr<Sampler> clone() const override {return make_shared<StratifiedSampler>(*this);}
+
   void startPixel() override;
 
   float next1D() override;
@@ -89,6 +105,8 @@ class HaltonSampler: public Sampler
 public:
   HaltonSampler(const json &j);
 
+  shared_ptr<Sampler> clone() const override {return make_shared<HaltonSampler>(*this);}
+
 private:
  
   static float scrambledRadicalInverse(const std::vector<uint64_t> &perm, uint64_t a, uint64_t base);
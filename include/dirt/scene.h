@@ -28,6 +28,8 @@
 #include <dirt/texture.h>
 #include <dirt/integrator.h>
 #include <dirt/medium.h>
+#include <dirt/mesh.h>
+#include <dirt/stats.h>
 
 /**
     Main scene data structure.
@@ -59,11 +61,45 @@ public:
 
     bool intersect(const Ray3f & ray, HitInfo & hit) const override
     {
+        return intersect(ray, hit, RayType::Indirect);
+    }
+
+    /// Intersect a ray against the scene, attributing the traversal work to rays of type \c type
+    bool intersect(const Ray3f & ray, HitInfo & hit, RayType type) const
+    {
+        RayStatsScope stats(type);
         return m_surfaces->intersect(ray, hit);
     }
 
+    bool occluded(const Ray3f & ray) const override
+    {
+        RayStatsScope stats(RayType::Shadow);
+        return m_surfaces->occluded(ray);
+    }
+
+    uint32_t intersectPacket(RayPacket & packet, uint32_t activeMask, HitInfo * hits) const override
+    {
+        RayStatsScope stats(RayType::Camera, popCount(activeMask));
+        return m_surfaces->intersectPacket(packet, activeMask, hits);
+    }
+
+    /// Add the statistics of all acceleration structures, including those of instanced meshes
+    void addAccelerationStats(json & stats) const override
+    {
+        m_surfaces->addAccelerationStats(stats);
+        for (auto & mesh : m_meshes)
+            mesh.second->addAccelerationStats(stats);
+    }
+
     Box3f localBBox() const override {return m_surfaces->localBBox();}
 
+    /// Update the acceleration structures after surfaces moved (see \ref SurfaceGroup::refit)
+    void refit()
+    {
+        m_surfaces->refit();
+        m_emitters.refit();
+    }
+
     /**
         Find/create a material.
        
@@ -91,6 +127,20 @@ public:
      */
     shared_ptr<const MediumInterface> findOrCreateMediumInterface(const json & j, const string & key = "medium_interface") const;
 
+    /**
+        Find a named mesh.
+
+        Return the mesh declared in the scene's "meshes" array under the name
+        given by the string \c j[key].
+     */
+    shared_ptr<const Mesh> findMesh(const json & j, const string & key = "mesh") const;
+
+    /// Return the camera (null until the scene's "camera" has been parsed)
+    shared_ptr<const Camera> camera() const {return m_camera;}
+
+    /// Default "accelerator" specification of the hierarchy over the faces of each mesh
+    const json & meshAccelerator() const {return m_meshAccelerator;}
+
     /// Return a const reference to the emitters
     const SurfaceBase & emitters() const {return m_emitters;}
 
@@ -114,9 +164,13 @@ public:
     Image3f integrateImage() const;
 
 private:
+    /// Generate the entire image by tracing camera rays in packets of neighboring pixels
+    Image3f integrateImagePackets() const;
+
     shared_ptr<Camera> m_camera;
     map<string, shared_ptr<const Material>> m_materials;
     map<string, shared_ptr<const Medium>> m_media;
+    map<string, shared_ptr<const Mesh>> m_meshes;    ///< Named meshes, for instancing
     shared_ptr<SurfaceGroup> m_surfaces;
     SurfaceGroup m_emitters {*this};
     shared_ptr<Background> m_background;
@@ -124,6 +178,8 @@ private:
     shared_ptr<Sampler> m_sampler;
 
     int m_imageSamples = 1;                      ///< samples per pixels in each direction
+    bool m_packets = true;                       ///< trace camera rays in packets if the integrator allows it
+    json m_meshAccelerator = {{"type", "bbh"}, {"split", "sah"}};
 };
 
 // create test scenes that do not need to be loaded from a file
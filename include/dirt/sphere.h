@@ -20,6 +20,8 @@
 
 #include <dirt/surface.h>
 
+struct SpherePrimitive;
+
 /// A sphere centered at the origin with radius m_radius
 class Sphere : public Surface
 {
@@ -31,13 +33,84 @@ public:
 
     Box3f localBBox() const override;
     bool intersect(const Ray3f &ray, HitInfo &hit) const override;
+    bool intersectCandidate(const Ray3f &ray, HitInfo &hit) const override;
+    void finalizeHit(const Ray3f &ray, HitInfo &hit) const override;
+    bool occluded(const Ray3f &ray) const override;
     bool isEmissive() const override {return m_material && m_material->isEmissive();}
 
     float pdf(const Vec3f& o, const Vec3f& v) const override;
     Vec3f sample(const Vec3f& o, const Vec2f &sample) const override;
 
+    /// Describe the sphere for leaf intersection, or return false if its transformation is projective
+    bool leafPrimitive(SpherePrimitive & primitive) const;
+
 protected:
     float m_radius = 1.0f;
     shared_ptr<const Material> m_material;
     shared_ptr<const MediumInterface> m_medium_interface;
-};
\ No newline at end of file
+};
+
+// compute the ray parameter of the first hit of a local-space ray with a
+// sphere of the given radius centered at the origin
+inline bool raySphere(const Ray3f &tray, float radius, float &t)
+{
+    auto a = length2(tray.d);
+    auto b = 2*dot(tray.d, tray.o);
+    auto c = length2(tray.o) - radius*radius;
+
+    // solve the quadratic equation using double precision
+    double discrim = (double)b*(double)b - 4*(double)a*(double)c;
+    if (discrim < 0)
+        return false;
+
+    double rootDiscrim = std::sqrt(discrim);
+
+    double q = (b < 0) ? -.5 * (b - rootDiscrim) : -.5 * (b + rootDiscrim);
+
+    float t1 = float(q / a);
+    float t2 = float(c / q);
+    if (t1 > t2)
+        std::swap(t1, t2);
+
+    // compute t
+    t = (t1 < tray.mint) ? t2 : t1;
+
+    // check if computed param is within ray.mint and ray.maxt
+    return t >= tray.mint && t <= tray.maxt;
+}
+
+/**
+    A \ref Sphere reduced to what its intersection tests need: its
+    world-to-local affine map and radius.
+
+    Acceleration structures store these by value (see \ref LeafPrimitives),
+    so that testing a sphere needs neither a virtual call nor an inverse
+    Transform. Hits are identical to those of \ref Sphere::intersectCandidate.
+ */
+struct SpherePrimitive
+{
+    AffineRayTransform worldToLocal;
+    float radius;
+    const Sphere * surface;
+
+    /// See \ref Sphere::intersectCandidate
+    bool intersectCandidate(const Ray3f &ray, HitInfo &hit) const
+    {
+        INCREMENT_INTERSECTION_TESTS;
+        float t;
+        if (!raySphere(worldToLocal(ray), radius, t))
+            return false;
+
+        hit.t = t;
+        hit.surface = surface;
+        return true;
+    }
+
+    /// See \ref Sphere::occluded
+    bool occluded(const Ray3f &ray) const
+    {
+        INCREMENT_INTERSECTION_TESTS;
+        float t;
+        return raySphere(worldToLocal(ray), radius, t);
+    }
+};
@@ -0,0 +1,85 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <dirt/common.h>
+
+/**
+    \file
+    Statistics about the quality of acceleration structures and the work
+    rays do traversing them.
+
+    Like \ref intersection_tests, the traversal counters are plain global
+    counters. The scene attributes the nodes visited and primitives tested
+    during each query to the type of the ray (see \ref RayStatsScope).
+ */
+
+/// Kinds of rays that traversal statistics are broken down by
+enum class RayType
+{
+    Camera = 0,     ///< Closest-hit queries of rays starting at the camera
+    Shadow,         ///< Occlusion queries, and closest-hit queries of rays towards lights
+    Indirect,       ///< All other closest-hit queries (e.g. after scattering)
+    Count
+};
+
+/// Traversal work of all rays of one \ref RayType
+struct RayTypeStats
+{
+    uint64_t rays = 0;              ///< Number of queries
+    uint64_t nodes = 0;             ///< Interior nodes visited (see \ref nodes_visited)
+    uint64_t primitives = 0;        ///< Primitive intersection tests (see \ref intersection_tests)
+};
+
+extern RayTypeStats ray_type_stats[int(RayType::Count)];
+
+/// Attributes the traversal work done during its lifetime to \c numRays rays of one type
+class RayStatsScope
+{
+public:
+    RayStatsScope(RayType type, uint64_t numRays = 1) :
+        m_stats(ray_type_stats[int(type)]), m_nodes(nodes_visited), m_primitives(intersection_tests)
+    {
+        m_stats.rays += numRays;
+    }
+
+    ~RayStatsScope()
+    {
+        m_stats.nodes += nodes_visited - m_nodes;
+        m_stats.primitives += intersection_tests - m_primitives;
+    }
+
+private:
+    RayTypeStats & m_stats;
+    uint64_t m_nodes, m_primitives;
+};
+
+/**
+    Return a report of the acceleration structures of \c scene and of the
+    traversal work of all rays traced so far, as JSON.
+
+    The report holds one entry per acceleration structure under
+    "accelerators" (see \ref SurfaceBase::addAccelerationStats), and the
+    number of rays and average nodes and primitives visited per ray of each
+    \ref RayType under "traversal".
+ */
+json renderStats(const Scene & scene);
+
+/// Format a report returned by \ref renderStats for printing
+string renderStatsString(const json & report);
@@ -42,6 +42,8 @@ struct HitInfo
 	const Material * mat = nullptr;         ///< Material at the hit point
     const MediumInterface *mi = nullptr; ///< Medium interface at the hit point
 	const SurfaceBase * surface = nullptr;  ///< Surface at the hit point
+    uint32_t primitive = 0;                 ///< Primitive within \ref surface (e.g. the face of a mesh)
+    Vec2f coords;                           ///< Surface-specific coordinates of the hit (e.g. barycentrics)
 
 	/// Default constructor that leaves all members uninitialized
 	HitInfo() = default;
@@ -117,6 +119,112 @@ public:
      */
     virtual bool intersect(const Ray3f &ray, HitInfo &hit) const = 0;
 
+    /**
+        Find the closest hit without computing its attributes.
+
+        This is the cheap first phase of \ref intersect: it only needs to set
+        \c hit.t, and \c hit.surface to the surface whose \ref finalizeHit
+        completes the hit record, together with whatever that surface needs
+        to do so (e.g. \c hit.primitive and \c hit.coords). Aggregates call
+        this for their children, so that only the closest of all candidate
+        hits is ever finalized.
+
+        The base class implementation just calls \ref intersect, which
+        leaves nothing to finalize.
+     */
+    virtual bool intersectCandidate(const Ray3f &ray, HitInfo &hit) const
+    {
+        return intersect(ray, hit);
+    }
+
+    /**
+        Compute the full hit record of a hit found by \ref intersectCandidate.
+
+        \c ray is the ray passed to \ref intersectCandidate. The base class
+        implementation does nothing.
+     */
+    virtual void finalizeHit(const Ray3f &ray, HitInfo &hit) const {}
+
+    /// Implement \ref intersect as \ref intersectCandidate followed by \ref finalizeHit
+    bool intersectAndFinalize(const Ray3f &ray, HitInfo &hit) const
+    {
+        if (!intersectCandidate(ray, hit))
+            return false;
+
+        hit.surface->finalizeHit(ray, hit);
+        return true;
+    }
+
+    /**
+        Ray-Surface occlusion test.
+
+        Determine whether the ray hits this surface anywhere within its
+        [mint, maxt] segment. Unlike \ref intersect, this may stop at the
+        first intersection found and does not compute any hit information,
+        so it should be preferred whenever only binary visibility matters.
+
+        The base class implementation just calls \ref intersect.
+
+        \param ray
+             A 3-dimensional ray data structure with minimum/maximum
+             extent information
+        \return  \c true if any intersection was found
+     */
+    virtual bool occluded(const Ray3f &ray) const
+    {
+        HitInfo hit;
+        return intersect(ray, hit);
+    }
+
+    /**
+        Ray packet-Surface intersection test.
+
+        Intersect every ray of \c packet whose bit is set in \c activeMask
+        against this surface. For each ray \c i that hits the surface within
+        its [mint, maxt] segment, \c hits[i] is filled and \c packet.maxt[i]
+        is shortened to the hit distance, so that after the query the packet
+        holds the closest hits found so far.
+
+        The base class implementation finds the closest candidate hit of each
+        ray with \ref intersectPacketCandidates, and then finalizes each of
+        them once.
+
+        \return  A bit mask of the rays that hit this surface
+     */
+    virtual uint32_t intersectPacket(RayPacket &packet, uint32_t activeMask, HitInfo *hits) const
+    {
+        uint32_t hitMask = intersectPacketCandidates(packet, activeMask, hits);
+        for (int i = 0; i < packet.size; ++i)
+            if (hitMask & (1u << i))
+                hits[i].surface->finalizeHit(packet.ray(i), hits[i]);
+        return hitMask;
+    }
+
+    /**
+        Find the closest candidate hit of each ray of a packet.
+
+        The packet counterpart of \ref intersectCandidate: \c hits[i] only
+        records what \ref finalizeHit needs, and \c packet.maxt[i] is
+        shortened as in \ref intersectPacket. Aggregates call this for
+        their children, so that each ray finalizes only its closest hit.
+
+        The base class implementation calls \ref intersectCandidate for
+        one ray at a time.
+     */
+    virtual uint32_t intersectPacketCandidates(RayPacket &packet, uint32_t activeMask, HitInfo *hits) const
+    {
+        uint32_t hitMask = 0;
+        for (int i = 0; i < packet.size; ++i)
+        {
+            if (!(activeMask & (1u << i)) || !intersectCandidate(packet.ray(i), hits[i]))
+                continue;
+
+            packet.maxt[i] = hits[i].t;
+            hitMask |= 1u << i;
+        }
+        return hitMask;
+    }
+
     /// Sample a direction from \c o towards this surface
     virtual Vec3f sample(const Vec3f& o, const Vec2f &sample) const
     {
@@ -132,6 +240,15 @@ public:
     /// Return whether or not this Surface's Material is emissive.
     virtual bool isEmissive() const {return false;}
 
+    /**
+        Append statistics about the acceleration structures of this surface
+        (and its children) to the JSON array \c stats.
+
+        The base class implementation does nothing, since plain surfaces
+        have no acceleration structure.
+     */
+    virtual void addAccelerationStats(json & stats) const {}
+
 };
 
 
@@ -159,6 +276,14 @@ public:
     */
     Box3f worldBBox() const override;
 
+    /**
+        Move the surface by replacing its local-to-world transformation.
+
+        Aggregates containing the surface need to be refit afterwards (see
+        \ref SurfaceGroup::refit).
+     */
+    virtual void setTransform(const Transform & xform) {m_xform = xform;}
+
 protected:
     Transform m_xform = Transform();        ///< Local-to-world Transformation
 };
@@ -52,6 +52,15 @@ public:
     virtual void clear();
 
     void addChild(shared_ptr<SurfaceBase> surface) override;
+
+    /**
+        Update the aggregate after the bounds of its children changed.
+
+        Call this after moving children (e.g. with \ref Surface::setTransform
+        or \ref Mesh::setVertices) instead of rebuilding the aggregate. The
+        base class implementation just recomputes the bounds of the group.
+     */
+    virtual void refit();
  
     /**
         Intersect a ray against all surfaces registered with the Accelerator.
@@ -63,7 +72,16 @@ public:
     */
     bool intersect(const Ray3f &ray, HitInfo &hit) const override;
 
+    /// Find the closest candidate hit among all surfaces (see \ref SurfaceBase::intersectCandidate)
+    bool intersectCandidate(const Ray3f &ray, HitInfo &hit) const override;
+
+    /// Return whether the ray hits any of the surfaces registered with the Accelerator
+    bool occluded(const Ray3f &ray) const override;
+
     float pdf(const Vec3f& o, const Vec3f& v) const override;
+
+    /// Add the statistics of the children's acceleration structures
+    void addAccelerationStats(json & stats) const override;
     
     Vec3f sample(const Vec3f& o, const Vec2f &sample) const override;
 
@@ -159,3 +159,39 @@ struct Transform
                                 {o, 1}));
     }
 };
+
+/**
+    The affine part of a \ref Transform, applied to rays with exactly the
+    arithmetic of \ref Transform::ray.
+
+    Primitives that are intersected in bulk (see \ref LeafPrimitives) store
+    this instead of a Transform, which saves building the inverse Transform
+    and the homogeneous divide for every ray.
+ */
+struct AffineRayTransform
+{
+    Vec4f rows[3];                          ///< The top three rows of the matrix
+
+    /// Take the affine part of \c m, or return false if \c m is a projective transformation
+    bool set(const Mat44f & m)
+    {
+        if (m(3, 0) != 0.f || m(3, 1) != 0.f || m(3, 2) != 0.f || m(3, 3) != 1.f)
+            return false;
+
+        for (int r = 0; r < 3; ++r)
+            rows[r] = Vec4f(m(r, 0), m(r, 1), m(r, 2), m(r, 3));
+        return true;
+    }
+
+    /// Apply the transformation to a ray
+    Ray3f operator()(const Ray3f & r) const
+    {
+        Vec3f o, d;
+        for (int i = 0; i < 3; ++i)
+        {
+            o[i] = rows[i].x*r.o.x + rows[i].y*r.o.y + rows[i].z*r.o.z + rows[i].w;
+            d[i] = rows[i].x*r.d.x + rows[i].y*r.d.y + rows[i].z*r.d.z;
+        }
+        return Ray3f(o, d, r.mint, r.maxt);
+    }
+};
@@ -0,0 +1,120 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <dirt/widebbh.h>
+#include <dirt/kdtree.h>
+#include <dirt/grid.h>
+#include <type_traits>
+
+// Definitions of the traversal templates of \ref Accelerator, which may
+// traverse any of the structures above
+
+/// Visitor of \ref Accelerator::visit that runs \ref BBHTree::intersectLeaves on any structure
+template <typename LeafFunc>
+struct AcceleratorIntersectLeaves
+{
+    const Ray3f & ray;
+    HitInfo & hit;
+    LeafFunc & intersectLeaf;
+
+    template <typename Structure>
+    bool operator()(const Structure & structure) const
+    {
+        return structure.intersectLeaves(ray, hit, intersectLeaf);
+    }
+};
+
+/// Visitor of \ref Accelerator::visit that runs \ref BBHTree::occludedLeaves on any structure
+template <typename LeafFunc>
+struct AcceleratorOccludedLeaves
+{
+    const Ray3f & ray;
+    LeafFunc & occludedLeaf;
+
+    template <typename Structure>
+    bool operator()(const Structure & structure) const
+    {
+        return structure.occludedLeaves(ray, occludedLeaf);
+    }
+};
+
+template <typename Visitor>
+bool Accelerator::visit(Visitor && visitor) const
+{
+    switch (m_traversalType)
+    {
+        case Traversal::Binary:     return visitor(*static_cast<const BBHTree *>(m_traversal));
+        case Traversal::Wide4:      return visitor(*static_cast<const BBHWideTree<4> *>(m_traversal));
+        case Traversal::Wide8:      return visitor(*static_cast<const BBHWideTree<8> *>(m_traversal));
+        case Traversal::Quantized4: return visitor(*static_cast<const BBHWideTree<4, true> *>(m_traversal));
+        case Traversal::Quantized8: return visitor(*static_cast<const BBHWideTree<8, true> *>(m_traversal));
+        case Traversal::KdTree:     return visitor(*static_cast<const KdTree *>(m_traversal));
+        case Traversal::Grid:       return visitor(*static_cast<const UniformGrid *>(m_traversal));
+        default:                    return false;
+    }
+}
+
+template <typename PrimitiveFunc>
+bool Accelerator::intersectPrimitives(const Ray3f &ray, HitInfo &hit, PrimitiveFunc && intersectPrimitive) const
+{
+    typedef typename std::remove_reference<PrimitiveFunc>::type Func;
+    return intersectLeaves(ray, hit, BBHEachPrimitive<Func>{intersectPrimitive});
+}
+
+template <typename PrimitiveFunc>
+bool Accelerator::occludedPrimitives(const Ray3f &ray, PrimitiveFunc && occludedPrimitive) const
+{
+    typedef typename std::remove_reference<PrimitiveFunc>::type Func;
+    return occludedLeaves(ray, BBHAnyPrimitive<Func>{occludedPrimitive});
+}
+
+template <typename LeafFunc>
+bool Accelerator::intersectLeaves(const Ray3f &ray, HitInfo &hit, LeafFunc && intersectLeaf) const
+{
+    typedef typename std::remove_reference<LeafFunc>::type Func;
+    return visit(AcceleratorIntersectLeaves<Func>{ray, hit, intersectLeaf});
+}
+
+template <typename LeafFunc>
+bool Accelerator::occludedLeaves(const Ray3f &ray, LeafFunc && occludedLeaf) const
+{
+    typedef typename std::remove_reference<LeafFunc>::type Func;
+    return visit(AcceleratorOccludedLeaves<Func>{ray, occludedLeaf});
+}
+
+template <typename PacketFunc, typename PrimitiveFunc>
+uint32_t Accelerator::intersectPacketPrimitives(RayPacket &packet, uint32_t activeMask, HitInfo *hits,
+                                                PacketFunc && intersectPrimitives,
+                                                PrimitiveFunc && intersectPrimitive) const
+{
+    if (m_packetTree)
+        return m_packetTree->intersectPacket(packet, activeMask, hits, intersectPrimitives, intersectPrimitive);
+
+    uint32_t hitMask = 0;
+    for (int i = 0; i < packet.size; ++i)
+    {
+        if ((activeMask & (1u << i)) && this->intersectPrimitives(packet.ray(i), hits[i], intersectPrimitive))
+        {
+            packet.maxt[i] = hits[i].t;
+            hitMask |= 1u << i;
+        }
+    }
+    return hitMask;
+}
@@ -91,16 +91,27 @@ public:
         Vec3f wi;
 
         // first compute primary ray connection to light source
-        HitInfo hit;
+        HitInfo primaryHit;
         Ray3f primaryRay(ray_);
-        if (scene.intersect(primaryRay, hit)) setRayMaxt(hit, primaryRay);
+        bool primaryFound = scene.intersect(primaryRay, primaryHit, RayType::Camera);
+        if (primaryFound) setRayMaxt(primaryHit, primaryRay);
         result += TrL(scene, sampler, primaryRay);
 
+        // the first iteration continues from the hit of the camera ray
+        bool firstIteration = true;
         int bounces = 0;
         while (bounces < m_maxBounces)
         {
             HitInfo hit;
-            bool foundIntersection = scene.intersect(ray, hit);
+            bool foundIntersection;
+            if (firstIteration)
+            {
+                hit = primaryHit;
+                foundIntersection = primaryFound;
+                firstIteration = false;
+            }
+            else
+                foundIntersection = scene.intersect(ray, hit);
             if (foundIntersection)
                 setRayMaxt(hit, ray); // Cut ray short at intersection point
 
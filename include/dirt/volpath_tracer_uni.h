@@ -41,12 +41,14 @@ public:
         Ray3f ray(ray_);
         Color3f throughput(1.f);
         Color3f result(0.f);
+        RayType rayType = RayType::Camera;
 
         int bounces = 0;
         while (bounces <= m_maxBounces)
         {
             HitInfo hit;
-            bool foundIntersection = scene.intersect(ray, hit);
+            bool foundIntersection = scene.intersect(ray, hit, rayType);
+            rayType = RayType::Indirect;
             if (foundIntersection) setRayMaxt(hit, ray);
 
             MediumInteraction mi;
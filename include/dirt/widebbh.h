@@ -0,0 +1,473 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <dirt/bbh.h>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DIRT_WIDE_BBH_SSE 1
+#include <immintrin.h>
+#endif
+
+/// Size of a memory page, in bytes
+const size_t MemoryPageSize = 4096;
+
+/// Allocate \c bytes aligned as described for \ref PageAlignedAllocator. Throws std::bad_alloc on failure.
+void * allocatePageAligned(size_t bytes);
+
+/// Release memory allocated by \ref allocatePageAligned
+void freePageAligned(void * pointer);
+
+/**
+    An allocator whose allocations touch as few memory pages as possible.
+
+    Allocations of at least a page start on a page boundary. Smaller ones
+    are aligned to their size rounded up to a power of two (and at least to
+    a cache line), so they never straddle two pages.
+ */
+template <typename T>
+struct PageAlignedAllocator
+{
+    typedef T value_type;
+
+    PageAlignedAllocator() = default;
+    template <typename U> PageAlignedAllocator(const PageAlignedAllocator<U> &) {}
+
+    T * allocate(size_t n) {return static_cast<T *>(allocatePageAligned(n * sizeof(T)));}
+    void deallocate(T * pointer, size_t) {freePageAligned(pointer);}
+
+    template <typename U> bool operator==(const PageAlignedAllocator<U> &) const {return true;}
+    template <typename U> bool operator!=(const PageAlignedAllocator<U> &) const {return false;}
+};
+
+/**
+    A node of a wide BBH with up to \c Width children.
+
+    The bounds of all children are stored as a structure of arrays, so that
+    a single SIMD slab test can intersect a ray with all of them at once.
+    Unused child slots have empty bounds, which no ray ever intersects.
+ */
+template <int Width>
+struct alignas(64) BBHWideNode
+{
+    float pMin[3][Width];               ///< Lower bounds of the children, per axis
+    float pMax[3][Width];               ///< Upper bounds of the children, per axis
+    uint32_t offset[Width];             ///< Child node index, or first primitive of a leaf child
+    uint16_t numPrimitives[Width];      ///< Number of primitives of leaf children (0 for interior children)
+
+    BBHWideNode()
+    {
+        for (int i = 0; i < Width; ++i)
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                pMin[a][i] = std::numeric_limits<float>::infinity();
+                pMax[a][i] = -std::numeric_limits<float>::infinity();
+            }
+            offset[i] = 0;
+            numPrimitives[i] = 0;
+        }
+    }
+
+    /// The lower (0) or upper (1) bounds of the children, so slab tests can pick planes by direction sign
+    const float (&bounds(int i) const)[3][Width] {return i ? pMax : pMin;}
+};
+
+/**
+    A node of a wide BBH whose child bounds are quantized to 8 bits per
+    coordinate, relative to the bounds of the node itself.
+
+    Along each axis \c a, child \c i spans
+    origin[a] + 2^exponent[a] * [qMin[a][i], qMax[a][i]]. The quantized
+    bounds are rounded outwards, so they always enclose the exact bounds of
+    the child. A 4-wide node fits into a single 64-byte cache line, half the
+    size of a \ref BBHWideNode.
+ */
+template <int Width>
+struct alignas(64) BBHQuantizedNode
+{
+    float origin[3];                    ///< Lower corner of the node
+    int8_t exponent[3];                 ///< Exponent of the quantization step, per axis
+    uint8_t numChildren;                ///< Number of used child slots
+    uint8_t qMin[3][Width];             ///< Quantized lower bounds of the children, per axis
+    uint8_t qMax[3][Width];             ///< Quantized upper bounds of the children, per axis
+    uint32_t offset[Width];             ///< Child node index, or first primitive of a leaf child
+    uint16_t numPrimitives[Width];      ///< Number of primitives of leaf children (0 for interior children)
+
+    BBHQuantizedNode() {std::memset(this, 0, sizeof(*this));}
+
+    /// Quantize the children of \c node, conservatively
+    explicit BBHQuantizedNode(const BBHWideNode<Width> & node);
+
+    /// The quantization step along \c axis
+    float scale(int axis) const
+    {
+        uint32_t bits = uint32_t(exponent[axis] + 127) << 23;
+        float result;
+        std::memcpy(&result, &bits, sizeof(result));
+        return result;
+    }
+
+    /// The quantized lower (0) or upper (1) bounds of the children (see \ref BBHWideNode::bounds)
+    const uint8_t (&bounds(int i) const)[3][Width] {return i ? qMax : qMin;}
+};
+
+/**
+    A wide (4- or 8-ary) bounding box hierarchy.
+
+    The wide hierarchy is created by collapsing a binary \ref BBHTree: each
+    wide node absorbs the largest interior nodes below it until it has
+    \c Width children. Leaves reference the same primitive ranges as the
+    leaves of the binary tree.
+
+    If \c Quantized is true, the nodes store their child bounds in the
+    compressed \ref BBHQuantizedNode format, which halves the memory of the
+    hierarchy at the cost of slightly looser bounds.
+ */
+template <int Width, bool Quantized>
+class BBHWideTree
+{
+    static_assert(Width == 4 || Width == 8, "Wide BBHs must have 4 or 8 children per node");
+
+public:
+    typedef typename std::conditional<Quantized, BBHQuantizedNode<Width>, BBHWideNode<Width>>::type Node;
+    typedef vector<Node, PageAlignedAllocator<Node>> NodeVector;
+
+    /**
+        Collapse the binary hierarchy \ref tree into a wide hierarchy.
+
+        The nodes are stored in depth-first order, unless \c treelets is
+        set: then they are grouped into treelets of up to a page of the
+        nodes most likely to be visited after the treelet's root (by their
+        surface areas), so that traversal touches fewer cache lines and
+        pages. The nodes start on a page boundary, and a treelet that would
+        straddle two pages is moved to the next one, leaving unused nodes
+        behind, so each treelet lies within a single page.
+     */
+    void build(const BBHTree & tree, bool treelets = false);
+
+    /// Release the nodes of the hierarchy
+    void clear() {m_nodes.clear(); m_nodes.shrink_to_fit();}
+
+    bool empty() const {return m_nodes.empty();}
+
+    /// The nodes of the hierarchy, including the unused nodes that pad treelets to page boundaries
+    const NodeVector & nodes() const {return m_nodes;}
+
+    /// Append the primitive range (first, count) of every leaf to \c leaves, in no particular order
+    void leafRanges(vector<std::pair<uint32_t, uint32_t>> & leaves) const;
+
+    /**
+        Intersect a ray against the hierarchy.
+
+        Children of each node are intersected with a single SIMD slab test
+        and visited in front-to-back order. The ray is shortened whenever a
+        closer hit is found. See \ref BBHTree::intersect for the signature
+        of \c intersectPrimitive.
+     */
+    template <typename PrimitiveFunc>
+    bool intersect(const Ray3f &ray, HitInfo &hit, PrimitiveFunc && intersectPrimitive) const
+    {
+        typedef typename std::remove_reference<PrimitiveFunc>::type Func;
+        return intersectLeaves(ray, hit, BBHEachPrimitive<Func>{intersectPrimitive});
+    }
+
+    /// Like \ref intersect, but testing whole leaves at once (see \ref BBHTree::intersectLeaves)
+    template <typename LeafFunc>
+    bool intersectLeaves(const Ray3f &_ray, HitInfo &hit, LeafFunc && intersectLeaf) const
+    {
+        if (m_nodes.empty())
+            return false;
+
+        // copy the ray so we can shorten it as we find closer hits
+        Ray3f ray = _ray;
+        bool hitSomething = false;
+        PrecomputedRay3f rd(ray);
+
+        StackEntry stack[MaxStackSize];
+        int stackSize = 0;
+        uint32_t current = 0;
+        while (true)
+        {
+            INCREMENT_NODES_VISITED;
+            pushChildren(m_nodes[current], rd, ray, stack, stackSize);
+
+            // pop the next entry that still starts before the closest hit
+            bool foundNode = false;
+            while (stackSize > 0)
+            {
+                const StackEntry & entry = stack[--stackSize];
+                if (entry.tNear > ray.maxt)
+                    continue;
+
+                if (entry.numPrimitives == 0)
+                {
+                    current = entry.offset;
+                    foundNode = true;
+                    break;
+                }
+
+                if (intersectLeaf(entry.offset, entry.numPrimitives, ray, hit))
+                    hitSomething = true;
+            }
+            if (!foundNode)
+                break;
+        }
+
+        return hitSomething;
+    }
+
+    /**
+        Determine whether the ray hits any primitive in the hierarchy.
+
+        See \ref BBHTree::occluded for the signature of \c occludedPrimitive.
+     */
+    template <typename PrimitiveFunc>
+    bool occluded(const Ray3f &ray, PrimitiveFunc && occludedPrimitive) const
+    {
+        typedef typename std::remove_reference<PrimitiveFunc>::type Func;
+        return occludedLeaves(ray, BBHAnyPrimitive<Func>{occludedPrimitive});
+    }
+
+    /// Like \ref occluded, but testing whole leaves at once (see \ref BBHTree::occludedLeaves)
+    template <typename LeafFunc>
+    bool occludedLeaves(const Ray3f &ray, LeafFunc && occludedLeaf) const
+    {
+        if (m_nodes.empty())
+            return false;
+
+        PrecomputedRay3f rd(ray);
+
+        StackEntry stack[MaxStackSize];
+        int stackSize = 0;
+        uint32_t current = 0;
+        while (true)
+        {
+            INCREMENT_NODES_VISITED;
+            pushChildren(m_nodes[current], rd, ray, stack, stackSize);
+
+            bool foundNode = false;
+            while (stackSize > 0)
+            {
+                const StackEntry & entry = stack[--stackSize];
+                if (entry.numPrimitives == 0)
+                {
+                    current = entry.offset;
+                    foundNode = true;
+                    break;
+                }
+
+                if (occludedLeaf(entry.offset, entry.numPrimitives, ray))
+                    return true;
+            }
+            if (!foundNode)
+                return false;
+        }
+    }
+
+private:
+    static constexpr int MaxStackSize = Width * BBHTree::MaxDepth;
+
+    struct StackEntry
+    {
+        uint32_t offset;
+        uint32_t numPrimitives;
+        float tNear;
+    };
+
+    /**
+        Intersect the ray with the bounds of all children of \c node.
+
+        \return A bit mask of the children that are hit. The entry distance of
+                each child is stored in \c tNear.
+     */
+    static int intersectChildren(const BBHWideNode<Width> & node, const PrecomputedRay3f & rd,
+                                 float mint, float maxt, float tNear[Width])
+    {
+#if defined(__AVX__)
+        if (Width == 8)
+        {
+            __m256 tMin = _mm256_set1_ps(mint), tMax = _mm256_set1_ps(maxt);
+            for (int a = 0; a < 3; ++a)
+            {
+                __m256 nearPlanes = _mm256_load_ps(node.bounds(rd.dirIsNeg[a])[a]);
+                __m256 farPlanes = _mm256_load_ps(node.bounds(1 - rd.dirIsNeg[a])[a]);
+                __m256 o = _mm256_set1_ps(rd.o[a]), invD = _mm256_set1_ps(rd.invD[a]);
+                __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(nearPlanes, o), invD);
+                __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(farPlanes, o), invD);
+                // NaNs (from 0 * inf) leave the current interval unchanged
+                tMin = _mm256_max_ps(t0, tMin);
+                tMax = _mm256_min_ps(t1, tMax);
+            }
+            _mm256_storeu_ps(tNear, tMin);
+            return _mm256_movemask_ps(_mm256_cmp_ps(tMin, tMax, _CMP_LE_OQ));
+        }
+#endif
+#if defined(DIRT_WIDE_BBH_SSE)
+        int mask = 0;
+        for (int k = 0; k < Width; k += 4)
+        {
+            __m128 tMin = _mm_set1_ps(mint), tMax = _mm_set1_ps(maxt);
+            for (int a = 0; a < 3; ++a)
+            {
+                __m128 nearPlanes = _mm_load_ps(node.bounds(rd.dirIsNeg[a])[a] + k);
+                __m128 farPlanes = _mm_load_ps(node.bounds(1 - rd.dirIsNeg[a])[a] + k);
+                __m128 o = _mm_set1_ps(rd.o[a]), invD = _mm_set1_ps(rd.invD[a]);
+                __m128 t0 = _mm_mul_ps(_mm_sub_ps(nearPlanes, o), invD);
+                __m128 t1 = _mm_mul_ps(_mm_sub_ps(farPlanes, o), invD);
+                // NaNs (from 0 * inf) leave the current interval unchanged
+                tMin = _mm_max_ps(t0, tMin);
+                tMax = _mm_min_ps(t1, tMax);
+            }
+            _mm_storeu_ps(tNear + k, tMin);
+            mask |= _mm_movemask_ps(_mm_cmple_ps(tMin, tMax)) << k;
+        }
+        return mask;
+#else
+        int mask = 0;
+        for (int i = 0; i < Width; ++i)
+        {
+            float tMin = mint, tMax = maxt;
+            for (int a = 0; a < 3; ++a)
+            {
+                float t0 = (node.bounds(rd.dirIsNeg[a])[a][i] - rd.o[a]) * rd.invD[a];
+                float t1 = (node.bounds(1 - rd.dirIsNeg[a])[a][i] - rd.o[a]) * rd.invD[a];
+                tMin = t0 > tMin ? t0 : tMin;
+                tMax = t1 < tMax ? t1 : tMax;
+            }
+            tNear[i] = tMin;
+            mask |= int(tMin <= tMax) << i;
+        }
+        return mask;
+#endif
+    }
+
+    /// Bound on the relative rounding error of \c n floating point operations (see pbrt's gamma)
+    static constexpr float gamma(int n)
+    {
+        return n * 0.5f * std::numeric_limits<float>::epsilon() /
+               (1.f - n * 0.5f * std::numeric_limits<float>::epsilon());
+    }
+
+    /**
+        Intersect the ray with the quantized bounds of all children of \c node.
+
+        Instead of decoding the bounds, the slab distances are computed
+        directly from the quantized coordinates: for a plane at
+        origin + q * scale, t = (origin - o) / d + q * (scale / d).
+
+        This rounds differently from a slab test against the decoded planes,
+        by up to gamma(4) (|base| + |q * step|) per distance, which the
+        outward rounding of the quantized bounds does not cover. So the far
+        distances are pushed out by twice the largest such error along each
+        axis, which keeps the test conservative for grazing rays.
+     */
+    static int intersectChildren(const BBHQuantizedNode<Width> & node, const PrecomputedRay3f & rd,
+                                 float mint, float maxt, float tNear[Width])
+    {
+        float base[3], step[3], slack[3];
+        for (int a = 0; a < 3; ++a)
+        {
+            base[a] = (node.origin[a] - rd.o[a]) * rd.invD[a];
+            step[a] = node.scale(a) * rd.invD[a];
+            // rays parallel to the slabs (infinite distances) need no slack
+            slack[a] = 2.f * gamma(4) * (std::abs(base[a]) + 255.f * std::abs(step[a]));
+            if (!(slack[a] < std::numeric_limits<float>::infinity()))
+                slack[a] = 0.f;
+        }
+
+        int mask = 0;
+#if defined(DIRT_WIDE_BBH_SSE)
+        const __m128i zero = _mm_setzero_si128();
+        for (int k = 0; k < Width; k += 4)
+        {
+            __m128 tMin = _mm_set1_ps(mint), tMax = _mm_set1_ps(maxt);
+            for (int a = 0; a < 3; ++a)
+            {
+                int32_t lo, hi;
+                std::memcpy(&lo, node.bounds(rd.dirIsNeg[a])[a] + k, sizeof(lo));
+                std::memcpy(&hi, node.bounds(1 - rd.dirIsNeg[a])[a] + k, sizeof(hi));
+                // widen the 8-bit coordinates of 4 children to floats
+                __m128 qNear = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(lo), zero), zero));
+                __m128 qFar = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(hi), zero), zero));
+                __m128 b = _mm_set1_ps(base[a]), st = _mm_set1_ps(step[a]);
+                __m128 t0 = _mm_add_ps(b, _mm_mul_ps(qNear, st));
+                __m128 t1 = _mm_add_ps(_mm_add_ps(b, _mm_mul_ps(qFar, st)), _mm_set1_ps(slack[a]));
+                // NaNs (from 0 * inf) leave the current interval unchanged
+                tMin = _mm_max_ps(t0, tMin);
+                tMax = _mm_min_ps(t1, tMax);
+            }
+            _mm_storeu_ps(tNear + k, tMin);
+            mask |= _mm_movemask_ps(_mm_cmple_ps(tMin, tMax)) << k;
+        }
+#else
+        for (int i = 0; i < Width; ++i)
+        {
+            float tMin = mint, tMax = maxt;
+            for (int a = 0; a < 3; ++a)
+            {
+                float t0 = base[a] + node.bounds(rd.dirIsNeg[a])[a][i] * step[a];
+                float t1 = base[a] + node.bounds(1 - rd.dirIsNeg[a])[a][i] * step[a] + slack[a];
+                tMin = t0 > tMin ? t0 : tMin;
+                tMax = t1 < tMax ? t1 : tMax;
+            }
+            tNear[i] = tMin;
+            mask |= int(tMin <= tMax) << i;
+        }
+#endif
+        return mask & ((1 << node.numChildren) - 1);
+    }
+
+    /// Push all children of \c node hit by the ray, so the nearest is popped first
+    static void pushChildren(const Node & node, const PrecomputedRay3f & rd,
+                             const Ray3f & ray, StackEntry * stack, int & stackSize)
+    {
+        float tNear[Width];
+        int mask = intersectChildren(node, rd, ray.mint, ray.maxt, tNear);
+
+        int first = stackSize;
+        for (int i = 0; i < Width; ++i)
+        {
+            if (!(mask & (1 << i)))
+                continue;
+
+            // insertion sort by decreasing entry distance
+            StackEntry entry = {node.offset[i], node.numPrimitives[i], tNear[i]};
+            int j = stackSize++;
+            while (j > first && stack[j-1].tNear < entry.tNear)
+            {
+                stack[j] = stack[j-1];
+                --j;
+            }
+            stack[j] = entry;
+        }
+    }
+
+    NodeVector m_nodes;
+};
+
+extern template struct BBHQuantizedNode<4>;
+extern template struct BBHQuantizedNode<8>;
+extern template class BBHWideTree<4, false>;
+extern template class BBHWideTree<8, false>;
+extern template class BBHWideTree<4, true>;
+extern template class BBHWideTree<8, true>;
@@ -21,6 +21,7 @@
 #include <dirt/scene.h>
 #include <dirt/argparse.h>
 #include <time.h>  
+#include <fstream>
 #include <filesystem/resolver.h>
 
 // runs the raytrace over all tests and saves the corresponding images
@@ -35,7 +36,8 @@ int main(int argc, char** argv)
                                    {"help", "h",  "Display this help screen and quit", typeid(bool), true, json()},
 	                               {"outfile", "o",  "Specify the output image filename (extension must be one of: .png, .jpg, .hdr, .bmp, or .tga)", typeid(string), true, json()},
                                    {"format", "f",  "Specify just the output image format (png, jpg, hdr, bmp, or tga)", typeid(string), true, "png"},
-                                   {"verbosity", "v",  "Specify the level of verbosity [0,1,2,3, or 4]", typeid(int), true, 3}
+                                   {"verbosity", "v",  "Specify the level of verbosity [0,1,2,3, or 4]", typeid(int), true, 3},
+                                   {"stats", "s",  "Also write the acceleration structure and traversal statistics to this JSON file", typeid(string), true, json()}
                                },
                                {
                                    {"scene.json", "",  "The filename of the JSON scenefile to load (or the string \"testsceneX\", where X is 0, 1, 2, or 3).", typeid(string), false, json("")},
@@ -97,6 +99,16 @@ int main(int argc, char** argv)
 
         message("Average number of intersection tests per ray: %f \n",
                 float(intersection_tests) / float(rays_traced));
+
+        json stats = renderStats(*scene);
+        message("%s", renderStatsString(stats));
+        if (!args["stats"].empty())
+        {
+            std::ofstream statsFile(args["stats"].get<string>());
+            statsFile << stats.dump(4) << std::endl;
+            if (!statsFile.good())
+                throw DirtException("Cannot write statistics file '%s'.", args["stats"].get<string>());
+        }
         message("Writing rendered image to file \"%s\"...\n", outFile);
 
         image.save(outFile);
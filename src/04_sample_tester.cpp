@@ -54,8 +54,25 @@ int main(int argc, char** argv)
 	mesh->F = {{0, 1, 2}};
 	auto triangle = make_shared<Triangle>(scene, json(), mesh, 0);
 
+	// a small and a large face, so that sampling the mesh has to pick faces by area
+	auto twoFaces = make_shared<Mesh>();
+	twoFaces->V = {{-0.5f, 0.2f, -1.0f}, {0.5f, 0.375f, -1.0f}, {-0.5f, 0.2f, 1.0f},
+	               {0.2f, -0.5f, 0.5f}, {0.3f, -0.5f, 0.5f}, {0.2f, -0.4f, 0.6f}};
+	twoFaces->F = {{0, 1, 2}, {3, 4, 5}};
+	twoFaces->build();
+
+	// a planar quad whose two triangles differ in area, referenced as a single face
+	auto quadMesh = make_shared<Mesh>();
+	quadMesh->V = {{-0.5f, 0.2f, -1.0f}, {0.5f, 0.375f, -1.0f}, {0.3f, 0.34f, 0.8f}, {-0.5f, 0.2f, 0.5f}};
+	quadMesh->F = {{0, 1, 2}};
+	quadMesh->Q = {3};
+	quadMesh->build();
+	auto quadFace = make_shared<Triangle>(scene, json(), quadMesh, 0);
+
     SampleTester tester;
     tester.runTest(triangle, "triangle");
+    tester.runTest(twoFaces, "mesh"    );
+    tester.runTest(quadFace, "quad face");
     tester.runTest(  sphere, "sphere"  );
     tester.runTest(    quad, "quad"    );
     return 0;
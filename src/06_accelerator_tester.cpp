@@ -0,0 +1,180 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirt/common.h>
+#include <dirt/parser.h>
+#include <dirt/sampling.h>
+#include <dirt/scene.h>
+#include <filesystem/resolver.h>
+
+#include <fstream>
+#include <iostream>
+
+/*
+    Traces the same random rays through a scene with every acceleration
+    structure, and compares the hits against those of plain SurfaceGroups,
+    which intersect all of their surfaces one by one.
+
+    Usage: 06_accelerator_tester [scene.json]
+
+    The scene defaults to scenes/tests/accelerators.json, which mixes
+    spheres, quads, and a mesh with quad faces, used directly, transformed,
+    and through instances, whose thin slanted faces exercise spatial splits.
+    Each accelerator is used for the whole scene and for all of its meshes.
+ */
+
+namespace
+{
+
+const int NumRays = 20000;
+
+// relative difference in hit distance that still counts as the same hit
+const float DistanceTolerance = 1e-4f;
+
+const json Accelerators[] = {
+    {{"type", "bbh"}},
+    {{"type", "bbh"}, {"split", "sah"}},
+    {{"type", "bbh"}, {"split", "sah"}, {"sah_leaves", true}, {"max_leaf_size", 8}},
+    {{"type", "bbh"}, {"split", "sah"}, {"width", 4}},
+    {{"type", "bbh"}, {"split", "sah"}, {"width", 8}},
+    {{"type", "bbh"}, {"split", "sah"}, {"width", 4}, {"quantized", true}},
+    {{"type", "bbh"}, {"split", "sah"}, {"width", 8}, {"quantized", true}},
+    {{"type", "bbh"}, {"split", "sah"}, {"width", 4}, {"layout", "treelet"}},
+    {{"type", "bbh"}, {"split", "sah"}, {"width", 8}, {"quantized", true}, {"layout", "treelet"}},
+    {{"type", "bbh"}, {"split", "sah"}, {"spatial_splits", true}},
+    {{"type", "bbh"}, {"split", "sah"}, {"spatial_splits", true}, {"width", 4}},
+    {{"type", "lbvh"}},
+    {{"type", "lbvh"}, {"restructure", true}, {"width", 8}},
+    {{"type", "kdtree"}},
+    {{"type", "grid"}},
+    {{"type", "grid"}, {"refine", true}, {"refine_threshold", 4}},
+    {{"type", "auto"}}
+};
+
+// set the accelerator of the scene and of all of its meshes
+json withAccelerator(json j, const json & spec)
+{
+    j["accelerator"] = spec;
+    for (auto key : {"meshes", "surfaces"})
+    {
+        if (!j.contains(key))
+            continue;
+        for (auto & s : j[key])
+            if (key == string("meshes") || s.value("type", "") == "mesh")
+                s["accelerator"] = spec;
+    }
+    return j;
+}
+
+// random rays from within (a slightly enlarged) box, half of them aimed into it
+vector<Ray3f> randomRays(const Box3f & box)
+{
+    Vec3f margin = 0.1f * box.diagonal();
+    Box3f outer(box.pMin - margin, box.pMax + margin);
+
+    vector<Ray3f> rays;
+    rays.reserve(NumRays);
+    for (int i = 0; i < NumRays; ++i)
+    {
+        Vec3f o = outer.pMin + Vec3f(randf(), randf(), randf()) * outer.diagonal();
+        Vec3f d(0.f);
+        if (i % 16 == 0)
+            // axis-aligned rays have infinite reciprocal directions
+            d[i / 16 % 3] = randf() < 0.5f ? -1.f : 1.f;
+        else if (i % 2 == 0)
+            d = randomOnUnitSphere(Vec2f(randf(), randf()));
+        else
+            d = normalize(box.pMin + Vec3f(randf(), randf(), randf()) * box.diagonal() - o);
+        rays.emplace_back(o, d);
+    }
+    return rays;
+}
+
+bool sameHit(bool hitA, const HitInfo & a, bool hitB, const HitInfo & b)
+{
+    return hitA == hitB && (!hitA || std::abs(a.t - b.t) <= DistanceTolerance * std::max(1.f, b.t));
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    string filename = argc > 1 ? argv[1] : "scenes/tests/accelerators.json";
+    std::ifstream stream(filename, std::ifstream::in);
+    if (!stream.good())
+    {
+        std::cerr << "Cannot open file: " << filename << std::endl;
+        return 1;
+    }
+    json j;
+    stream >> j;
+
+    // OBJ files are relative to the scene file
+    getFileResolver().prepend(filesystem::path(filename).parent_path());
+    setVerbosity(int(Verbosity::Error));
+
+    json group = {{"type", "group"}};
+    Scene reference(withAccelerator(j, group));
+    vector<Ray3f> rays = randomRays(reference.worldBBox());
+
+    vector<HitInfo> expected(rays.size());
+    vector<char> expectedHit(rays.size());
+    int numHits = 0;
+    for (size_t i = 0; i < rays.size(); ++i)
+        numHits += expectedHit[i] = reference.intersect(rays[i], expected[i]);
+    std::cout << "Tracing " << rays.size() << " rays through \"" << filename << "\" ("
+              << numHits << " hit the reference)" << std::endl;
+
+    int failures = 0;
+    for (auto & spec : Accelerators)
+    {
+        Scene scene(withAccelerator(j, spec));
+
+        int intersectErrors = 0, occludedErrors = 0, packetErrors = 0;
+        for (size_t i = 0; i < rays.size(); ++i)
+        {
+            HitInfo hit;
+            bool hitSomething = scene.intersect(rays[i], hit);
+            intersectErrors += !sameHit(hitSomething, hit, expectedHit[i], expected[i]);
+            occludedErrors += scene.occluded(rays[i]) != bool(expectedHit[i]);
+        }
+
+        // packets of consecutive (incoherent) rays
+        for (size_t first = 0; first < rays.size(); first += RayPacket::MaxSize)
+        {
+            RayPacket packet;
+            HitInfo hits[RayPacket::MaxSize];
+            packet.size = int(std::min(rays.size() - first, size_t(RayPacket::MaxSize)));
+            for (int i = 0; i < packet.size; ++i)
+                packet.set(i, rays[first + i]);
+            uint32_t hitMask = scene.intersectPacket(packet, packet.fullMask(), hits);
+            for (int i = 0; i < packet.size; ++i)
+                packetErrors += !sameHit(hitMask & (1u << i), hits[i], expectedHit[first + i], expected[first + i]);
+        }
+
+        int errors = intersectErrors + occludedErrors + packetErrors;
+        failures += errors > 0;
+        std::cout << (errors ? "FAILED " : "passed ") << spec.dump() << ": " << intersectErrors
+                  << " intersect, " << occludedErrors << " occluded, " << packetErrors
+                  << " packet mismatches" << std::endl;
+    }
+
+    std::cout << failures << " of " << sizeof(Accelerators) / sizeof(Accelerators[0])
+              << " accelerators disagreed with the reference" << std::endl;
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,118 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirt/traversal.h>
+#include <unordered_set>
+
+Accelerator::~Accelerator()
+{
+}
+
+void Accelerator::build()
+{
+    // a rebuild after spatial splits (or of a kd-tree or grid) starts from
+    // the distinct surfaces again
+    if (m_duplicated)
+    {
+        std::unordered_set<const SurfaceBase *> seen;
+        vector<shared_ptr<SurfaceBase>> distinct;
+        for (auto & surface : m_surfaces)
+            if (seen.insert(surface.get()).second)
+                distinct.push_back(surface);
+        m_surfaces.swap(distinct);
+    }
+
+    vector<Box3f> bounds(m_surfaces.size());
+    for (auto i : range(m_surfaces.size()))
+        bounds[i] = m_surfaces[i]->worldBBox();
+
+    vector<uint32_t> order;
+    buildPrimitives(bounds, order);
+    m_duplicated = order.size() > bounds.size();
+
+    // store the surfaces of each leaf contiguously (surfaces referenced from
+    // several leaves are stored once per leaf)
+    vector<shared_ptr<SurfaceBase>> ordered(order.size());
+    for (auto i : range(order.size()))
+        ordered[i] = m_surfaces[order[i]];
+    m_surfaces.swap(ordered);
+    m_leafPrimitives.build(m_surfaces);
+}
+
+void Accelerator::refit()
+{
+    vector<Box3f> bounds(m_surfaces.size());
+    m_localBBox = Box3f();
+    for (auto i : range(m_surfaces.size()))
+    {
+        bounds[i] = m_surfaces[i]->worldBBox();
+        m_localBBox.enclose(bounds[i]);
+    }
+
+    if (!refitPrimitives(bounds))
+        build();
+    else
+        m_leafPrimitives.build(m_surfaces);
+}
+
+bool Accelerator::refitPrimitives(const vector<Box3f> & bounds)
+{
+    return bounds.empty();
+}
+
+void Accelerator::addAccelerationStats(json & stats) const
+{
+    std::unordered_set<const SurfaceBase *> distinct;
+    for (auto & surface : m_surfaces)
+        distinct.insert(surface.get());
+
+    json tree = treeStats();
+    tree["surface"] = "group";
+    tree["primitives"] = distinct.size();
+    stats.push_back(tree);
+    SurfaceGroup::addAccelerationStats(stats);
+}
+
+bool Accelerator::intersectCandidate(const Ray3f &ray, HitInfo &hit) const
+{
+    return intersectPrimitives(ray, hit, [this](uint32_t i, const Ray3f & ray, HitInfo & hit)
+    {
+        return m_leafPrimitives.intersectCandidate(i, ray, hit);
+    });
+}
+
+bool Accelerator::occluded(const Ray3f &ray) const
+{
+    return occludedPrimitives(ray, [this](uint32_t i, const Ray3f & ray)
+    {
+        return m_leafPrimitives.occluded(i, ray);
+    });
+}
+
+uint32_t Accelerator::intersectPacketCandidates(RayPacket &packet, uint32_t activeMask, HitInfo *hits) const
+{
+    return intersectPacketPrimitives(packet, activeMask, hits,
+        [this](uint32_t i, RayPacket & packet, uint32_t mask, HitInfo * hits)
+        {
+            return m_leafPrimitives.intersectPacketCandidates(i, packet, mask, hits);
+        },
+        [this](uint32_t i, const Ray3f & ray, HitInfo & hit)
+        {
+            return m_leafPrimitives.intersectCandidate(i, ray, hit);
+        });
+}
@@ -0,0 +1,241 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirt/autoaccelerator.h>
+#include <dirt/camera.h>
+#include <dirt/parser.h>
+#include <dirt/sampling.h>
+#include <dirt/scene.h>
+#include <dirt/sphere.h>
+#include <algorithm>
+#include <chrono>
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+// below this many primitives a linear scan beats any hierarchy
+const size_t MaxGroupSize = 4;
+// smallest number of primitives that is worth a grid or a wider hierarchy
+const size_t LargeSetSize = 10000;
+
+// the fraction of spheres among the surfaces and the coefficient of
+// variation of the lengths of their bounding box diagonals
+void classify(const vector<shared_ptr<SurfaceBase>> & surfaces, float & sphereFraction, float & sizeVariation)
+{
+    size_t spheres = 0;
+    double sum = 0.0, sumSquares = 0.0;
+    for (auto & surface : surfaces)
+    {
+        if (dynamic_cast<const Sphere *>(surface.get()))
+            ++spheres;
+        double size = length(surface->worldBBox().diagonal());
+        sum += size;
+        sumSquares += size * size;
+    }
+
+    size_t n = surfaces.size();
+    sphereFraction = n ? float(spheres) / n : 0.f;
+    double mean = n ? sum / n : 0.0;
+    double variance = n ? std::max(0.0, sumSquares / n - mean * mean) : 0.0;
+    sizeVariation = mean > 0.0 ? float(std::sqrt(variance) / mean) : 0.f;
+}
+
+// time (in microseconds) to trace all rays through the accelerator, taking
+// the fastest of a few passes to filter out noise
+int64_t traceTime(const SurfaceGroup & accelerator, const vector<Ray3f> & rays)
+{
+    int64_t best = std::numeric_limits<int64_t>::max();
+    for (int pass = 0; pass < 3; ++pass)
+    {
+        auto start = Clock::now();
+        HitInfo hit;
+        for (auto & ray : rays)
+            accelerator.intersect(ray, hit);
+        best = std::min(best, int64_t(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count()));
+    }
+    return best;
+}
+
+} // namespace
+
+
+AutoAccelerator::AutoAccelerator(const Scene & scene, const json & j)
+    : m_scene(scene)
+{
+    m_probe = j.value("probe", m_probe);
+    m_probeRays = j.value("probe_rays", m_probeRays);
+    if (j.contains("candidates"))
+    {
+        m_candidates = j["candidates"];
+        if (!m_candidates.is_array() || m_candidates.empty())
+            throw DirtException("\"candidates\" must be a non-empty array of \"accelerator\" specifications here:\n%s",
+                                j.dump(4));
+        for (auto & c : m_candidates)
+            if (c.value("type", "") == "auto")
+                throw DirtException("\"candidates\" cannot contain an \"auto\" accelerator here:\n%s", j.dump(4));
+        m_probe = j.value("probe", true);
+    }
+    if (m_probeRays < 1)
+        throw DirtException("\"probe_rays\" must be positive here:\n%s", j.dump(4));
+}
+
+json AutoAccelerator::heuristic(size_t numPrimitives, float sphereFraction, float sizeVariation)
+{
+    if (numPrimitives <= MaxGroupSize)
+        return {{"type", "group"}};
+
+    // a uniform grid is hard to beat on many similarly sized primitives,
+    // and spheres are compact enough that they rarely straddle many cells
+    if (numPrimitives >= LargeSetSize && sphereFraction >= 0.9f && sizeVariation <= 0.5f)
+        return {{"type", "grid"}};
+
+    if (numPrimitives >= LargeSetSize)
+        return {{"type", "bbh"}, {"split", "sah"}, {"width", 4}};
+
+    return {{"type", "bbh"}, {"split", "sah"}};
+}
+
+shared_ptr<SurfaceGroup> AutoAccelerator::probe(json & choice, float sphereFraction, string & reason) const
+{
+    json candidates = m_candidates;
+    if (candidates.is_null())
+    {
+        candidates = json::array({choice,
+                                  {{"type", "bbh"}, {"split", "sah"}},
+                                  {{"type", "bbh"}, {"split", "sah"}, {"width", 4}},
+                                  {{"type", "lbvh"}}});
+        if (sphereFraction >= 0.5f)
+            candidates.push_back({{"type", "grid"}});
+        if (m_surfaces.size() <= 100000)
+            candidates.push_back({{"type", "kdtree"}});
+    }
+
+    // half of the probe rays come from the camera (if the scene has one),
+    // the other half start anywhere within the scene in random directions
+    vector<Ray3f> rays;
+    rays.reserve(m_probeRays);
+    pcg32 rng;
+    auto camera = m_scene.camera();
+    int cameraRays = camera ? m_probeRays / 2 : 0;
+    for (int i = 0; i < cameraRays; ++i)
+    {
+        Vec2i res = camera->resolution();
+        rays.push_back(camera->generateRay(rng.nextFloat() * res.x, rng.nextFloat() * res.y));
+    }
+    Box3f bounds = m_localBBox;
+    for (int i = cameraRays; i < m_probeRays; ++i)
+    {
+        Vec3f t(rng.nextFloat(), rng.nextFloat(), rng.nextFloat());
+        Vec3f o = bounds.pMin + t * bounds.diagonal();
+        rays.emplace_back(o, randomOnUnitSphere(Vec2f(rng.nextFloat(), rng.nextFloat())));
+    }
+
+    // probing must not show up in the render statistics
+    uint64_t savedTests = intersection_tests, savedRays = rays_traced, savedNodes = nodes_visited;
+
+    shared_ptr<SurfaceGroup> best;
+    int64_t bestTime = std::numeric_limits<int64_t>::max();
+    vector<json> probed;
+    vector<string> timings;
+    for (auto & candidate : candidates)
+    {
+        if (std::find(probed.begin(), probed.end(), candidate) != probed.end())
+            continue;
+        probed.push_back(candidate);
+
+        auto accelerator = parseAccelerator(m_scene, candidate);
+        for (auto & surface : m_surfaces)
+            accelerator->addChild(surface);
+        accelerator->build();
+
+        int64_t time = traceTime(*accelerator, rays);
+        timings.push_back(tfm::format("%s: %.2f ms", candidate.dump(), time / 1000.0));
+        if (time < bestTime)
+        {
+            bestTime = time;
+            best = accelerator;
+            choice = candidate;
+        }
+    }
+
+    intersection_tests = savedTests;
+    rays_traced = savedRays;
+    nodes_visited = savedNodes;
+
+    reason = tfm::format("fastest on %d probe rays (%d from the camera) among ", rays.size(), cameraRays);
+    for (size_t i = 0; i < timings.size(); ++i)
+        reason += (i ? ", " : "") + timings[i];
+    return best;
+}
+
+void AutoAccelerator::build()
+{
+    float sphereFraction, sizeVariation;
+    classify(m_surfaces, sphereFraction, sizeVariation);
+    json choice = heuristic(m_surfaces.size(), sphereFraction, sizeVariation);
+    string reason = tfm::format("heuristic for %d surfaces, %.0f%% spheres, size variation %.2f",
+                                m_surfaces.size(), 100.f * sphereFraction, sizeVariation);
+
+    // probing keeps the fastest candidate, which is already built
+    m_chosen = nullptr;
+    if (m_probe && m_surfaces.size() > MaxGroupSize)
+        m_chosen = probe(choice, sphereFraction, reason);
+
+    message("Auto accelerator chose %s (%s)\n", choice.dump(), reason);
+
+    if (!m_chosen)
+    {
+        m_chosen = parseAccelerator(m_scene, choice);
+        for (auto & surface : m_surfaces)
+            m_chosen->addChild(surface);
+        m_chosen->build();
+    }
+}
+
+void AutoAccelerator::refit()
+{
+    m_chosen->refit();
+    m_localBBox = m_chosen->localBBox();
+}
+
+bool AutoAccelerator::intersect(const Ray3f &ray, HitInfo &hit) const
+{
+    return m_chosen->intersect(ray, hit);
+}
+
+bool AutoAccelerator::intersectCandidate(const Ray3f &ray, HitInfo &hit) const
+{
+    return m_chosen->intersectCandidate(ray, hit);
+}
+
+bool AutoAccelerator::occluded(const Ray3f &ray) const
+{
+    return m_chosen->occluded(ray);
+}
+
+uint32_t AutoAccelerator::intersectPacketCandidates(RayPacket &packet, uint32_t activeMask, HitInfo *hits) const
+{
+    return m_chosen->intersectPacketCandidates(packet, activeMask, hits);
+}
+
+void AutoAccelerator::addAccelerationStats(json & stats) const
+{
+    m_chosen->addAccelerationStats(stats);
+}
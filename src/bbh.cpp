@@ -17,96 +17,1079 @@
 */
 
 #include <dirt/bbh.h>
+#include <dirt/bbhcache.h>
+#include <dirt/widebbh.h>
+#include <filesystem/resolver.h>
+#include <dirt/parallel.h>
+#include <algorithm>
+#include <chrono>
+#include <future>
 
-BBHNode::BBHNode(vector<shared_ptr<SurfaceBase>> primitives, Progress & progress)
+namespace
 {
-    if (primitives.size() == 1)
+
+using PrimIterator = vector<BBHPrimitiveInfo>::iterator;
+using Clock = std::chrono::steady_clock;
+
+// below this depth, nodes are split at the median primitive to bound the
+// depth of the hierarchy (and therefore the size of the traversal stack)
+const int MaxSAHDepth = BBHTree::MaxDepth / 2;
+
+// subtrees with at least this many primitives are built as separate tasks,
+// which run on another thread whenever one is idle
+const int64_t MinTaskSize = 4096;
+
+// nodes with at least this many primitives compute their bounds, bin and
+// partition their primitives in parallel
+const int64_t MinParallelSplitSize = 128 * 1024;
+
+// state shared by all tasks of a build
+struct BuildContext
+{
+    BuildContext(const BBHSettings & settings, Progress & progress, PrimIterator first, int numThreads) :
+        settings(settings), progress(progress), first(first), numThreads(numThreads), idleThreads(numThreads - 1)
+    {
+    }
+
+    const BBHSettings & settings;
+    Progress & progress;
+    PrimIterator first;                     ///< First primitive of the whole build
+    int numThreads;
+    std::atomic<int> idleThreads;           ///< Threads available to run new tasks
+    std::atomic<int64_t> taskTime {0};      ///< Run time of all spawned tasks (in microseconds)
+    std::atomic<int64_t> waitTime {0};      ///< Time spent waiting for other tasks (in microseconds)
+};
+
+int64_t microseconds(Clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+}
+
+// compute the bounds of a range of primitives and of their centroids
+void computeBounds(PrimIterator begin, PrimIterator end, int numChunks,
+                   Box3f & bounds, Box3f & centroidBounds)
+{
+    vector<Box3f> chunkBounds(numChunks), chunkCentroidBounds(numChunks);
+    parallelFor(end - begin, numChunks, [&](int64_t b, int64_t e, int c)
+    {
+        for (auto it = begin + b; it != begin + e; ++it)
+        {
+            chunkBounds[c].enclose(it->bounds);
+            chunkCentroidBounds[c].enclose(it->centroid);
+        }
+    });
+
+    for (int c = 0; c < numChunks; ++c)
+    {
+        bounds.enclose(chunkBounds[c]);
+        centroidBounds.enclose(chunkCentroidBounds[c]);
+    }
+}
+
+// reorder a range of primitives so that those satisfying pred come first,
+// and return the first primitive that does not
+template <typename Pred>
+PrimIterator partitionPrimitives(PrimIterator begin, PrimIterator end, int numChunks, Pred && pred)
+{
+    int64_t count = end - begin;
+    if (count < MinParallelSplitSize)
+        return std::partition(begin, end, pred);
+
+    // large ranges are partitioned stably, so the result does not depend on
+    // the number of chunks: count the primitives going left in each chunk,
+    // then scatter each chunk to its place in a temporary copy
+    vector<int64_t> numLeft(numChunks, 0);
+    parallelFor(count, numChunks, [&](int64_t b, int64_t e, int c)
+    {
+        for (auto it = begin + b; it != begin + e; ++it)
+            numLeft[c] += pred(*it);
+    });
+
+    vector<int64_t> leftOffset(numChunks), rightOffset(numChunks);
+    int64_t totalLeft = 0, totalRight = 0;
+    for (int c = 0; c < numChunks; ++c)
+    {
+        int64_t chunkSize = count * (c + 1) / numChunks - count * c / numChunks;
+        leftOffset[c] = totalLeft;
+        rightOffset[c] = totalRight;
+        totalLeft += numLeft[c];
+        totalRight += chunkSize - numLeft[c];
+    }
+
+    vector<BBHPrimitiveInfo> partitioned(count);
+    parallelFor(count, numChunks, [&](int64_t b, int64_t e, int c)
+    {
+        int64_t left = leftOffset[c], right = totalLeft + rightOffset[c];
+        for (auto it = begin + b; it != begin + e; ++it)
+            partitioned[pred(*it) ? left++ : right++] = *it;
+    });
+    parallelFor(count, numChunks, [&](int64_t b, int64_t e, int c)
+    {
+        std::copy(partitioned.begin() + b, partitioned.begin() + e, begin + b);
+    });
+
+    return begin + totalLeft;
+}
+
+// split a range of primitives in two halves along a random axis
+PrimIterator splitMedian(PrimIterator begin, PrimIterator end, pcg32 & rng, int & axis)
+{
+    axis = int(rng.nextFloat() * 3.0f);
+    PrimIterator mid = begin + (end - begin) / 2;
+    std::nth_element(begin, mid, end,
+                     [axis](const BBHPrimitiveInfo & a, const BBHPrimitiveInfo & b)
+                     {
+                         return a.centroid[axis] < b.centroid[axis];
+                     });
+    return mid;
+}
+
+// the bin of a primitive centroid within the centroid bounds of a node
+inline int centroidBin(const BBHPrimitiveInfo & p, int axis, const Box3f & centroidBounds,
+                       const Vec3f & extent, int numBins)
+{
+    int b = int(numBins * (p.centroid[axis] - centroidBounds.pMin[axis]) / extent[axis]);
+    return clamp(b, 0, numBins - 1);
+}
+
+// the binned centroid split with the lowest SAH cost over all three axes
+struct ObjectSplit
+{
+    float cost = std::numeric_limits<float>::infinity();
+    int axis = -1;              ///< -1 if no split separates the primitives
+    int split = 0;              ///< Primitives in bins [0, split) go left
+    Box3f leftBounds, rightBounds;
+};
+
+ObjectSplit findObjectSplit(PrimIterator begin, PrimIterator end,
+                            const Box3f & centroidBounds, const BBHSettings & settings,
+                            int numChunks)
+{
+    struct Bin
+    {
+        int count = 0;
+        Box3f bounds;
+    };
+
+    const int numBins = std::max(2, settings.numBins);
+    Vec3f extent = centroidBounds.diagonal();
+
+    // bin the primitives along all three axes in a single pass; large nodes
+    // bin separate chunks of primitives in parallel and merge the bins
+    vector<vector<Bin>> chunkBins(numChunks, vector<Bin>(3 * numBins));
+    parallelFor(end - begin, numChunks, [&](int64_t b, int64_t e, int c)
+    {
+        vector<Bin> & bins = chunkBins[c];
+        for (auto it = begin + b; it != begin + e; ++it)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                if (extent[axis] <= 0.f)
+                    continue;
+
+                Bin & bin = bins[axis * numBins + centroidBin(*it, axis, centroidBounds, extent, numBins)];
+                bin.count++;
+                bin.bounds.enclose(it->bounds);
+            }
+        }
+    });
+    for (int c = 1; c < numChunks; ++c)
+    {
+        for (int i = 0; i < 3 * numBins; ++i)
+        {
+            chunkBins[0][i].count += chunkBins[c][i].count;
+            chunkBins[0][i].bounds.enclose(chunkBins[c][i].bounds);
+        }
+    }
+
+    ObjectSplit best;
+    vector<Box3f> rightBounds(numBins);
+    vector<float> rightArea(numBins);
+    vector<int> rightCount(numBins);
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        if (extent[axis] <= 0.f)
+            continue;
+
+        const Bin * bins = &chunkBins[0][axis * numBins];
+
+        // sweep from the right to accumulate the area/count of each right half
+        Box3f box;
+        int count = 0;
+        for (int i = numBins - 1; i > 0; --i)
+        {
+            box.enclose(bins[i].bounds);
+            count += bins[i].count;
+            rightBounds[i] = box;
+            rightArea[i] = box.surfaceArea();
+            rightCount[i] = count;
+        }
+
+        // sweep from the left and evaluate the cost of splitting after bin i-1
+        box = Box3f();
+        count = 0;
+        for (int i = 1; i < numBins; ++i)
+        {
+            box.enclose(bins[i-1].bounds);
+            count += bins[i-1].count;
+            float cost = count * box.surfaceArea() + rightCount[i] * rightArea[i];
+            if (count > 0 && rightCount[i] > 0 && cost < best.cost)
+            {
+                best.cost = cost;
+                best.axis = axis;
+                best.split = i;
+                best.leftBounds = box;
+                best.rightBounds = rightBounds[i];
+            }
+        }
+    }
+    return best;
+}
+
+// split a range of primitives at the binned centroid split with the lowest SAH
+// cost over all three axes
+PrimIterator splitSAH(PrimIterator begin, PrimIterator end,
+                      const Box3f & centroidBounds, const BBHSettings & settings,
+                      int numChunks, pcg32 & rng, int & axis)
+{
+    ObjectSplit best = findObjectSplit(begin, end, centroidBounds, settings, numChunks);
+    if (best.axis < 0)
+        return splitMedian(begin, end, rng, axis);
+
+    axis = best.axis;
+    const int numBins = std::max(2, settings.numBins);
+    Vec3f extent = centroidBounds.diagonal();
+    return partitionPrimitives(begin, end, numChunks,
+                               [&](const BBHPrimitiveInfo & p)
+                               {
+                                   return centroidBin(p, best.axis, centroidBounds, extent, numBins) < best.split;
+                               });
+}
+
+// whether a node small enough to become a leaf should still be split, since
+// the SAH predicts that traversing its children is cheaper than testing all
+// of its primitives
+bool splitSmallNode(PrimIterator begin, PrimIterator end, const Box3f & bounds,
+                    const Box3f & centroidBounds, const BBHSettings & settings)
+{
+    auto count = end - begin;
+    if (!settings.sahLeaves || count < 2 || max(centroidBounds.diagonal()) <= 0.f)
+        return false;
+
+    ObjectSplit split = findObjectSplit(begin, end, centroidBounds, settings, 1);
+    float area = bounds.surfaceArea();
+    return split.axis >= 0 && settings.traversalCost * area + split.cost < count * area;
+}
+
+// recursively build the subtree over [begin, end) in depth-first order and
+// return the index of its root node
+//
+// Large second children are built as separate tasks into their own node
+// array, which is appended once both children are done. Every task draws
+// its random numbers from its own generator seeded by its primitive range,
+// so the hierarchy does not depend on the number of threads.
+uint32_t buildRecursive(BuildContext & ctx, vector<BBHLinearNode> & nodes,
+                        PrimIterator begin, PrimIterator end, int depth, pcg32 & rng)
+{
+    uint32_t nodeIndex = uint32_t(nodes.size());
+    nodes.emplace_back();
+
+    auto count = end - begin;
+    int numChunks = count >= MinParallelSplitSize ? ctx.numThreads : 1;
+
+    Box3f bounds, centroidBounds;
+    computeBounds(begin, end, numChunks, bounds, centroidBounds);
+
+    bool fitsLeaf = count <= std::numeric_limits<uint16_t>::max();
+    // nodes whose centroids all coincide cannot be separated by any split
+    if (fitsLeaf && ((count <= ctx.settings.maxLeafSize &&
+                      !splitSmallNode(begin, end, bounds, centroidBounds, ctx.settings)) ||
+                     max(centroidBounds.diagonal()) <= 0.f))
     {
-        m_left = m_right = primitives[0];
-        progress += 1;
+        BBHLinearNode & leaf = nodes[nodeIndex];
+        leaf.bounds = bounds;
+        leaf.primitivesOffset = uint32_t(begin - ctx.first);
+        leaf.numPrimitives = uint16_t(count);
+        ctx.progress += count;
+        return nodeIndex;
     }
-    else if (primitives.size() == 2)
+
+    PrimIterator mid;
+    int axis = 0;
+    if (max(centroidBounds.diagonal()) <= 0.f)
+        mid = begin + count / 2;
+    else if (ctx.settings.splitMethod == "sah" && depth < MaxSAHDepth)
+        mid = splitSAH(begin, end, centroidBounds, ctx.settings, numChunks, rng, axis);
+    else
+        mid = splitMedian(begin, end, rng, axis);
+
+    uint32_t secondChild;
+    if (end - mid < MinTaskSize)
     {
-        m_left = primitives[0];
-        m_right = primitives[1];
-        progress += 2;
+        buildRecursive(ctx, nodes, begin, mid, depth + 1, rng);
+        secondChild = buildRecursive(ctx, nodes, mid, end, depth + 1, rng);
     }
     else
     {
-        int axis = int(randf() * 3.0f);
-        std::sort(primitives.begin(), primitives.end(),
-                  [&](shared_ptr<const SurfaceBase> a, shared_ptr<const SurfaceBase> b) {
-                      return a->worldBBox().center()[axis] <
-                             b->worldBBox().center()[axis];
-                  });
+        vector<BBHLinearNode> secondNodes;
+        auto buildSecond = [&ctx, &secondNodes, mid, end, depth]()
+        {
+            pcg32 taskRng(uint64_t(mid - ctx.first));
+            secondNodes.reserve(2 * (end - mid));
+            buildRecursive(ctx, secondNodes, mid, end, depth + 1, taskRng);
+        };
+
+        // run the second child on an idle thread, if there is one
+        std::future<void> task;
+        if (ctx.idleThreads.fetch_sub(1) > 0)
+            task = std::async(std::launch::async, [&ctx, &buildSecond]()
+            {
+                auto start = Clock::now();
+                buildSecond();
+                ctx.taskTime += microseconds(start);
+                ctx.idleThreads++;
+            });
+        else
+            ctx.idleThreads++;
+
+        buildRecursive(ctx, nodes, begin, mid, depth + 1, rng);
 
-        vector<shared_ptr<SurfaceBase>> leftList, rightList;
-        leftList.insert(leftList.begin(), primitives.begin(),
-                        primitives.begin() + primitives.size() / 2);
-        rightList.insert(rightList.begin(),
-                         primitives.begin() + primitives.size() / 2,
-                         primitives.end());
+        if (task.valid())
+        {
+            auto start = Clock::now();
+            task.get();
+            ctx.waitTime += microseconds(start);
+        }
+        else
+            buildSecond();
 
-        m_left = make_shared<BBHNode>(leftList, progress);
-        m_right = make_shared<BBHNode>(rightList, progress);
+        // append the second subtree, relocating its child offsets
+        secondChild = uint32_t(nodes.size());
+        for (BBHLinearNode node : secondNodes)
+        {
+            if (!node.isLeaf())
+                node.secondChildOffset += secondChild;
+            nodes.push_back(node);
+        }
     }
 
-    (m_bounds = m_left->worldBBox()).enclose(m_right->worldBBox());
+    // the node array may have been reallocated by the recursive calls
+    BBHLinearNode & node = nodes[nodeIndex];
+    node.bounds = bounds;
+    node.secondChildOffset = secondChild;
+    node.axis = uint8_t(axis);
+    return nodeIndex;
 }
 
-BBHNode::~BBHNode()
+// state of a build with spatial splits (see buildSpatialRecursive)
+struct SpatialBuildContext
+{
+    SpatialBuildContext(const BBHSettings & settings, const BBHSplitFunction & splitPrimitive,
+                        Progress & progress, int64_t numPrimitives) :
+        settings(settings), splitPrimitive(splitPrimitive), progress(progress),
+        progressLeft(numPrimitives),
+        remainingReferences(int64_t(std::max(0.f, settings.maxDuplication - 1.f) * numPrimitives))
+    {
+    }
+
+    const BBHSettings & settings;
+    const BBHSplitFunction & splitPrimitive;
+    Progress & progress;
+    int64_t progressLeft;                   ///< Leaf references can outnumber the primitives
+    int64_t remainingReferences;            ///< References that spatial splits may still add
+    float rootArea = 0.f;
+    vector<BBHPrimitiveInfo> references;    ///< Leaf references in depth-first order
+};
+
+// the part of a box that lies within another box (empty if they are disjoint)
+Box3f overlap(const Box3f & a, const Box3f & b)
 {
+    Box3f result;
+    result.pMin = max(a.pMin, b.pMin);
+    result.pMax = min(a.pMax, b.pMax);
+    return result;
 }
 
-bool BBHNode::intersect(const Ray3f &ray, HitInfo &hit) const
+// split a reference at the plane at position along axis into the parts on
+// either side, either of which may be empty
+void splitReference(const SpatialBuildContext & ctx, const BBHPrimitiveInfo & ref, int axis, float position,
+                    BBHPrimitiveInfo & left, BBHPrimitiveInfo & right)
 {
-    if (m_bounds.intersect(ray))
+    left.index = right.index = ref.index;
+    left.bounds = right.bounds = Box3f();
+    if (ctx.splitPrimitive)
+        ctx.splitPrimitive(ref.index, axis, position, left.bounds, right.bounds);
+    else
+        left.bounds = right.bounds = ref.bounds;
+
+    // the parts of a reference never extend beyond the reference itself,
+    // which may already have been clipped by earlier splits
+    left.bounds.pMax[axis] = std::min(left.bounds.pMax[axis], position);
+    right.bounds.pMin[axis] = std::max(right.bounds.pMin[axis], position);
+    left.bounds = overlap(left.bounds, ref.bounds);
+    right.bounds = overlap(right.bounds, ref.bounds);
+    left.centroid = left.bounds.center();
+    right.centroid = right.bounds.center();
+}
+
+// the binned spatial split with the lowest SAH cost over all three axes
+struct SpatialSplit
+{
+    float cost = std::numeric_limits<float>::infinity();
+    int axis = -1;              ///< -1 if no split separates the references
+    float position = 0.f;       ///< Position of the split plane along axis
+    int leftCount = 0, rightCount = 0;
+    Box3f leftBounds, rightBounds;
+};
+
+SpatialSplit findSpatialSplit(const SpatialBuildContext & ctx, const vector<BBHPrimitiveInfo> & refs,
+                              const Box3f & bounds)
+{
+    struct Bin
+    {
+        Box3f bounds;
+        int entries = 0;        ///< References starting in this bin
+        int exits = 0;          ///< References ending in this bin
+    };
+
+    const int numBins = std::max(2, ctx.settings.numBins);
+    Vec3f extent = bounds.diagonal();
+
+    SpatialSplit best;
+    vector<Bin> bins(numBins);
+    vector<Box3f> rightBounds(numBins);
+    vector<int> rightCount(numBins);
+    for (int axis = 0; axis < 3; ++axis)
     {
-        HitInfo leftHit, rightHit;
-        bool hitLeft = m_left->intersect(ray, leftHit);
-        bool hitRight = m_right->intersect(ray, rightHit);
+        if (extent[axis] <= 0.f)
+            continue;
+
+        float binWidth = extent[axis] / numBins;
+        auto binIndex = [&](float x)
+        {
+            return clamp(int((x - bounds.pMin[axis]) / binWidth), 0, numBins - 1);
+        };
+
+        // clip each reference into all the bins it overlaps
+        std::fill(bins.begin(), bins.end(), Bin());
+        for (auto & ref : refs)
+        {
+            int first = binIndex(ref.bounds.pMin[axis]), last = binIndex(ref.bounds.pMax[axis]);
+            BBHPrimitiveInfo rest = ref, left, right;
+            for (int i = first; i < last; ++i)
+            {
+                splitReference(ctx, rest, axis, bounds.pMin[axis] + (i + 1) * binWidth, left, right);
+                bins[i].bounds.enclose(left.bounds);
+                rest = right;
+            }
+            bins[last].bounds.enclose(rest.bounds);
+            bins[first].entries++;
+            bins[last].exits++;
+        }
+
+        // sweep from the right to accumulate the bounds/count of each right half
+        Box3f box;
+        int count = 0;
+        for (int i = numBins - 1; i > 0; --i)
+        {
+            box.enclose(bins[i].bounds);
+            count += bins[i].exits;
+            rightBounds[i] = box;
+            rightCount[i] = count;
+        }
 
-        if (hitLeft && hitRight)
+        // sweep from the left and evaluate the cost of splitting after bin i-1
+        box = Box3f();
+        count = 0;
+        for (int i = 1; i < numBins; ++i)
         {
-            if (leftHit.t < rightHit.t)
-                hit = leftHit;
+            box.enclose(bins[i-1].bounds);
+            count += bins[i-1].entries;
+            float cost = count * box.surfaceArea() + rightCount[i] * rightBounds[i].surfaceArea();
+            if (count > 0 && rightCount[i] > 0 && cost < best.cost)
+            {
+                best.cost = cost;
+                best.axis = axis;
+                best.position = bounds.pMin[axis] + i * binWidth;
+                best.leftCount = count;
+                best.rightCount = rightCount[i];
+                best.leftBounds = box;
+                best.rightBounds = rightBounds[i];
+            }
+        }
+    }
+    return best;
+}
+
+// distribute references to the sides of a spatial split, splitting those that
+// straddle the plane unless keeping them whole on one side is cheaper
+// ("reference unsplitting")
+void performSpatialSplit(const SpatialBuildContext & ctx, const vector<BBHPrimitiveInfo> & refs,
+                         SpatialSplit split, vector<BBHPrimitiveInfo> & left, vector<BBHPrimitiveInfo> & right)
+{
+    int axis = split.axis;
+    for (auto & ref : refs)
+    {
+        if (ref.bounds.pMax[axis] <= split.position)
+            left.push_back(ref);
+        else if (ref.bounds.pMin[axis] >= split.position)
+            right.push_back(ref);
+        else
+        {
+            Box3f leftWhole = split.leftBounds, rightWhole = split.rightBounds;
+            leftWhole.enclose(ref.bounds);
+            rightWhole.enclose(ref.bounds);
+            float leftArea = split.leftBounds.surfaceArea(), rightArea = split.rightBounds.surfaceArea();
+            float splitCost = split.leftCount * leftArea + split.rightCount * rightArea;
+            float leftCost = split.leftCount * leftWhole.surfaceArea() + (split.rightCount - 1) * rightArea;
+            float rightCost = (split.leftCount - 1) * leftArea + split.rightCount * rightWhole.surfaceArea();
+
+            BBHPrimitiveInfo leftPart, rightPart;
+            if (splitCost <= leftCost && splitCost <= rightCost)
+                splitReference(ctx, ref, axis, split.position, leftPart, rightPart);
+
+            if (leftCost < splitCost && leftCost <= rightCost)
+            {
+                left.push_back(ref);
+                split.leftBounds = leftWhole;
+                split.rightCount--;
+            }
+            else if (rightCost < splitCost || leftPart.bounds.isEmpty())
+            {
+                right.push_back(ref);
+                split.rightBounds = rightWhole;
+                split.leftCount--;
+            }
+            else if (rightPart.bounds.isEmpty())
+                left.push_back(ref);
             else
-                hit = rightHit;
-            return true;
+            {
+                left.push_back(leftPart);
+                right.push_back(rightPart);
+            }
+        }
+    }
+}
+
+// recursively build the subtree over refs like buildRecursive, but also
+// consider splitting references at spatial planes (Stich et al., "Spatial
+// Splits in Bounding Volume Hierarchies", HPG 2009); leaves append their
+// references to ctx.references
+//
+// Since the number of references is not known in advance, this builds
+// serially with a separate list of references per node.
+uint32_t buildSpatialRecursive(SpatialBuildContext & ctx, vector<BBHLinearNode> & nodes,
+                               vector<BBHPrimitiveInfo> & refs, int depth, pcg32 & rng)
+{
+    // spatial splits are only worth evaluating if the children of the best
+    // object split overlap by more than this fraction of the root area
+    const float MinOverlap = 1e-5f;
+
+    uint32_t nodeIndex = uint32_t(nodes.size());
+    nodes.emplace_back();
+
+    auto count = int64_t(refs.size());
+    Box3f bounds, centroidBounds;
+    computeBounds(refs.begin(), refs.end(), 1, bounds, centroidBounds);
+    if (depth == 0)
+        ctx.rootArea = bounds.surfaceArea();
+
+    bool fitsLeaf = count <= std::numeric_limits<uint16_t>::max();
+    if (fitsLeaf && ((count <= ctx.settings.maxLeafSize &&
+                      !splitSmallNode(refs.begin(), refs.end(), bounds, centroidBounds, ctx.settings)) ||
+                     max(centroidBounds.diagonal()) <= 0.f))
+    {
+        BBHLinearNode & leaf = nodes[nodeIndex];
+        leaf.bounds = bounds;
+        leaf.primitivesOffset = uint32_t(ctx.references.size());
+        leaf.numPrimitives = uint16_t(count);
+        ctx.references.insert(ctx.references.end(), refs.begin(), refs.end());
+
+        int64_t steps = std::min(count, ctx.progressLeft);
+        ctx.progress += steps;
+        ctx.progressLeft -= steps;
+        return nodeIndex;
+    }
+
+    vector<BBHPrimitiveInfo> left, right;
+    int axis = 0;
+    if (max(centroidBounds.diagonal()) > 0.f && depth < MaxSAHDepth)
+    {
+        ObjectSplit object = findObjectSplit(refs.begin(), refs.end(), centroidBounds, ctx.settings, 1);
+
+        SpatialSplit spatial;
+        if (ctx.remainingReferences > 0 &&
+            (object.axis < 0 ||
+             overlap(object.leftBounds, object.rightBounds).surfaceArea() > MinOverlap * ctx.rootArea))
+            spatial = findSpatialSplit(ctx, refs, bounds);
+
+        if (spatial.axis >= 0 && spatial.cost < object.cost &&
+            spatial.leftCount + spatial.rightCount - count <= ctx.remainingReferences)
+        {
+            axis = spatial.axis;
+            performSpatialSplit(ctx, refs, spatial, left, right);
         }
-        else if (hitLeft)
+        else if (object.axis >= 0)
         {
-            hit = leftHit;
-            return true;
+            axis = object.axis;
+            const int numBins = std::max(2, ctx.settings.numBins);
+            Vec3f extent = centroidBounds.diagonal();
+            for (auto & ref : refs)
+            {
+                if (centroidBin(ref, axis, centroidBounds, extent, numBins) < object.split)
+                    left.push_back(ref);
+                else
+                    right.push_back(ref);
+            }
         }
-        else if (hitRight)
+    }
+
+    // fall back to a median split if no SAH split separates the references
+    if (left.empty() || right.empty())
+    {
+        left.clear();
+        right.clear();
+        auto mid = refs.begin() + count / 2;
+        if (max(centroidBounds.diagonal()) > 0.f)
+            mid = splitMedian(refs.begin(), refs.end(), rng, axis);
+        left.assign(refs.begin(), mid);
+        right.assign(mid, refs.end());
+    }
+
+    ctx.remainingReferences -= int64_t(left.size() + right.size()) - count;
+    vector<BBHPrimitiveInfo>().swap(refs);
+
+    buildSpatialRecursive(ctx, nodes, left, depth + 1, rng);
+    uint32_t secondChild = buildSpatialRecursive(ctx, nodes, right, depth + 1, rng);
+
+    // the node array may have been reallocated by the recursive calls
+    BBHLinearNode & node = nodes[nodeIndex];
+    node.bounds = bounds;
+    node.secondChildOffset = secondChild;
+    node.axis = uint8_t(axis);
+    return nodeIndex;
+}
+
+} // namespace
+
+
+BBHBuildStats BBHTree::build(const vector<Box3f> & bounds, const BBHSettings & settings,
+                             Progress & progress, vector<uint32_t> & order,
+                             const BBHSplitFunction & splitPrimitive)
+{
+    clear();
+    order.clear();
+    if (bounds.empty())
+        return BBHBuildStats();
+
+    auto start = Clock::now();
+
+    vector<BBHPrimitiveInfo> primitives(bounds.size());
+    for (auto i : range(bounds.size()))
+    {
+        primitives[i].index = uint32_t(i);
+        primitives[i].bounds = bounds[i];
+        primitives[i].centroid = bounds[i].center();
+    }
+
+    if (settings.spatialSplits)
+    {
+        SpatialBuildContext ctx(settings, splitPrimitive, progress, int64_t(primitives.size()));
+        pcg32 rng;
+        vector<BBHLinearNode> nodes;
+        nodes.reserve(2 * bounds.size());
+        buildSpatialRecursive(ctx, nodes, primitives, 0, rng);
+        setNodes(std::move(nodes));
+
+        order.resize(ctx.references.size());
+        for (auto i : range(ctx.references.size()))
+            order[i] = ctx.references[i].index;
+
+        BBHBuildStats stats;
+        stats.milliseconds = microseconds(start) / 1000.0;
+        return stats;
+    }
+
+    BuildContext ctx(settings, progress, primitives.begin(),
+                     settings.threads > 0 ? settings.threads : defaultThreadCount());
+    pcg32 rng;
+    vector<BBHLinearNode> nodes;
+    nodes.reserve(2 * bounds.size());
+    buildRecursive(ctx, nodes, primitives.begin(), primitives.end(), 0, rng);
+    setNodes(std::move(nodes));
+
+    order.resize(primitives.size());
+    for (auto i : range(primitives.size()))
+        order[i] = primitives[i].index;
+
+    // the calling thread is busy all the time, except while waiting for tasks
+    int64_t wallTime = std::max(int64_t(1), microseconds(start));
+    BBHBuildStats stats;
+    stats.milliseconds = wallTime / 1000.0;
+    stats.threads = ctx.numThreads;
+    stats.utilization = float(wallTime + ctx.taskTime - ctx.waitTime) / float(wallTime * ctx.numThreads);
+    return stats;
+}
+
+json BBHTree::statistics(const BBHSettings & settings) const
+{
+    // the depth of each node follows from its parent, which precedes it
+    vector<int> depth(m_numNodes, 0);
+    vector<int> depthHistogram, leafSizeHistogram;
+    uint64_t numLeaves = 0, numReferences = 0;
+    double leafDepthSum = 0.0, overlapArea = 0.0;
+    for (size_t i = 0; i < m_numNodes; ++i)
+    {
+        const BBHLinearNode & node = m_nodes[i];
+        if (node.isLeaf())
         {
-            hit = rightHit;
-            return true;
+            numLeaves++;
+            numReferences += node.numPrimitives;
+            leafDepthSum += depth[i];
+            if (depth[i] >= int(depthHistogram.size()))
+                depthHistogram.resize(depth[i] + 1, 0);
+            depthHistogram[depth[i]]++;
+            if (node.numPrimitives >= leafSizeHistogram.size())
+                leafSizeHistogram.resize(node.numPrimitives + 1, 0);
+            leafSizeHistogram[node.numPrimitives]++;
         }
         else
-            return false;
+        {
+            depth[i + 1] = depth[node.secondChildOffset] = depth[i] + 1;
+            overlapArea += overlap(m_nodes[i + 1].bounds, m_nodes[node.secondChildOffset].bounds).surfaceArea();
+        }
     }
-    else
-        return false;
+
+    float rootArea = bounds().surfaceArea();
+    json stats;
+    stats["nodes"] = m_numNodes;
+    stats["leaves"] = numLeaves;
+    stats["references"] = numReferences;
+    stats["sah_cost"] = sahCost(settings);
+    stats["max_depth"] = depthHistogram.empty() ? 0 : int(depthHistogram.size()) - 1;
+    stats["mean_leaf_depth"] = numLeaves ? leafDepthSum / numLeaves : 0.0;
+    stats["leaf_depth_histogram"] = depthHistogram;
+    stats["leaf_size_histogram"] = leafSizeHistogram;
+    stats["overlap"] = rootArea > 0.f ? overlapArea / rootArea : 0.0;
+    return stats;
+}
+
+void BBHTree::clear()
+{
+    m_storage.clear();
+    m_storage.shrink_to_fit();
+    m_mapping = nullptr;
+    m_nodes = nullptr;
+    m_numNodes = 0;
+}
+
+void BBHTree::refit(const vector<Box3f> & bounds)
+{
+    // mapped nodes are read-only, so refit a copy
+    if (m_mapping)
+        setNodes(vector<BBHLinearNode>(m_nodes, m_nodes + m_numNodes));
+
+    // children follow their parents in depth-first order, so a reverse sweep
+    // visits both children of each node before the node itself
+    for (size_t i = m_storage.size(); i-- > 0;)
+    {
+        BBHLinearNode & node = m_storage[i];
+        Box3f box;
+        if (node.isLeaf())
+            for (uint32_t p = node.primitivesOffset; p < node.primitivesOffset + node.numPrimitives; ++p)
+                box.enclose(bounds[p]);
+        else
+        {
+            box = m_storage[i + 1].bounds;
+            box.enclose(m_storage[node.secondChildOffset].bounds);
+        }
+        node.bounds = box;
+    }
+}
+
+void BBHTree::setNodes(vector<BBHLinearNode> nodes)
+{
+    clear();
+    m_storage = std::move(nodes);
+    m_storage.shrink_to_fit();
+    m_nodes = m_storage.data();
+    m_numNodes = m_storage.size();
+}
+
+void BBHTree::setNodes(shared_ptr<const MappedFile> mapping, const BBHLinearNode * nodes, size_t numNodes)
+{
+    clear();
+    m_mapping = mapping;
+    m_nodes = nodes;
+    m_numNodes = numNodes;
+}
+
+float BBHTree::sahCost(const BBHSettings & settings) const
+{
+    float rootArea = bounds().surfaceArea();
+    if (rootArea <= 0.f)
+        return 0.f;
+
+    float cost = 0.f;
+    for (size_t i = 0; i < m_numNodes; ++i)
+        cost += m_nodes[i].bounds.surfaceArea() *
+                (m_nodes[i].isLeaf() ? float(m_nodes[i].numPrimitives) : settings.traversalCost);
+    return cost / rootArea;
 }
 
 
-BBH::BBH(const Scene & scene, const json & j) : SurfaceGroup(scene, j)
+BBH::BBH(const Scene & scene, const json & j) : Accelerator(scene, j)
 {
+    m_settings.splitMethod = j.value("split", m_settings.splitMethod);
+    m_settings.maxLeafSize = j.value("max_leaf_size", m_settings.maxLeafSize);
+    m_settings.sahLeaves = j.value("sah_leaves", m_settings.sahLeaves);
+    m_settings.numBins = j.value("bins", m_settings.numBins);
+    m_settings.traversalCost = j.value("traversal_cost", m_settings.traversalCost);
+    m_settings.width = j.value("width", m_settings.width);
+    m_settings.quantized = j.value("quantized", m_settings.quantized);
+    m_settings.layout = j.value("layout", m_settings.layout);
+    m_settings.threads = j.value("threads", m_settings.threads);
+    m_settings.spatialSplits = j.value("spatial_splits", m_settings.spatialSplits);
+    m_settings.maxDuplication = j.value("max_duplication", m_settings.maxDuplication);
+    m_rebuildThreshold = j.value("rebuild_threshold", m_rebuildThreshold);
+
+    if (m_settings.splitMethod != "median" && m_settings.splitMethod != "sah")
+        throw DirtException("Unknown BBH 'split' method '%s' here:\n%s", m_settings.splitMethod, j.dump(4));
+    if (m_settings.maxLeafSize < 1 || m_settings.maxLeafSize > std::numeric_limits<uint16_t>::max())
+        throw DirtException("BBH 'max_leaf_size' must be between 1 and 65535 here:\n%s", j.dump(4));
+    if (m_settings.sahLeaves && m_settings.splitMethod != "sah")
+        throw DirtException("BBH 'sah_leaves' requires the \"sah\" split method here:\n%s", j.dump(4));
+    if (m_settings.width != 2 && m_settings.width != 4 && m_settings.width != 8)
+        throw DirtException("BBH 'width' must be 2, 4 or 8 here:\n%s", j.dump(4));
+    if (m_settings.quantized && m_settings.width == 2)
+        throw DirtException("BBH 'quantized' requires a 'width' of 4 or 8 here:\n%s", j.dump(4));
+    if (m_settings.layout != "depth_first" && m_settings.layout != "treelet")
+        throw DirtException("Unknown BBH 'layout' '%s' here:\n%s", m_settings.layout, j.dump(4));
+    if (m_settings.layout != "depth_first" && m_settings.width == 2)
+        throw DirtException("BBH 'layout' requires a 'width' of 4 or 8 here:\n%s", j.dump(4));
+    if (m_settings.spatialSplits && m_settings.splitMethod != "sah")
+        throw DirtException("BBH 'spatial_splits' requires the \"sah\" split method here:\n%s", j.dump(4));
+    if (m_settings.maxDuplication < 1.f)
+        throw DirtException("BBH 'max_duplication' must be at least 1 here:\n%s", j.dump(4));
+
+    if (j.contains("cache"))
+    {
+        if (j["cache"].is_boolean())
+            m_cacheDirectory = j["cache"].get<bool>() ? "bvh_cache" : "";
+        else
+            m_cacheDirectory = j["cache"].get<string>();
+
+        // everything that affects the hierarchy identifies it in the cache
+        json parameters = j;
+        parameters.erase("cache");
+        parameters.erase("threads");
+        parameters.erase("rebuild_threshold");
+        m_cacheParameters = parameters.dump();
+    }
+
+    // spatial splits clip the actual primitives (e.g. mesh faces), which
+    // the cache key, built from their bounds, does not capture
+    if (m_settings.spatialSplits && !m_cacheDirectory.empty())
+        throw DirtException("BBH 'cache' cannot be combined with 'spatial_splits' here:\n%s", j.dump(4));
 }
 
+BBH::~BBH()
+{
+}
 
-void BBH::build()
+
+void BBH::buildPrimitives(const vector<Box3f> & bounds, vector<uint32_t> & order,
+                          const BBHSplitFunction & splitPrimitive)
 {
-    Progress progress("Building BVH", m_surfaces.size());
-    if (!m_surfaces.empty())
-        m_root = make_shared<BBHNode>(m_surfaces, progress);
+    m_tree.clear();
+    m_tree4 = nullptr;
+    m_tree8 = nullptr;
+    m_quantizedTree4 = nullptr;
+    m_quantizedTree8 = nullptr;
+    m_releasedTreeStats = json();
+    setTraversal(nullptr);
+    setPacketTree(nullptr);
+    order.clear();
+    if (bounds.empty())
+        return;
+
+    string cacheFile;
+    uint64_t cacheKey = 0;
+    if (!m_cacheDirectory.empty())
+    {
+        // relative cache directories are relative to the scene file
+        filesystem::path directory(m_cacheDirectory);
+        if (!directory.is_absolute() && getFileResolver().size() > 0)
+            directory = getFileResolver()[0] / directory;
+        if (!directory.exists())
+            filesystem::create_directories(directory);
+
+        cacheKey = bbhCacheKey(m_cacheParameters, bounds);
+        cacheFile = (directory / tfm::format("%016x.bvh", cacheKey)).str();
+    }
+
+    if (!cacheFile.empty() && loadBBHCache(cacheFile, cacheKey, bounds.size(), m_tree, order))
+        message("Loaded BVH from cache file \"%s\"\n", cacheFile);
     else
-        m_root = nullptr;
+    {
+        BBHBuildStats stats;
+        {
+            Progress progress("Building BVH", bounds.size());
+            stats = buildTree(bounds, progress, order, splitPrimitive);
+        }
+        message("Built BVH in %s using %d threads (%.0f%% thread utilization)\n",
+                timeString(stats.milliseconds), stats.threads, 100.f * stats.utilization);
+
+        if (!cacheFile.empty() && !saveBBHCache(cacheFile, cacheKey, bounds.size(), m_tree, order))
+            warning("Could not write BVH cache file \"%s\".\n", cacheFile);
+    }
+
+    m_builtCost = m_tree.sahCost(m_settings);
+    message("BVH (%s split): %d nodes (%s), SAH cost: %f\n", m_settings.splitMethod,
+            m_tree.numNodes(), memString(m_tree.numNodes() * sizeof(BBHLinearNode)), m_builtCost);
+    if (order.size() > bounds.size())
+        message("Spatial splits added %d primitive references (%.1f%%)\n", order.size() - bounds.size(),
+                100.f * (order.size() - bounds.size()) / bounds.size());
+
+    collapseTree();
+    if (m_tree4)
+        message("Collapsed into a 4-wide BVH: %d nodes (%s)\n", m_tree4->nodes().size(),
+                memString(m_tree4->nodes().size() * sizeof(BBHWideNode<4>)));
+    else if (m_tree8)
+        message("Collapsed into an 8-wide BVH: %d nodes (%s)\n", m_tree8->nodes().size(),
+                memString(m_tree8->nodes().size() * sizeof(BBHWideNode<8>)));
+    else if (m_quantizedTree4)
+        message("Collapsed into a quantized 4-wide BVH: %d nodes (%s)\n", m_quantizedTree4->nodes().size(),
+                memString(m_quantizedTree4->nodes().size() * sizeof(BBHQuantizedNode<4>)));
+    else if (m_quantizedTree8)
+        message("Collapsed into a quantized 8-wide BVH: %d nodes (%s)\n", m_quantizedTree8->nodes().size(),
+                memString(m_quantizedTree8->nodes().size() * sizeof(BBHQuantizedNode<8>)));
+
+    // the quantized hierarchy is all that traversal needs, so release the
+    // binary one, keeping only its statistics
+    if (m_settings.quantized)
+    {
+        m_releasedTreeStats = m_tree.statistics(m_settings);
+        m_tree.clear();
+        setPacketTree(nullptr);
+    }
+}
+
+void BBH::collapseTree()
+{
+    m_tree4 = nullptr;
+    m_tree8 = nullptr;
+    m_quantizedTree4 = nullptr;
+    m_quantizedTree8 = nullptr;
+
+    // packets are traced through the binary hierarchy, which is kept around
+    // even if a wide hierarchy is used for single rays
+    setPacketTree(&m_tree);
+    if (m_settings.width == 4 && m_settings.quantized)
+    {
+        m_quantizedTree4 = make_shared<BBHWideTree<4, true>>();
+        m_quantizedTree4->build(m_tree, m_settings.layout == "treelet");
+        setTraversal(m_quantizedTree4.get());
+    }
+    else if (m_settings.width == 8 && m_settings.quantized)
+    {
+        m_quantizedTree8 = make_shared<BBHWideTree<8, true>>();
+        m_quantizedTree8->build(m_tree, m_settings.layout == "treelet");
+        setTraversal(m_quantizedTree8.get());
+    }
+    else if (m_settings.width == 4)
+    {
+        m_tree4 = make_shared<BBHWideTree<4>>();
+        m_tree4->build(m_tree, m_settings.layout == "treelet");
+        setTraversal(m_tree4.get());
+    }
+    else if (m_settings.width == 8)
+    {
+        m_tree8 = make_shared<BBHWideTree<8>>();
+        m_tree8->build(m_tree, m_settings.layout == "treelet");
+        setTraversal(m_tree8.get());
+    }
+    else
+        setTraversal(&m_tree);
+}
+
+vector<std::pair<uint32_t, uint32_t>> BBH::leafRanges() const
+{
+    vector<std::pair<uint32_t, uint32_t>> leaves;
+    if (!m_tree.empty())
+    {
+        // the leaves of the binary hierarchy are already in primitive order
+        for (auto i : range(m_tree.numNodes()))
+            if (m_tree.nodes()[i].isLeaf() && m_tree.nodes()[i].numPrimitives > 0)
+                leaves.emplace_back(m_tree.nodes()[i].primitivesOffset, m_tree.nodes()[i].numPrimitives);
+        return leaves;
+    }
+
+    if (m_quantizedTree4)
+        m_quantizedTree4->leafRanges(leaves);
+    else if (m_quantizedTree8)
+        m_quantizedTree8->leafRanges(leaves);
+    std::sort(leaves.begin(), leaves.end());
+    return leaves;
+}
+
+json BBH::treeStats() const
+{
+    json stats = m_releasedTreeStats.is_null() ? m_tree.statistics(m_settings) : m_releasedTreeStats;
+    stats["split"] = m_settings.splitMethod;
+    stats["width"] = m_settings.width;
+    stats["quantized"] = m_settings.quantized;
+
+    // memory of the nodes kept for traversal
+    size_t bytes = m_tree.numNodes() * sizeof(BBHLinearNode);
+    if (m_tree4)
+    {
+        stats["wide_nodes"] = m_tree4->nodes().size();
+        bytes += m_tree4->nodes().size() * sizeof(BBHWideNode<4>);
+    }
+    else if (m_tree8)
+    {
+        stats["wide_nodes"] = m_tree8->nodes().size();
+        bytes += m_tree8->nodes().size() * sizeof(BBHWideNode<8>);
+    }
+    else if (m_quantizedTree4)
+    {
+        stats["wide_nodes"] = m_quantizedTree4->nodes().size();
+        bytes += m_quantizedTree4->nodes().size() * sizeof(BBHQuantizedNode<4>);
+    }
+    else if (m_quantizedTree8)
+    {
+        stats["wide_nodes"] = m_quantizedTree8->nodes().size();
+        bytes += m_quantizedTree8->nodes().size() * sizeof(BBHQuantizedNode<8>);
+    }
+    stats["node_bytes"] = bytes;
+    return stats;
+}
+
+bool BBH::refitPrimitives(const vector<Box3f> & bounds)
+{
+    // this also rebuilds quantized hierarchies, which release the binary tree
+    if (m_tree.empty())
+        return bounds.empty();
+
+    m_tree.refit(bounds);
+
+    // moving primitives apart makes the nodes overlap more and more, until
+    // rebuilding pays off
+    float cost = m_tree.sahCost(m_settings);
+    if (m_rebuildThreshold > 0.f && cost > m_rebuildThreshold * m_builtCost)
+    {
+        message("Rebuilding BVH, since refitting raised its SAH cost from %f to %f\n", m_builtCost, cost);
+        return false;
+    }
+
+    // only collapse the wide hierarchy once the refit is kept
+    collapseTree();
+    return true;
 }
 
-bool BBH::intersect(const Ray3f &ray, HitInfo &hit) const
+BBHBuildStats BBH::buildTree(const vector<Box3f> & bounds, Progress & progress,
+                             vector<uint32_t> & order, const BBHSplitFunction & splitPrimitive)
 {
-    return m_root ? m_root->intersect(ray, hit) : false;
+    return m_tree.build(bounds, m_settings, progress, order, splitPrimitive);
 }
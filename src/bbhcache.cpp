@@ -0,0 +1,231 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirt/bbhcache.h>
+#include <dirt/mappedfile.h>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+
+#if defined(_WIN32)
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+// increment whenever the file layout or BBHLinearNode changes
+const uint32_t CacheVersion = 4;
+const char CacheMagic[8] = {'D', 'I', 'R', 'T', 'B', 'B', 'H', '\0'};
+
+// the header fills the first 64 bytes of a cache file, so that the nodes
+// that follow it are aligned within the (page-aligned) mapping
+struct CacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t nodeSize;
+    uint64_t key;
+    uint64_t numNodes;
+    uint64_t numPrimitives;
+    uint64_t numReferences;     ///< Length of the order (more than numPrimitives with spatial splits)
+    uint64_t checksum;          ///< Hash of the nodes and the order
+    uint8_t pad[8];
+};
+
+static_assert(sizeof(CacheHeader) == 64, "CacheHeader should be 64 bytes");
+
+// hash a range of bytes, 8 bytes at a time
+uint64_t hashBytes(uint64_t hash, const void * data, size_t size)
+{
+    auto bytes = (const uint8_t *) data;
+    for (; size > 0; bytes += 8, size -= std::min(size, size_t(8)))
+    {
+        uint64_t word = 0;
+        memcpy(&word, bytes, std::min(size, size_t(8)));
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+// loading hashes the nodes one at a time, which gives the same hash as
+// hashing them all at once since each node is a whole number of words
+static_assert(sizeof(BBHLinearNode) % 8 == 0, "BBHLinearNode should be a multiple of 8 bytes");
+
+uint64_t checksum(const BBHLinearNode * nodes, size_t numNodes, const uint32_t * order, size_t numReferences)
+{
+    return hashBytes(hashBytes(0, nodes, numNodes * sizeof(BBHLinearNode)), order, numReferences * sizeof(uint32_t));
+}
+
+// a name for the temporary file that no other render (or thread) writes to
+string temporaryFilename(const string & filename)
+{
+    static std::atomic<uint32_t> counter(0);
+#if defined(_WIN32)
+    int pid = _getpid();
+#else
+    int pid = int(getpid());
+#endif
+    return tfm::format("%s.%d.%d.tmp", filename, pid, counter++);
+}
+
+} // namespace
+
+
+uint64_t bbhCacheKey(const string & parameters, const vector<Box3f> & bounds)
+{
+    uint64_t numPrimitives = bounds.size();
+    uint64_t hash = hashBytes(0xcbf29ce484222325ull, &CacheVersion, sizeof(CacheVersion));
+    hash = hashBytes(hash, parameters.data(), parameters.size());
+    hash = hashBytes(hash, &numPrimitives, sizeof(numPrimitives));
+    return hashBytes(hash, bounds.data(), bounds.size() * sizeof(Box3f));
+}
+
+bool loadBBHCache(const string & filename, uint64_t key, size_t numPrimitives,
+                  BBHTree & tree, vector<uint32_t> & order)
+{
+    if (!std::ifstream(filename).good())
+        return false;
+
+    shared_ptr<const MappedFile> file;
+    try
+    {
+        file = make_shared<const MappedFile>(filename);
+    }
+    catch (const DirtException & e)
+    {
+        warning("%s\n", e.what());
+        return false;
+    }
+
+    CacheHeader header;
+    if (file->size() < sizeof(header))
+        return false;
+    memcpy(&header, file->data(), sizeof(header));
+    if (memcmp(header.magic, CacheMagic, sizeof(CacheMagic)) != 0 ||
+        header.version != CacheVersion || header.nodeSize != sizeof(BBHLinearNode) ||
+        header.key != key || header.numPrimitives != numPrimitives ||
+        header.numReferences < numPrimitives ||
+        file->size() != sizeof(header) + header.numNodes * sizeof(BBHLinearNode) +
+                        header.numReferences * sizeof(uint32_t))
+        return false;
+
+    // the checksum does not rule out a file that was written with broken
+    // nodes, so while hashing them, make sure that they cannot send the
+    // traversal out of bounds or overflow its fixed-size stacks. Children
+    // always follow their parent, so the levels (the root being level 1)
+    // are final by the time each node is reached
+    auto nodes = (const BBHLinearNode *) (file->data() + sizeof(header));
+    auto references = (const uint32_t *) (nodes + header.numNodes);
+    vector<uint8_t> levels(header.numNodes, 0);
+    if (header.numNodes > 0)
+        levels[0] = 1;
+    uint64_t hash = 0;
+    for (uint64_t i = 0; i < header.numNodes; ++i)
+    {
+        hash = hashBytes(hash, &nodes[i], sizeof(BBHLinearNode));
+        bool valid = levels[i] <= BBHTree::MaxDepth && (nodes[i].isLeaf() ?
+            uint64_t(nodes[i].primitivesOffset) + nodes[i].numPrimitives <= header.numReferences :
+            nodes[i].secondChildOffset > i + 1 && nodes[i].secondChildOffset < header.numNodes);
+        if (!valid)
+        {
+            warning("Ignoring corrupt BVH cache file '%s'.\n", filename);
+            return false;
+        }
+        if (!nodes[i].isLeaf())
+        {
+            uint8_t childLevel = uint8_t(levels[i] + 1);
+            levels[i + 1] = std::max(levels[i + 1], childLevel);
+            levels[nodes[i].secondChildOffset] = std::max(levels[nodes[i].secondChildOffset], childLevel);
+        }
+    }
+
+    vector<uint32_t> fileOrder(header.numReferences);
+    memcpy(fileOrder.data(), references, header.numReferences * sizeof(uint32_t));
+    hash = hashBytes(hash, fileOrder.data(), fileOrder.size() * sizeof(uint32_t));
+    if (hash != header.checksum)
+    {
+        warning("Ignoring corrupt BVH cache file '%s'.\n", filename);
+        return false;
+    }
+
+    // every primitive must be referenced, and only spatial splits may
+    // reference a primitive more than once
+    vector<bool> seen(numPrimitives, false);
+    size_t numSeen = 0;
+    for (auto index : fileOrder)
+    {
+        if (index >= numPrimitives || (seen[index] && header.numReferences == numPrimitives))
+        {
+            warning("Ignoring corrupt BVH cache file '%s'.\n", filename);
+            return false;
+        }
+        numSeen += !seen[index];
+        seen[index] = true;
+    }
+    if (numSeen != numPrimitives)
+    {
+        warning("Ignoring corrupt BVH cache file '%s'.\n", filename);
+        return false;
+    }
+
+    tree.setNodes(file, nodes, header.numNodes);
+    order.swap(fileOrder);
+    return true;
+}
+
+bool saveBBHCache(const string & filename, uint64_t key, size_t numPrimitives,
+                  const BBHTree & tree, const vector<uint32_t> & order)
+{
+    CacheHeader header = {};
+    memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+    header.version = CacheVersion;
+    header.nodeSize = sizeof(BBHLinearNode);
+    header.key = key;
+    header.numNodes = tree.numNodes();
+    header.numPrimitives = numPrimitives;
+    header.numReferences = order.size();
+    header.checksum = checksum(tree.nodes(), tree.numNodes(), order.data(), order.size());
+
+    // write to a temporary file of our own first, so that concurrent renders
+    // never see (or write to) a partially written cache file
+    string tempFilename = temporaryFilename(filename);
+    {
+        std::ofstream out(tempFilename, std::ios::binary);
+        out.write((const char *) &header, sizeof(header));
+        out.write((const char *) tree.nodes(), tree.numNodes() * sizeof(BBHLinearNode));
+        out.write((const char *) order.data(), order.size() * sizeof(uint32_t));
+        if (!out.good())
+        {
+            out.close();
+            std::remove(tempFilename.c_str());
+            return false;
+        }
+    }
+
+    std::remove(filename.c_str());
+    if (std::rename(tempFilename.c_str(), filename.c_str()) != 0)
+    {
+        std::remove(tempFilename.c_str());
+        return false;
+    }
+    return true;
+}
@@ -24,6 +24,7 @@
 
 uint64_t intersection_tests = 0;
 uint64_t rays_traced = 0;
+uint64_t nodes_visited = 0;
 
 Verbosity g_verbosity = Verbosity::Debug;
 
@@ -0,0 +1,320 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirt/grid.h>
+#include <dirt/timer.h>
+#include <algorithm>
+
+namespace
+{
+
+// cells per axis of a grid over the given box with about density * count
+// roughly cubical cells (axes too thin for more than one cell are left out,
+// so that flat boxes get square cells)
+void gridResolution(const Box3f & box, size_t count, float density, int maxResolution, int resolution[3])
+{
+    Vec3f d = box.diagonal();
+    bool thin[3] = {false, false, false};
+    float cellsPerLength = 0.f;
+    for (int pass = 0; pass < 3; ++pass)
+    {
+        float volume = 1.f;
+        int dimensions = 0;
+        for (int a = 0; a < 3; ++a)
+            if (!thin[a])
+            {
+                volume *= d[a];
+                dimensions++;
+            }
+        cellsPerLength = std::pow(density * count / volume, 1.f / dimensions);
+
+        bool changed = false;
+        for (int a = 0; a < 3; ++a)
+            if (!thin[a] && dimensions > 1 && d[a] * cellsPerLength < 1.f)
+                thin[a] = changed = true;
+        if (!changed)
+            break;
+    }
+
+    for (int a = 0; a < 3; ++a)
+        resolution[a] = thin[a] ? 1 : clamp(int(std::round(d[a] * cellsPerLength)), 1, maxResolution);
+}
+
+// range of cells of a grid that a box overlaps along each axis, padded by a
+// fraction of a cell so that rays that graze cell boundaries cannot miss it
+void cellRange(const Box3f & bounds, const Box3f & grid, const Vec3f & invCellSize, const int resolution[3],
+               int lo[3], int hi[3])
+{
+    const float padding = 1e-3f;
+    for (int a = 0; a < 3; ++a)
+    {
+        float l = (bounds.pMin[a] - grid.pMin[a]) * invCellSize[a] - padding;
+        float h = (bounds.pMax[a] - grid.pMin[a]) * invCellSize[a] + padding;
+        lo[a] = clamp(int(std::floor(std::max(l, 0.f))), 0, resolution[a] - 1);
+        hi[a] = clamp(int(std::floor(std::min(h, float(resolution[a])))), 0, resolution[a] - 1);
+    }
+}
+
+} // namespace
+
+
+void UniformGrid::clear()
+{
+    m_cells.clear();
+    m_cells.shrink_to_fit();
+    m_levels.clear();
+    m_levels.shrink_to_fit();
+}
+
+BBHBuildStats UniformGrid::build(const vector<Box3f> & bounds, const GridSettings & settings, Progress & progress,
+                                 vector<uint32_t> & order)
+{
+    Timer timer;
+    clear();
+    order.clear();
+
+    BBHBuildStats stats;
+    if (bounds.empty())
+        return stats;
+
+    // pad the grid slightly, so that flat scenes still get cells with volume
+    Box3f box;
+    for (auto & b : bounds)
+        box.enclose(b);
+    Vec3f d = box.diagonal();
+    float padding = 1e-4f * std::max(std::max(d.x, d.y), std::max(d.z, 1e-3f));
+    box.pMin -= Vec3f(padding);
+    box.pMax += Vec3f(padding);
+
+    // a grid over the given primitives, whose references to them are
+    // counted and then filled in by two passes, like a counting sort
+    auto addLevel = [&](const Box3f & levelBounds, size_t count, float density, vector<uint32_t> & refs,
+                        vector<uint32_t> & cellOffsets) -> size_t
+    {
+        Level level;
+        level.bounds = levelBounds;
+        gridResolution(levelBounds, count, density, settings.maxResolution, level.resolution);
+        for (int a = 0; a < 3; ++a)
+        {
+            level.cellSize[a] = levelBounds.diagonal()[a] / level.resolution[a];
+            level.invCellSize[a] = 1.f / level.cellSize[a];
+        }
+        level.firstCell = uint32_t(m_cells.size());
+        m_levels.push_back(level);
+
+        size_t numCells = size_t(level.resolution[0]) * level.resolution[1] * level.resolution[2];
+        cellOffsets.assign(numCells + 1, 0);
+        auto forEachCell = [&](uint32_t primitive, const std::function<void(size_t)> & f)
+        {
+            int lo[3], hi[3];
+            cellRange(bounds[primitive], levelBounds, level.invCellSize, level.resolution, lo, hi);
+            for (int z = lo[2]; z <= hi[2]; ++z)
+                for (int y = lo[1]; y <= hi[1]; ++y)
+                    for (int x = lo[0]; x <= hi[0]; ++x)
+                        f((size_t(z) * level.resolution[1] + y) * level.resolution[0] + x);
+        };
+
+        vector<uint32_t> primitives;
+        primitives.swap(refs);
+        for (auto p : primitives)
+            forEachCell(p, [&](size_t c) {cellOffsets[c + 1]++;});
+        for (auto c : range(numCells))
+            cellOffsets[c + 1] += cellOffsets[c];
+
+        refs.resize(cellOffsets[numCells]);
+        vector<uint32_t> fill(cellOffsets.begin(), cellOffsets.end() - 1);
+        for (auto p : primitives)
+            forEachCell(p, [&](size_t c) {refs[fill[c]++] = p;});
+        return numCells;
+    };
+
+    vector<uint32_t> refs(bounds.size()), cellOffsets;
+    for (auto i : range(uint32_t(bounds.size())))
+        refs[i] = i;
+    size_t numCells = addLevel(box, bounds.size(), settings.density, refs, cellOffsets);
+    m_cells.resize(numCells);
+    progress += bounds.size() / 2;
+
+    // store the references cell by cell, refining dense cells by nested grids
+    order.reserve(refs.size());
+    vector<uint32_t> nestedRefs, nestedOffsets;
+    for (auto c : range(numCells))
+    {
+        uint32_t first = cellOffsets[c], count = cellOffsets[c + 1] - first;
+        if (settings.refine && count > uint32_t(settings.refineThreshold))
+        {
+            const Level & top = m_levels[0];
+            int x = int(c % top.resolution[0]), y = int(c / top.resolution[0] % top.resolution[1]),
+                z = int(c / (size_t(top.resolution[0]) * top.resolution[1]));
+            Box3f cellBounds;
+            cellBounds.pMin = top.bounds.pMin + Vec3f(float(x), float(y), float(z)) * top.cellSize;
+            cellBounds.pMax = top.bounds.pMin + Vec3f(float(x + 1), float(y + 1), float(z + 1)) * top.cellSize;
+
+            int resolution[3];
+            gridResolution(cellBounds, count, settings.nestedDensity, settings.maxResolution, resolution);
+            if (resolution[0] * resolution[1] * resolution[2] > 1)
+            {
+                uint32_t levelIndex = uint32_t(m_levels.size());
+                nestedRefs.assign(refs.begin() + first, refs.begin() + first + count);
+                size_t nestedCells = addLevel(cellBounds, count, settings.nestedDensity, nestedRefs, nestedOffsets);
+
+                // keep the nested grid only if a random ray through the cell
+                // is expected to test fewer primitives (see statistics())
+                Vec3f s = m_levels[levelIndex].cellSize;
+                float nestedArea = 2.f * (s.x * s.y + s.y * s.z + s.z * s.x);
+                float cost = nestedArea / cellBounds.surfaceArea() *
+                             (nestedCells * settings.traversalCost + nestedRefs.size());
+                if (cost < count)
+                {
+                    m_cells[c] = {levelIndex, GridCell::Refined};
+                    m_cells.resize(m_cells.size() + nestedCells);
+                    for (auto n : range(nestedCells))
+                    {
+                        GridCell & cell = m_cells[m_levels[levelIndex].firstCell + n];
+                        cell.offset = uint32_t(order.size() + nestedOffsets[n]);
+                        cell.count = nestedOffsets[n + 1] - nestedOffsets[n];
+                    }
+                    order.insert(order.end(), nestedRefs.begin(), nestedRefs.end());
+                    continue;
+                }
+                m_levels.pop_back();
+            }
+        }
+
+        m_cells[c] = {uint32_t(order.size()), count};
+        order.insert(order.end(), refs.begin() + first, refs.begin() + first + count);
+    }
+    progress += bounds.size() - bounds.size() / 2;
+
+    stats.milliseconds = timer.elapsed();
+    return stats;
+}
+
+json UniformGrid::statistics(const GridSettings & settings) const
+{
+    vector<int> depthHistogram, leafSizeHistogram;
+    uint64_t numLeaves = 0, numReferences = 0;
+    double leafDepthSum = 0.0, cost = 0.0;
+
+    // the cells of each grid partition it, so the expected number of cells a
+    // random ray crosses is the sum of their surface areas over that of the grid
+    for (auto l : range(m_levels.size()))
+    {
+        const Level & level = m_levels[l];
+        Vec3f s = level.cellSize;
+        float cellArea = 2.f * (s.x * s.y + s.y * s.z + s.z * s.x);
+        int depth = l == 0 ? 0 : 1;
+        size_t numCells = size_t(level.resolution[0]) * level.resolution[1] * level.resolution[2];
+        for (auto c : range(numCells))
+        {
+            const GridCell & cell = m_cells[level.firstCell + c];
+            cost += cellArea * settings.traversalCost;
+            if (cell.isRefined())
+                continue;
+
+            numLeaves++;
+            numReferences += cell.count;
+            leafDepthSum += depth;
+            cost += cellArea * cell.count;
+            if (depth >= int(depthHistogram.size()))
+                depthHistogram.resize(depth + 1, 0);
+            depthHistogram[depth]++;
+            if (cell.count >= leafSizeHistogram.size())
+                leafSizeHistogram.resize(cell.count + 1, 0);
+            leafSizeHistogram[cell.count]++;
+        }
+    }
+
+    float rootArea = empty() ? 0.f : m_levels[0].bounds.surfaceArea();
+    json stats;
+    stats["nodes"] = m_cells.size();
+    stats["leaves"] = numLeaves;
+    stats["references"] = numReferences;
+    stats["sah_cost"] = rootArea > 0.f ? cost / rootArea : 0.0;
+    stats["max_depth"] = depthHistogram.empty() ? 0 : int(depthHistogram.size()) - 1;
+    stats["mean_leaf_depth"] = numLeaves ? leafDepthSum / numLeaves : 0.0;
+    stats["leaf_depth_histogram"] = depthHistogram;
+    stats["leaf_size_histogram"] = leafSizeHistogram;
+    // the cells of a grid never overlap
+    stats["overlap"] = 0.0;
+    return stats;
+}
+
+void UniformGrid::leafRanges(vector<std::pair<uint32_t, uint32_t>> & leaves) const
+{
+    size_t first = leaves.size();
+    for (auto & cell : m_cells)
+        if (!cell.isRefined() && cell.count > 0)
+            leaves.emplace_back(cell.offset, cell.count);
+    // the cells of nested grids are stored after the top-level grid
+    std::sort(leaves.begin() + first, leaves.end());
+}
+
+
+GridAccelerator::GridAccelerator(const Scene & scene, const json & j) : Accelerator(scene, j)
+{
+    m_gridSettings.maxResolution = j.value("max_resolution", m_gridSettings.maxResolution);
+    m_gridSettings.refine = j.value("refine", m_gridSettings.refine);
+    m_gridSettings.refineThreshold = j.value("refine_threshold", m_gridSettings.refineThreshold);
+    m_gridSettings.nestedDensity = j.value("nested_density", m_gridSettings.nestedDensity);
+    if (m_gridSettings.refineThreshold < 1)
+        throw DirtException("Grid 'refine_threshold' must be at least 1 here:\n%s", j.dump(4));
+    // a refined grid starts from coarse cells of about "refine_threshold" primitives each
+    if (m_gridSettings.refine)
+        m_gridSettings.density = 1.f / m_gridSettings.refineThreshold;
+    m_gridSettings.density = j.value("density", m_gridSettings.density);
+    m_gridSettings.traversalCost = j.value("traversal_cost", m_gridSettings.traversalCost);
+
+    if (m_gridSettings.density <= 0.f || m_gridSettings.nestedDensity <= 0.f)
+        throw DirtException("Grid 'density' and 'nested_density' must be positive here:\n%s", j.dump(4));
+    if (m_gridSettings.maxResolution < 1 || m_gridSettings.maxResolution > 1024)
+        throw DirtException("Grid 'max_resolution' must be between 1 and 1024 here:\n%s", j.dump(4));
+}
+
+void GridAccelerator::buildPrimitives(const vector<Box3f> & bounds, vector<uint32_t> & order,
+                                      const BBHSplitFunction &)
+{
+    setTraversal(nullptr);
+    m_grid.clear();
+
+    BBHBuildStats stats;
+    {
+        Progress progress("Building grid", bounds.size());
+        stats = m_grid.build(bounds, m_gridSettings, progress, order);
+    }
+    message("Built grid in %s\n", timeString(stats.milliseconds));
+    message("Grid: %d cells in %d grids (%s), %d primitive references (%.1f per primitive)\n",
+            m_grid.cells().size(), m_grid.numGrids(), memString(m_grid.bytes()),
+            order.size(), bounds.empty() ? 0.f : float(order.size()) / bounds.size());
+    setTraversal(&m_grid);
+}
+
+vector<std::pair<uint32_t, uint32_t>> GridAccelerator::leafRanges() const
+{
+    vector<std::pair<uint32_t, uint32_t>> leaves;
+    m_grid.leafRanges(leaves);
+    return leaves;
+}
+
+json GridAccelerator::treeStats() const
+{
+    json stats = m_grid.statistics(m_gridSettings);
+    stats["type"] = "grid";
+    stats["node_bytes"] = m_grid.bytes();
+    return stats;
+}
@@ -0,0 +1,110 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirt/instance.h>
+#include <dirt/scene.h>
+
+Instance::Instance(const Scene & scene, const json & j)
+    : Surface(scene, j)
+{
+    m_mesh = scene.findMesh(j);
+    m_worldToMesh = m_xform.inverse();
+    m_material = scene.findOrCreateMaterial(j);
+    m_medium_interface = scene.findOrCreateMediumInterface(j);
+}
+
+Box3f Instance::localBBox() const
+{
+    return m_mesh->localBBox();
+}
+
+void Instance::setTransform(const Transform & xform)
+{
+    m_xform = xform;
+    m_worldToMesh = m_xform.inverse();
+}
+
+void Instance::hitToWorld(HitInfo &hit) const
+{
+    // the mesh-space ray is an affine transformation of the world-space ray,
+    // so the ray parameter t stays the same
+    hit.p = m_xform.point(hit.p);
+    hit.gn = m_xform.normal(hit.gn);
+    hit.sn = m_xform.normal(hit.sn);
+    hit.mat = m_material.get();
+    hit.mi = m_medium_interface.get();
+    hit.surface = this;
+}
+
+bool Instance::intersect(const Ray3f &ray, HitInfo &hit) const
+{
+    return intersectAndFinalize(ray, hit);
+}
+
+bool Instance::intersectCandidate(const Ray3f &ray, HitInfo &hit) const
+{
+    if (!m_mesh->intersectCandidate(m_worldToMesh.ray(ray), hit))
+        return false;
+
+    // the mesh finalizes the hit in finalizeHit below
+    hit.surface = this;
+    return true;
+}
+
+void Instance::finalizeHit(const Ray3f &ray, HitInfo &hit) const
+{
+    m_mesh->finalizeHit(m_worldToMesh.ray(ray), hit);
+    hitToWorld(hit);
+}
+
+bool Instance::occluded(const Ray3f &ray) const
+{
+    return m_mesh->occluded(m_worldToMesh.ray(ray));
+}
+
+uint32_t Instance::intersectPacketCandidates(RayPacket &packet, uint32_t activeMask, HitInfo *hits) const
+{
+    RayPacket local;
+    local.size = packet.size;
+    for (int i = 0; i < packet.size; ++i)
+        if (activeMask & (1u << i))
+            local.set(i, m_worldToMesh.ray(packet.ray(i)));
+
+    uint32_t hitMask = m_mesh->intersectPacketCandidates(local, activeMask, hits);
+    for (int i = 0; i < packet.size; ++i)
+    {
+        if (!(hitMask & (1u << i)))
+            continue;
+
+        // the mesh finalizes the hit in finalizeHit
+        hits[i].surface = this;
+        packet.maxt[i] = hits[i].t;
+    }
+    return hitMask;
+}
+
+Vec3f Instance::sample(const Vec3f& o, const Vec2f &sample) const
+{
+    Vec3f v = m_mesh->sample(m_worldToMesh.point(o), sample);
+    return normalize(m_xform.vector(v));
+}
+
+float Instance::pdf(const Vec3f& o, const Vec3f& v) const
+{
+    return m_mesh->pdf(m_worldToMesh.point(o), normalize(m_worldToMesh.vector(v)));
+}
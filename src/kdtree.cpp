@@ -0,0 +1,363 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirt/kdtree.h>
+#include <dirt/timer.h>
+#include <algorithm>
+#include <unordered_set>
+
+namespace
+{
+
+// a primitive, or the part of it inside the cell of a node
+struct KdReference
+{
+    uint32_t index;
+    Box3f bounds;
+};
+
+// the start or end of the bounds of a reference along the split axis
+struct BoundEdge
+{
+    float t;
+    uint32_t reference;
+    bool start;
+
+    // edges at the same position start before they end
+    bool operator<(const BoundEdge & other) const
+    {
+        return t != other.t ? t < other.t : start > other.start;
+    }
+};
+
+struct KdBuildContext
+{
+    const KdTreeSettings & settings;
+    const BBHSplitFunction & splitPrimitive;
+    vector<KdTreeNode> & nodes;
+    vector<uint32_t> & order;
+    Progress & progress;
+    double progressDone;    ///< Fraction of the primitives covered by finished leaves, times their number
+};
+
+Box3f overlap(const Box3f & a, const Box3f & b)
+{
+    Box3f result;
+    result.pMin = max(a.pMin, b.pMin);
+    result.pMax = min(a.pMax, b.pMax);
+    return result;
+}
+
+// clip a reference that straddles the plane at position along axis to both
+// sides of the plane
+void clipReference(const KdBuildContext & ctx, const KdReference & ref, int axis, float position,
+                   Box3f & below, Box3f & above)
+{
+    below = above = Box3f();
+    if (ctx.splitPrimitive)
+        ctx.splitPrimitive(ref.index, axis, position, below, above);
+    else
+        below = above = ref.bounds;
+
+    below.pMax[axis] = std::min(below.pMax[axis], position);
+    above.pMin[axis] = std::max(above.pMin[axis], position);
+    below = overlap(below, ref.bounds);
+    above = overlap(above, ref.bounds);
+}
+
+// the SAH cost of the best split of a cell along one axis, following the
+// kd-tree builder of pbrt: every edge of every reference is a candidate
+void findSplit(const vector<KdReference> & refs, const Box3f & cell, int axis, const KdTreeSettings & settings,
+               vector<BoundEdge> & edges, float & bestCost, int & bestAxis, float & bestSplit)
+{
+    edges.clear();
+    for (auto i : range(uint32_t(refs.size())))
+    {
+        edges.push_back({refs[i].bounds.pMin[axis], i, true});
+        edges.push_back({refs[i].bounds.pMax[axis], i, false});
+    }
+    std::sort(edges.begin(), edges.end());
+
+    Vec3f d = cell.diagonal();
+    int axis1 = (axis + 1) % 3, axis2 = (axis + 2) % 3;
+    float invArea = 1.f / cell.surfaceArea();
+    size_t below = 0, above = refs.size();
+    for (auto & edge : edges)
+    {
+        if (!edge.start)
+            --above;
+
+        if (edge.t > cell.pMin[axis] && edge.t < cell.pMax[axis])
+        {
+            float belowArea = 2.f * (d[axis1] * d[axis2] + (edge.t - cell.pMin[axis]) * (d[axis1] + d[axis2]));
+            float aboveArea = 2.f * (d[axis1] * d[axis2] + (cell.pMax[axis] - edge.t) * (d[axis1] + d[axis2]));
+            float bonus = (below == 0 || above == 0) ? settings.emptyBonus : 0.f;
+            float cost = settings.traversalCost +
+                         (1.f - bonus) * invArea * (belowArea * below + aboveArea * above);
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = edge.t;
+            }
+        }
+
+        if (edge.start)
+            ++below;
+    }
+}
+
+// primitives are referenced by several leaves, so each node is credited with
+// its share of the progress of its parent, split by reference counts
+void makeLeaf(KdBuildContext & ctx, uint32_t nodeIndex, const vector<KdReference> & refs, double share)
+{
+    KdTreeNode & leaf = ctx.nodes[nodeIndex];
+    leaf.primitivesOffset = uint32_t(ctx.order.size());
+    leaf.flags = (uint32_t(refs.size()) << 2) | 3u;
+    for (auto & ref : refs)
+        ctx.order.push_back(ref.index);
+
+    int64_t before = int64_t(ctx.progressDone);
+    ctx.progressDone += share;
+    ctx.progress += int64_t(ctx.progressDone) - before;
+}
+
+void buildRecursive(KdBuildContext & ctx, const Box3f & cell, vector<KdReference> & refs,
+                    double share, int depth, int badRefines, vector<BoundEdge> & edges)
+{
+    uint32_t nodeIndex = uint32_t(ctx.nodes.size());
+    ctx.nodes.emplace_back();
+
+    float leafCost = float(refs.size());
+    if (refs.size() <= size_t(ctx.settings.maxLeafSize) || depth == 0 || cell.surfaceArea() <= 0.f)
+        return makeLeaf(ctx, nodeIndex, refs, share);
+
+    // try the axis of largest extent first, and the others only if it has
+    // no split inside the cell
+    float bestCost = std::numeric_limits<float>::infinity(), split = 0.f;
+    Vec3f d = cell.diagonal();
+    int bestAxis = -1, axis = d.x > d.y && d.x > d.z ? 0 : (d.y > d.z ? 1 : 2);
+    for (int retries = 0; retries < 3 && bestAxis < 0; ++retries, axis = (axis + 1) % 3)
+        findSplit(refs, cell, axis, ctx.settings, edges, bestCost, bestAxis, split);
+
+    // give up on nodes that splitting keeps making more expensive
+    if (bestCost > leafCost)
+        ++badRefines;
+    if (bestAxis < 0 || (bestCost > 4.f * leafCost && refs.size() < 16) || badRefines == 3)
+        return makeLeaf(ctx, nodeIndex, refs, share);
+
+    // references that straddle the plane are clipped to both sides, and
+    // dropped from a side if their clipped part turns out to be empty
+    Box3f belowCell = cell, aboveCell = cell;
+    belowCell.pMax[bestAxis] = aboveCell.pMin[bestAxis] = split;
+    vector<KdReference> below, above;
+    for (auto & ref : refs)
+    {
+        bool inAbove = ref.bounds.pMax[bestAxis] > split;
+        bool inBelow = ref.bounds.pMin[bestAxis] < split || !inAbove;
+        if (inBelow && inAbove)
+        {
+            Box3f belowBounds, aboveBounds;
+            clipReference(ctx, ref, bestAxis, split, belowBounds, aboveBounds);
+            if (!belowBounds.isEmpty() || !aboveBounds.isEmpty())
+            {
+                if (!belowBounds.isEmpty())
+                    below.push_back({ref.index, belowBounds});
+                if (!aboveBounds.isEmpty())
+                    above.push_back({ref.index, aboveBounds});
+                continue;
+            }
+        }
+        if (inBelow)
+            below.push_back(ref);
+        if (inAbove)
+            above.push_back(ref);
+    }
+    vector<KdReference>().swap(refs);
+
+    double belowShare = share * below.size() / (below.size() + above.size());
+    buildRecursive(ctx, belowCell, below, belowShare, depth - 1, badRefines, edges);
+    uint32_t aboveIndex = uint32_t(ctx.nodes.size());
+    buildRecursive(ctx, aboveCell, above, share - belowShare, depth - 1, badRefines, edges);
+
+    KdTreeNode & node = ctx.nodes[nodeIndex];
+    node.split = split;
+    node.flags = (aboveIndex << 2) | uint32_t(bestAxis);
+}
+
+} // namespace
+
+
+constexpr int KdTree::MaxDepth;
+
+BBHBuildStats KdTree::build(const vector<Box3f> & bounds, const KdTreeSettings & settings, Progress & progress,
+                            vector<uint32_t> & order, const BBHSplitFunction & splitPrimitive)
+{
+    Timer timer;
+    clear();
+    order.clear();
+
+    BBHBuildStats stats;
+    if (bounds.empty())
+        return stats;
+
+    vector<KdReference> refs(bounds.size());
+    for (auto i : range(uint32_t(bounds.size())))
+    {
+        refs[i] = {i, bounds[i]};
+        m_bounds.enclose(bounds[i]);
+    }
+
+    int maxDepth = settings.maxDepth > 0 ? settings.maxDepth
+                                         : int(std::round(8.f + 1.3f * std::log2(float(bounds.size()))));
+    maxDepth = std::min(maxDepth, MaxDepth);
+
+    vector<BoundEdge> edges;
+    edges.reserve(2 * bounds.size());
+    KdBuildContext ctx = {settings, splitPrimitive, m_nodes, order, progress, 0.0};
+    buildRecursive(ctx, m_bounds, refs, double(bounds.size()), maxDepth, 0, edges);
+    m_nodes.shrink_to_fit();
+
+    stats.milliseconds = timer.elapsed();
+    return stats;
+}
+
+float KdTree::sahCost(const KdTreeSettings & settings) const
+{
+    return statistics(settings)["sah_cost"];
+}
+
+json KdTree::statistics(const KdTreeSettings & settings) const
+{
+    vector<int> depthHistogram, leafSizeHistogram;
+    uint64_t numLeaves = 0, numReferences = 0;
+    double leafDepthSum = 0.0, cost = 0.0;
+
+    // walk the tree to recover the cell of each node
+    struct Entry
+    {
+        uint32_t node;
+        int depth;
+        Box3f cell;
+    };
+    vector<Entry> stack;
+    if (!m_nodes.empty())
+        stack.push_back({0, 0, m_bounds});
+    while (!stack.empty())
+    {
+        Entry entry = stack.back();
+        stack.pop_back();
+        const KdTreeNode & node = m_nodes[entry.node];
+        if (node.isLeaf())
+        {
+            numLeaves++;
+            numReferences += node.numPrimitives();
+            leafDepthSum += entry.depth;
+            cost += entry.cell.surfaceArea() * node.numPrimitives();
+            if (entry.depth >= int(depthHistogram.size()))
+                depthHistogram.resize(entry.depth + 1, 0);
+            depthHistogram[entry.depth]++;
+            if (node.numPrimitives() >= leafSizeHistogram.size())
+                leafSizeHistogram.resize(node.numPrimitives() + 1, 0);
+            leafSizeHistogram[node.numPrimitives()]++;
+        }
+        else
+        {
+            cost += entry.cell.surfaceArea() * settings.traversalCost;
+            Box3f below = entry.cell, above = entry.cell;
+            below.pMax[node.axis()] = above.pMin[node.axis()] = node.split;
+            stack.push_back({node.aboveChild(), entry.depth + 1, above});
+            stack.push_back({entry.node + 1, entry.depth + 1, below});
+        }
+    }
+
+    float rootArea = m_bounds.surfaceArea();
+    json stats;
+    stats["nodes"] = m_nodes.size();
+    stats["leaves"] = numLeaves;
+    stats["references"] = numReferences;
+    stats["sah_cost"] = rootArea > 0.f ? cost / rootArea : 0.0;
+    stats["max_depth"] = depthHistogram.empty() ? 0 : int(depthHistogram.size()) - 1;
+    stats["mean_leaf_depth"] = numLeaves ? leafDepthSum / numLeaves : 0.0;
+    stats["leaf_depth_histogram"] = depthHistogram;
+    stats["leaf_size_histogram"] = leafSizeHistogram;
+    // the cells of a kd-tree never overlap
+    stats["overlap"] = 0.0;
+    return stats;
+}
+
+void KdTree::leafRanges(vector<std::pair<uint32_t, uint32_t>> & leaves) const
+{
+    // leaves are stored in depth-first order, like their primitives
+    for (auto & node : m_nodes)
+        if (node.isLeaf() && node.numPrimitives() > 0)
+            leaves.emplace_back(node.primitivesOffset, node.numPrimitives());
+}
+
+
+KdTreeAccelerator::KdTreeAccelerator(const Scene & scene, const json & j) : Accelerator(scene, j)
+{
+    m_kdSettings.traversalCost = j.value("traversal_cost", m_kdSettings.traversalCost);
+    m_kdSettings.emptyBonus = j.value("empty_bonus", m_kdSettings.emptyBonus);
+    m_kdSettings.maxLeafSize = j.value("max_leaf_size", m_kdSettings.maxLeafSize);
+    m_kdSettings.maxDepth = j.value("max_depth", m_kdSettings.maxDepth);
+
+    if (m_kdSettings.maxLeafSize < 1)
+        throw DirtException("kd-tree 'max_leaf_size' must be at least 1 here:\n%s", j.dump(4));
+    if (m_kdSettings.emptyBonus < 0.f || m_kdSettings.emptyBonus > 1.f)
+        throw DirtException("kd-tree 'empty_bonus' must be between 0 and 1 here:\n%s", j.dump(4));
+    if (m_kdSettings.maxDepth < 0 || m_kdSettings.maxDepth > KdTree::MaxDepth)
+        throw DirtException("kd-tree 'max_depth' must be between 0 and %d here:\n%s", KdTree::MaxDepth, j.dump(4));
+}
+
+void KdTreeAccelerator::buildPrimitives(const vector<Box3f> & bounds, vector<uint32_t> & order,
+                                        const BBHSplitFunction & splitPrimitive)
+{
+    setTraversal(nullptr);
+    m_kdTree.clear();
+
+    BBHBuildStats stats;
+    {
+        Progress progress("Building kd-tree", bounds.size());
+        stats = m_kdTree.build(bounds, m_kdSettings, progress, order, splitPrimitive);
+    }
+    message("Built kd-tree in %s\n", timeString(stats.milliseconds));
+    message("kd-tree: %d nodes (%s), %d primitive references (%.1f per primitive), SAH cost: %f\n",
+            m_kdTree.nodes().size(), memString(m_kdTree.nodes().size() * sizeof(KdTreeNode)),
+            order.size(), bounds.empty() ? 0.f : float(order.size()) / bounds.size(),
+            m_kdTree.sahCost(m_kdSettings));
+    setTraversal(&m_kdTree);
+}
+
+vector<std::pair<uint32_t, uint32_t>> KdTreeAccelerator::leafRanges() const
+{
+    vector<std::pair<uint32_t, uint32_t>> leaves;
+    m_kdTree.leafRanges(leaves);
+    return leaves;
+}
+
+json KdTreeAccelerator::treeStats() const
+{
+    json stats = m_kdTree.statistics(m_kdSettings);
+    stats["type"] = "kdtree";
+    stats["split"] = "sah";
+    stats["width"] = 2;
+    stats["quantized"] = false;
+    stats["node_bytes"] = m_kdTree.nodes().size() * sizeof(KdTreeNode);
+    return stats;
+}
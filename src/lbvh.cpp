@@ -0,0 +1,419 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirt/lbvh.h>
+#include <dirt/timer.h>
+#include <algorithm>
+
+namespace
+{
+
+// below this depth, nodes are split at their middle primitive to bound the
+// depth of the hierarchy (see the SAH builder)
+const int MaxMortonDepth = BBHTree::MaxDepth / 2;
+
+struct MortonPrimitive
+{
+    uint64_t code;
+    uint32_t index;
+};
+
+// spread the lowest 21 bits of v apart, so that there are two zero bits
+// between any two consecutive bits
+uint64_t expandBits(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+// sort primitives by their Morton codes with a least-significant-digit radix
+// sort over 8-bit digits, using only as many passes as the codes have bits
+void radixSort(vector<MortonPrimitive> & primitives, int bits)
+{
+    vector<MortonPrimitive> sorted(primitives.size());
+    for (int shift = 0; shift < bits; shift += 8)
+    {
+        size_t offsets[256] = {0};
+        for (auto & p : primitives)
+            offsets[(p.code >> shift) & 255]++;
+
+        size_t offset = 0;
+        for (auto & o : offsets)
+        {
+            size_t count = o;
+            o = offset;
+            offset += count;
+        }
+
+        for (auto & p : primitives)
+            sorted[offsets[(p.code >> shift) & 255]++] = p;
+        primitives.swap(sorted);
+    }
+}
+
+// return the index of the highest bit in which a and b differ
+int highestDifferingBit(uint64_t a, uint64_t b)
+{
+    uint64_t x = a ^ b;
+    int bit = 0;
+    for (int shift = 32; shift > 0; shift >>= 1)
+    {
+        if (x >> shift)
+        {
+            x >>= shift;
+            bit += shift;
+        }
+    }
+    return bit;
+}
+
+// a node of the hierarchy while it is being built and restructured
+struct BuildNode
+{
+    Box3f bounds;
+    int children[2] = {-1, -1};
+    uint32_t first = 0;         ///< Leaf: first sorted primitive
+    uint32_t count = 0;         ///< Number of primitives in the subtree
+    float cost = 0.f;           ///< SAH cost of the subtree (not normalized)
+
+    bool isLeaf() const {return children[0] < 0;}
+};
+
+class LBVHBuilder
+{
+public:
+    LBVHBuilder(const vector<MortonPrimitive> & primitives, const vector<Box3f> & bounds,
+                const BBHSettings & settings, Progress & progress) :
+        m_primitives(primitives), m_bounds(bounds), m_settings(settings), m_progress(progress)
+    {
+        m_nodes.reserve(2 * primitives.size());
+    }
+
+    // build the hierarchy over the sorted primitives [first, end) and return its root
+    int build(uint32_t first, uint32_t end, int depth)
+    {
+        int index = int(m_nodes.size());
+        m_nodes.emplace_back();
+
+        uint32_t count = end - first;
+        if (count <= uint32_t(m_settings.maxLeafSize))
+        {
+            BuildNode & leaf = m_nodes[index];
+            for (uint32_t i = first; i < end; ++i)
+                leaf.bounds.enclose(m_bounds[m_primitives[i].index]);
+            leaf.first = first;
+            leaf.count = count;
+            leaf.cost = count * leaf.bounds.surfaceArea();
+            m_progress += count;
+            return index;
+        }
+
+        // split where the highest differing bit of the codes in the range
+        // changes; all codes in the range agree on the bits above it
+        uint64_t firstCode = m_primitives[first].code, lastCode = m_primitives[end - 1].code;
+        uint32_t mid;
+        if (firstCode == lastCode || depth >= MaxMortonDepth)
+            mid = first + count / 2;
+        else
+        {
+            uint64_t bit = uint64_t(1) << highestDifferingBit(firstCode, lastCode);
+            mid = uint32_t(std::partition_point(m_primitives.begin() + first, m_primitives.begin() + end,
+                                                [bit](const MortonPrimitive & p)
+                                                {
+                                                    return !(p.code & bit);
+                                                }) - m_primitives.begin());
+        }
+
+        int child0 = build(first, mid, depth + 1);
+        int child1 = build(mid, end, depth + 1);
+
+        // the node array may have been reallocated by the recursive calls
+        BuildNode & node = m_nodes[index];
+        node.children[0] = child0;
+        node.children[1] = child1;
+        updateNode(index);
+        return index;
+    }
+
+    // restructure the treelets of all nodes with at least minCount primitives
+    // below node n, bottom-up
+    void restructure(int n, int treeletSize, uint32_t minCount)
+    {
+        if (m_nodes[n].isLeaf() || m_nodes[n].count < minCount)
+            return;
+
+        restructure(m_nodes[n].children[0], treeletSize, minCount);
+        restructure(m_nodes[n].children[1], treeletSize, minCount);
+        optimizeTreelet(n, treeletSize);
+    }
+
+    // flatten the subtree below node n in depth-first order into nodes and
+    // return its maximum depth
+    int flatten(int n, vector<BBHLinearNode> & nodes) const
+    {
+        const BuildNode & node = m_nodes[n];
+        uint32_t index = uint32_t(nodes.size());
+        nodes.emplace_back();
+        nodes[index].bounds = node.bounds;
+        if (node.isLeaf())
+        {
+            nodes[index].primitivesOffset = node.first;
+            nodes[index].numPrimitives = uint16_t(node.count);
+            return 1;
+        }
+
+        int depth0 = flatten(node.children[0], nodes);
+        uint32_t secondChild = uint32_t(nodes.size());
+        int depth1 = flatten(node.children[1], nodes);
+
+        // use the axis along which the children are furthest apart to
+        // order the traversal
+        Vec3f separation = m_nodes[node.children[1]].bounds.center() - m_nodes[node.children[0]].bounds.center();
+        int axis = 0;
+        for (int a = 1; a < 3; ++a)
+            if (fabs(separation[a]) > fabs(separation[axis]))
+                axis = a;
+
+        nodes[index].secondChildOffset = secondChild;
+        nodes[index].axis = uint8_t(axis);
+        return 1 + std::max(depth0, depth1);
+    }
+
+    vector<BuildNode> & nodes() {return m_nodes;}
+
+private:
+    // recompute the bounds, primitive count and cost of an interior node from its children
+    void updateNode(int n)
+    {
+        BuildNode & node = m_nodes[n];
+        const BuildNode & child0 = m_nodes[node.children[0]];
+        const BuildNode & child1 = m_nodes[node.children[1]];
+        node.bounds = child0.bounds;
+        node.bounds.enclose(child1.bounds);
+        node.count = child0.count + child1.count;
+        node.cost = m_settings.traversalCost * node.bounds.surfaceArea() + child0.cost + child1.cost;
+    }
+
+    // replace the treelet rooted at node root by the topology with the lowest
+    // SAH cost over the same treelet leaves
+    void optimizeTreelet(int root, int treeletSize)
+    {
+        // form the treelet by repeatedly opening the leaf with the largest area
+        int leaves[16], internals[16];
+        int numLeaves = 2, numInternals = 1;
+        internals[0] = root;
+        leaves[0] = m_nodes[root].children[0];
+        leaves[1] = m_nodes[root].children[1];
+        while (numLeaves < treeletSize)
+        {
+            int largest = -1;
+            float largestArea = -1.f;
+            for (int i = 0; i < numLeaves; ++i)
+            {
+                float area = m_nodes[leaves[i]].bounds.surfaceArea();
+                if (!m_nodes[leaves[i]].isLeaf() && area > largestArea)
+                {
+                    largest = i;
+                    largestArea = area;
+                }
+            }
+            if (largest < 0)
+                break;
+
+            int opened = leaves[largest];
+            internals[numInternals++] = opened;
+            leaves[largest] = m_nodes[opened].children[0];
+            leaves[numLeaves++] = m_nodes[opened].children[1];
+        }
+        if (numLeaves < 3)
+            return;
+
+        // find the lowest cost of every subset of treelet leaves, and the
+        // partition of the subset achieving it, by dynamic programming
+        int numSubsets = 1 << numLeaves;
+        m_subsetBounds.resize(numSubsets);
+        m_subsetCost.resize(numSubsets);
+        m_subsetPartition.resize(numSubsets);
+        m_subsetBounds[0] = Box3f();
+        for (int s = 1; s < numSubsets; ++s)
+        {
+            int lowest = s & -s;
+            m_subsetBounds[s] = m_subsetBounds[s & (s - 1)];
+            m_subsetBounds[s].enclose(m_nodes[leaves[bitIndex(lowest)]].bounds);
+
+            if (s == lowest)
+            {
+                m_subsetCost[s] = m_nodes[leaves[bitIndex(lowest)]].cost;
+                continue;
+            }
+
+            // subsets are visited in increasing order, so both parts of every
+            // partition have already been evaluated; only partitions
+            // containing the lowest leaf are considered to skip mirrored ones
+            float best = std::numeric_limits<float>::infinity();
+            int bestPartition = lowest;
+            for (int p = (s - 1) & s; p > 0; p = (p - 1) & s)
+            {
+                if (!(p & lowest))
+                    continue;
+
+                float c = m_subsetCost[p] + m_subsetCost[s ^ p];
+                if (c < best)
+                {
+                    best = c;
+                    bestPartition = p;
+                }
+            }
+            m_subsetCost[s] = m_settings.traversalCost * m_subsetBounds[s].surfaceArea() + best;
+            m_subsetPartition[s] = bestPartition;
+        }
+
+        if (m_subsetCost[numSubsets - 1] >= m_nodes[root].cost * (1.f - 1e-5f))
+            return;
+
+        // rebuild the treelet, reusing its interior nodes
+        int nextInternal = 1;
+        assignTreelet(root, numSubsets - 1, leaves, internals, nextInternal);
+    }
+
+    // make node n the root of the optimal topology for the given subset of treelet leaves
+    void assignTreelet(int n, int subset, const int * leaves, const int * internals, int & nextInternal)
+    {
+        int parts[2] = {m_subsetPartition[subset], subset ^ m_subsetPartition[subset]};
+        for (int c = 0; c < 2; ++c)
+        {
+            if (!(parts[c] & (parts[c] - 1)))
+                m_nodes[n].children[c] = leaves[bitIndex(parts[c])];
+            else
+            {
+                int child = internals[nextInternal++];
+                m_nodes[n].children[c] = child;
+                assignTreelet(child, parts[c], leaves, internals, nextInternal);
+            }
+        }
+        updateNode(n);
+    }
+
+    static int bitIndex(int singleBit)
+    {
+        int index = 0;
+        while (singleBit > 1)
+        {
+            singleBit >>= 1;
+            ++index;
+        }
+        return index;
+    }
+
+    const vector<MortonPrimitive> & m_primitives;
+    const vector<Box3f> & m_bounds;
+    const BBHSettings & m_settings;
+    Progress & m_progress;
+    vector<BuildNode> m_nodes;
+
+    // scratch space of the treelet optimization
+    vector<Box3f> m_subsetBounds;
+    vector<float> m_subsetCost;
+    vector<int> m_subsetPartition;
+};
+
+} // namespace
+
+
+LBVH::LBVH(const Scene & scene, const json & j) : BBH(scene, j)
+{
+    m_settings.splitMethod = "lbvh";
+    m_mortonBits = j.value("morton_bits", m_mortonBits);
+    m_restructure = j.value("restructure", m_restructure);
+    m_treeletSize = j.value("treelet_size", m_treeletSize);
+    m_restructureIterations = j.value("restructure_iterations", m_restructureIterations);
+
+    if (m_mortonBits != 30 && m_mortonBits != 63)
+        throw DirtException("LBVH 'morton_bits' must be 30 or 63 here:\n%s", j.dump(4));
+    if (m_treeletSize < 3 || m_treeletSize > 10)
+        throw DirtException("LBVH 'treelet_size' must be between 3 and 10 here:\n%s", j.dump(4));
+}
+
+BBHBuildStats LBVH::buildTree(const vector<Box3f> & bounds, Progress & progress,
+                              vector<uint32_t> & order, const BBHSplitFunction &)
+{
+    Timer timer;
+
+    // quantize the centroids within their bounds and compute the Morton codes
+    Box3f centroidBounds;
+    for (auto & b : bounds)
+        centroidBounds.enclose(b.center());
+
+    int bitsPerAxis = m_mortonBits / 3;
+    float scale = float(1 << bitsPerAxis);
+    Vec3f extent = centroidBounds.diagonal();
+    vector<MortonPrimitive> primitives(bounds.size());
+    for (auto i : range(bounds.size()))
+    {
+        Vec3f c = bounds[i].center();
+        uint64_t code = 0;
+        for (int a = 0; a < 3; ++a)
+        {
+            float x = extent[a] > 0.f ? (c[a] - centroidBounds.pMin[a]) / extent[a] : 0.f;
+            uint64_t q = uint64_t(clamp(x * scale, 0.f, scale - 1.f));
+            code |= expandBits(q) << (2 - a);
+        }
+        primitives[i] = {code, uint32_t(i)};
+    }
+
+    radixSort(primitives, m_mortonBits);
+
+    LBVHBuilder builder(primitives, bounds, m_settings, progress);
+    int root = builder.build(0, uint32_t(primitives.size()), 0);
+
+    vector<BBHLinearNode> nodes;
+    nodes.reserve(builder.nodes().size());
+    if (m_restructure)
+    {
+        // restructure larger and larger treelets, starting with those over
+        // at least treelet_size primitives, doubling each iteration
+        vector<BuildNode> original = builder.nodes();
+        uint32_t minCount = uint32_t(m_treeletSize);
+        for (int i = 0; i < m_restructureIterations; ++i, minCount *= 2)
+            builder.restructure(root, m_treeletSize, minCount);
+
+        if (builder.flatten(root, nodes) > BBHTree::MaxDepth)
+        {
+            warning("Restructured LBVH is too deep, using the original hierarchy.\n");
+            builder.nodes() = original;
+            nodes.clear();
+            builder.flatten(root, nodes);
+        }
+    }
+    else
+        builder.flatten(root, nodes);
+    m_tree.setNodes(std::move(nodes));
+
+    order.resize(primitives.size());
+    for (auto i : range(primitives.size()))
+        order[i] = primitives[i].index;
+
+    BBHBuildStats stats;
+    stats.milliseconds = timer.elapsed();
+    return stats;
+}
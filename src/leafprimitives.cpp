@@ -0,0 +1,59 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirt/leafprimitives.h>
+#include <typeinfo>
+
+void LeafPrimitives::build(const vector<shared_ptr<SurfaceBase>> & surfaces)
+{
+    clear();
+    if (surfaces.size() > IndexMask)
+        throw DirtException("Too many primitives (%d) for a single acceleration structure.", surfaces.size());
+
+    m_refs.resize(surfaces.size());
+    for (size_t slot = 0; slot < surfaces.size(); ++slot)
+    {
+        // only the exact types, since derived classes may intersect differently
+        const SurfaceBase & surface = *surfaces[slot];
+        SpherePrimitive sphere;
+        QuadPrimitive quad;
+        if (typeid(surface) == typeid(Sphere) && static_cast<const Sphere &>(surface).leafPrimitive(sphere))
+        {
+            m_refs[slot] = (SphereType << TypeShift) | uint32_t(m_spheres.size());
+            m_spheres.push_back(sphere);
+        }
+        else if (typeid(surface) == typeid(Quad) && static_cast<const Quad &>(surface).leafPrimitive(quad))
+        {
+            m_refs[slot] = (QuadType << TypeShift) | uint32_t(m_quads.size());
+            m_quads.push_back(quad);
+        }
+        else
+        {
+            m_refs[slot] = (SurfaceType << TypeShift) | uint32_t(m_surfaces.size());
+            m_surfaces.push_back(&surface);
+        }
+    }
+}
+
+void LeafPrimitives::clear()
+{
+    m_refs.clear();
+    m_spheres.clear();
+    m_quads.clear();
+    m_surfaces.clear();
+}
@@ -0,0 +1,95 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirt/mappedfile.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+
+MappedFile::MappedFile(const string & filename)
+{
+    m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+        throw DirtException("Cannot open file '%s'.", filename);
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(m_file);
+        throw DirtException("Cannot map empty file '%s'.", filename);
+    }
+    m_size = size_t(size.QuadPart);
+
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping)
+        m_data = (const uint8_t *) MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!m_data)
+    {
+        if (m_mapping)
+            CloseHandle(m_mapping);
+        CloseHandle(m_file);
+        throw DirtException("Cannot map file '%s' into memory.", filename);
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    UnmapViewOfFile(m_data);
+    CloseHandle(m_mapping);
+    CloseHandle(m_file);
+}
+
+#else
+
+MappedFile::MappedFile(const string & filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw DirtException("Cannot open file '%s'.", filename);
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        close(fd);
+        throw DirtException("Cannot map empty file '%s'.", filename);
+    }
+    m_size = size_t(info.st_size);
+
+    void * data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping stays valid after the file is closed
+    close(fd);
+    if (data == MAP_FAILED)
+        throw DirtException("Cannot map file '%s' into memory.", filename);
+    m_data = (const uint8_t *) data;
+}
+
+MappedFile::~MappedFile()
+{
+    munmap((void *) m_data, m_size);
+}
+
+#endif
@@ -25,6 +25,7 @@
 #include <dirt/sampler.h>
 #include <iostream>
 
+#undef M_E
 const int M_E = 2.71828182846;
 
 shared_ptr<const Material> Material::defaultMaterial()
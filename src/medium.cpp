@@ -158,7 +158,7 @@ Color3f TrL(const Scene &scene, Sampler &sampler, const Ray3f &ray_)
     /* Part 1: Advance Tr to next intersection */
   
     HitInfo hit;
-    bool hitSurface = scene.intersect(ray, hit);
+    bool hitSurface = scene.intersect(ray, hit, RayType::Shadow);
 
     if (hitSurface) ray.maxt = length(hit.p - ray.o) + 2.0 * Epsilon;
 
@@ -18,19 +18,33 @@
 
 #include <dirt/mesh.h>
 #include <dirt/scene.h>
+#include <dirt/traversal.h>
+#include <algorithm>
+#include <numeric>
 
-// Ray-Triangle intersection
-// p0, p1, p2 - Triangle vertices
-// n0, n1, n2 - optional per vertex normal data
-// t0, t1, t2 - optional per vertex texture coordinates
-bool singleTriangleIntersect(const Ray3f& ray,
-	                         const Vec3f& p0, const Vec3f& p1, const Vec3f& p2,
-	                         const Vec3f* n0, const Vec3f* n1, const Vec3f* n2,
-                             const Vec2f* t0, const Vec2f* t1, const Vec2f* t2,
-	                         HitInfo& hit,
-	                         const Material * material,
-                             const MediumInterface *medium_interface,
-	                         const SurfaceBase * surface)
+namespace
+{
+
+// if a box is (nearly) flat along an axis, expand it a bit along that axis
+void padFlatBounds(Box3f & box)
+{
+    auto diag = box.diagonal();
+    for (int i = 0; i < 3; ++i)
+    {
+        if (diag[i] < 1e-4f)
+        {
+            box.pMin[i] -= 5e-5f;
+            box.pMax[i] += 5e-5f;
+        }
+    }
+}
+
+// Möller-Trumbore ray-triangle test: computes the ray parameter t and the
+// barycentric coordinates (u,v) of the hit point if the ray hits the triangle
+// within its [mint, maxt] segment
+inline bool rayTriangle(const Ray3f& ray,
+                        const Vec3f& p0, const Vec3f& p1, const Vec3f& p2,
+                        float& t, float& u, float& v)
 {
    // Find vectors for two edges sharing v[0]
     Vec3f edge1 = p1 - p0,
@@ -50,7 +64,7 @@ bool singleTriangleIntersect(const Ray3f& ray,
     Vec3f tvec = ray.o - p0;
 
     // Calculate U parameter and test bounds
-    float u = dot(tvec,pvec) * inv_det;
+    u = dot(tvec,pvec) * inv_det;
     if (u < 0.0 || u > 1.0)
         return false;
 
@@ -58,16 +72,26 @@ bool singleTriangleIntersect(const Ray3f& ray,
     Vec3f qvec = cross(tvec, edge1);
 
     // Calculate V parameter and test bounds
-    float v = dot(ray.d,qvec) * inv_det;
+    v = dot(ray.d,qvec) * inv_det;
     if (v < 0.0 || u + v > 1.0)
         return false;
 
     // Ray intersects triangle -> compute t
-    float t = dot(edge2, qvec) * inv_det;
+    t = dot(edge2, qvec) * inv_det;
 
-    if (!(t >= ray.mint && t <= ray.maxt))
-        return false;
+    return t >= ray.mint && t <= ray.maxt;
+}
 
+// fill the hit record for a hit at distance t and barycentric coordinates (u,v)
+void triangleHit(float t, float u, float v,
+                 const Vec3f& p0, const Vec3f& p1, const Vec3f& p2,
+                 const Vec3f* n0, const Vec3f* n1, const Vec3f* n2,
+                 const Vec2f* t0, const Vec2f* t1, const Vec2f* t2,
+                 HitInfo& hit,
+                 const Material * material,
+                 const MediumInterface *medium_interface,
+                 const SurfaceBase * surface)
+{
     Vec3f gn = normalize(cross(p1 - p0, p2 - p0));
 
     Vec3f bary(1 - (u + v), u, v);
@@ -91,80 +115,816 @@ bool singleTriangleIntersect(const Ray3f& ray,
 
     // if hit, set intersection record values
     hit = HitInfo(t, p, gn, sn, uv, material, medium_interface, surface);
-    return true; 
 }
 
-Triangle::Triangle(const Scene & scene, const json & j, shared_ptr<const Mesh> mesh, uint32_t triNumber)
-    : m_mesh(mesh), m_faceIdx(triNumber)
+// Reshetov's ray/bilinear patch test ("Cool Patches", Ray Tracing Gems, 2019)
+// for the patch through p00, p10, p11, p01 (in order around it): computes the
+// ray parameter t and the patch coordinates (u,v) of the closest hit within
+// the ray's [mint, maxt] segment. The patch of a planar convex quad is the
+// quad itself
+inline bool rayPatch(const Ray3f& ray,
+                     const Vec3f& p00, const Vec3f& p10, const Vec3f& p11, const Vec3f& p01,
+                     float& t, float& u, float& v)
 {
-    
+    Vec3f e10 = p10 - p00, e11 = p11 - p10, e00 = p01 - p00;
+    Vec3f qn = cross(e10, p01 - p11);
+    Vec3f q00 = p00 - ray.o, q10 = p10 - ray.o;
+
+    // u solves a + b u + c u^2 = 0
+    float a = dot(cross(q00, ray.d), e00);
+    float c = dot(qn, ray.d);
+    float b = dot(cross(q10, ray.d), e11) - (a + c);
+    float det = b*b - 4*a*c;
+    if (det < 0)
+        return false;
+    det = std::sqrt(det);
+
+    float roots[2];
+    if (c == 0)
+    {
+        // the patch is a trapezoid, so the equation is linear
+        roots[0] = -a / b;
+        roots[1] = -1.f;
+    }
+    else
+    {
+        // numerically stable roots
+        roots[0] = (-b - std::copysign(det, b)) / 2;
+        roots[1] = a / roots[0];
+        roots[0] /= c;
+    }
+
+    bool hitSomething = false;
+    float closest = ray.maxt;
+    for (float ui : roots)
+    {
+        if (!(ui >= 0.f && ui <= 1.f))
+            continue;
+
+        // intersect the ray with the segment of the patch at ui, which
+        // starts at pa (relative to the ray origin) and spans pb
+        Vec3f pa = lerp(q00, q10, ui), pb = lerp(e00, e11, ui);
+        Vec3f n = cross(ray.d, pb);
+        float n2 = dot(n, n);
+        n = cross(n, pa);
+        float ti = dot(n, pb) / n2, vi = dot(n, ray.d) / n2;
+        if (vi >= 0.f && vi <= 1.f && ti >= ray.mint && ti <= closest)
+        {
+            hitSomething = true;
+            closest = t = ti;
+            u = ui;
+            v = vi;
+        }
+    }
+    return hitSomething;
 }
 
-bool Triangle::intersect(const Ray3f &ray, HitInfo &hit) const
+// fill the hit record for a hit at distance t and patch coordinates (u,v)
+void patchHit(float t, float u, float v, const Vec3f p[4], const Vec3f * n[4], const Vec2f * uvs[4],
+              HitInfo& hit,
+              const Material * material,
+              const MediumInterface *medium_interface,
+              const SurfaceBase * surface)
 {
-    INCREMENT_INTERSECTION_TESTS;
+    // the normal is the cross product of the partial derivatives of the patch
+    Vec3f dpdu = lerp(p[1] - p[0], p[2] - p[3], v),
+          dpdv = lerp(p[3] - p[0], p[2] - p[1], u);
+    Vec3f gn = normalize(cross(dpdu, dpdv));
+
+    float w[4] = {(1 - u) * (1 - v), u * (1 - v), u * v, (1 - u) * v};
+
+    Vec3f sn;
+    if (n[0])
+        sn = normalize(w[0] * (*n[0]) + w[1] * (*n[1]) + w[2] * (*n[2]) + w[3] * (*n[3]));
+    else
+        sn = gn;
+
+    Vec2f uv;
+    if (uvs[0])
+        uv = w[0] * (*uvs[0]) + w[1] * (*uvs[1]) + w[2] * (*uvs[2]) + w[3] * (*uvs[3]);
+    else
+        uv = {u, v};
+
+    Vec3f position = w[0] * p[0] + w[1] * p[1] + w[2] * p[2] + w[3] * p[3];
+
+    hit = HitInfo(t, position, gn, sn, uv, material, medium_interface, surface);
+}
+
+// Möller-Trumbore against all lanes of a block at once, with the same
+// arithmetic as rayTriangle. The loop has no branches so the compiler can
+// vectorize it across the lanes. Returns the mask of lanes in laneMask that
+// the ray hits within its [mint, maxt] segment
+inline uint32_t rayTriangleBlock(const Ray3f& ray, const TriangleBlock& block, uint32_t laneMask,
+                                 float t[], float u[], float v[])
+{
+    const int Width = TriangleBlock::Width;
+    bool valid[Width];
+    for (int i = 0; i < Width; ++i)
+    {
+        float e1x = block.e1[0][i], e1y = block.e1[1][i], e1z = block.e1[2][i];
+        float e2x = block.e2[0][i], e2y = block.e2[1][i], e2z = block.e2[2][i];
+
+        // pvec = cross(d, e2)
+        float px = ray.d.y * e2z - ray.d.z * e2y;
+        float py = ray.d.z * e2x - ray.d.x * e2z;
+        float pz = ray.d.x * e2y - ray.d.y * e2x;
+        float det = e1x * px + e1y * py + e1z * pz;
+        float invDet = 1.0f / det;
+
+        float tx = ray.o.x - block.v0[0][i], ty = ray.o.y - block.v0[1][i], tz = ray.o.z - block.v0[2][i];
+        u[i] = (tx * px + ty * py + tz * pz) * invDet;
+
+        // qvec = cross(tvec, e1)
+        float qx = ty * e1z - tz * e1y;
+        float qy = tz * e1x - tx * e1z;
+        float qz = tx * e1y - ty * e1x;
+        v[i] = (ray.d.x * qx + ray.d.y * qy + ray.d.z * qz) * invDet;
+        t[i] = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+
+        valid[i] = (det <= -1e-8f || det >= 1e-8f) &
+                   (u[i] >= 0.f) & (u[i] <= 1.f) & (v[i] >= 0.f) & (u[i] + v[i] <= 1.f) &
+                   (t[i] >= ray.mint) & (t[i] <= ray.maxt);
+    }
+
+    uint32_t mask = 0;
+    for (int i = 0; i < Width; ++i)
+        mask |= uint32_t(valid[i]) << i;
+    return mask & laneMask;
+}
+
+// mask of the lanes of block b that hold faces in [first, end)
+inline uint32_t blockLanes(uint32_t b, uint32_t first, uint32_t end)
+{
+    const uint32_t Width = TriangleBlock::Width;
+    uint32_t lo = std::max(first, b * Width) - b * Width,
+             hi = std::min(end, (b + 1) * Width) - b * Width;
+    return ((1u << hi) - 1u) & ~((1u << lo) - 1u);
+}
+
+} // namespace
+
+// Ray-Triangle intersection
+// p0, p1, p2 - Triangle vertices
+// n0, n1, n2 - optional per vertex normal data
+// t0, t1, t2 - optional per vertex texture coordinates
+bool singleTriangleIntersect(const Ray3f& ray,
+	                         const Vec3f& p0, const Vec3f& p1, const Vec3f& p2,
+	                         const Vec3f* n0, const Vec3f* n1, const Vec3f* n2,
+                             const Vec2f* t0, const Vec2f* t1, const Vec2f* t2,
+	                         HitInfo& hit,
+	                         const Material * material,
+                             const MediumInterface *medium_interface,
+	                         const SurfaceBase * surface)
+{
+    float t, u, v;
+    if (!rayTriangle(ray, p0, p1, p2, t, u, v))
+        return false;
+
+    triangleHit(t, u, v, p0, p1, p2, n0, n1, n2, t0, t1, t2,
+                hit, material, medium_interface, surface);
+    return true; 
+}
+
+void Mesh::faceHit(uint32_t f, float t, float u, float v, HitInfo &hit, const SurfaceBase * surface) const
+{
+    if (isQuad(f))
+    {
+        const int32_t i[4] = {F[f].x, F[f].y, F[f].z, Q[f]};
+        const Vec3f p[4] = {V[i[0]], V[i[1]], V[i[2]], V[i[3]]};
+        const Vec3f * n[4] = {nullptr, nullptr, nullptr, nullptr};
+        const Vec2f * uvs[4] = {nullptr, nullptr, nullptr, nullptr};
+        for (int k = 0; k < 4; ++k)
+        {
+            if (!N.empty())
+                n[k] = &N[i[k]];
+            if (!UV.empty())
+                uvs[k] = &UV[i[k]];
+        }
+        patchHit(t, u, v, p, n, uvs, hit, material.get(), medium_interface.get(), surface);
+        return;
+    }
 
-    auto i0 = m_mesh->F[m_faceIdx].x,
-         i1 = m_mesh->F[m_faceIdx].y,
-         i2 = m_mesh->F[m_faceIdx].z;
-    auto p0 = m_mesh->V[i0],
-         p1 = m_mesh->V[i1],
-         p2 = m_mesh->V[i2];
+    auto i0 = F[f].x,
+         i1 = F[f].y,
+         i2 = F[f].z;
     const Vec3f * n0 = nullptr, *n1 = nullptr, *n2 = nullptr;
-    if (!m_mesh->N.empty())
+    if (!N.empty())
     {
-        n0 = &m_mesh->N[i0];
-        n1 = &m_mesh->N[i1];
-        n2 = &m_mesh->N[i2];
+        n0 = &N[i0];
+        n1 = &N[i1];
+        n2 = &N[i2];
     }
     const Vec2f * t0 = nullptr, *t1 = nullptr, *t2 = nullptr;
-    if (!m_mesh->UV.empty())
+    if (!UV.empty())
     {
-        t0 = &m_mesh->UV[i0];
-        t1 = &m_mesh->UV[i1];
-        t2 = &m_mesh->UV[i2];
+        t0 = &UV[i0];
+        t1 = &UV[i1];
+        t2 = &UV[i2];
     }
 
-    return singleTriangleIntersect(ray,
-                                   p0, p1, p2,
-                                   n0, n1, n2,
-                                   t0, t1, t2,
-                                   hit,
-                                   m_mesh->material.get(), 
-                                   m_mesh->medium_interface.get(),
-                                   this);
+    triangleHit(t, u, v, V[i0], V[i1], V[i2], n0, n1, n2, t0, t1, t2,
+                hit, material.get(), medium_interface.get(), surface);
 }
 
-Box3f Triangle::localBBox() const
+bool Mesh::intersectFace(uint32_t f, const Ray3f &ray, HitInfo &hit, const SurfaceBase * surface) const
 {
-	// all mesh vertices have already been transformed to world space,
-	// so we need to transform back to get the local space bounds
-    Box3f result;
-    result.enclose(m_mesh->m_xform.inverse().point(vertex(0)));
-    result.enclose(m_mesh->m_xform.inverse().point(vertex(1)));
-    result.enclose(m_mesh->m_xform.inverse().point(vertex(2)));
-    
-    // if the triangle lies in an axis-aligned plane, expand the box a bit
-    auto diag = result.diagonal();
-    for (int i = 0; i < 3; ++i)
+    if (!intersectFaceCandidate(f, ray, hit, surface))
+        return false;
+
+    faceHit(f, hit.t, hit.coords.x, hit.coords.y, hit, surface);
+    return true;
+}
+
+bool Mesh::intersectFaceCandidate(uint32_t f, const Ray3f &ray, HitInfo &hit, const SurfaceBase * surface) const
+{
+    INCREMENT_INTERSECTION_TESTS;
+
+    float t, u, v;
+    if (isQuad(f) ? !rayPatch(ray, V[F[f].x], V[F[f].y], V[F[f].z], V[Q[f]], t, u, v)
+                  : !rayTriangle(ray, V[F[f].x], V[F[f].y], V[F[f].z], t, u, v))
+        return false;
+
+    hit.t = t;
+    hit.primitive = f;
+    hit.coords = Vec2f(u, v);
+    hit.surface = surface;
+    return true;
+}
+
+uint32_t Mesh::intersectFacePacket(uint32_t f, RayPacket &packet, uint32_t activeMask, HitInfo *hits,
+                                   const SurfaceBase * surface) const
+{
+    // quads are intersected one ray at a time
+    if (isQuad(f))
     {
-        if (diag[i] < 1e-4f)
+        uint32_t hitMask = 0;
+        for (int i = 0; i < packet.size; ++i)
         {
-            result.pMin[i] -= 5e-5f;
-            result.pMax[i] += 5e-5f;
+            if (!(activeMask & (1u << i)) || !intersectFaceCandidate(f, packet.ray(i), hits[i], surface))
+                continue;
+
+            packet.maxt[i] = hits[i].t;
+            hitMask |= 1u << i;
+        }
+        return hitMask;
+    }
+
+    intersection_tests += popCount(activeMask);
+
+    Vec3f p0 = V[F[f].x], p1 = V[F[f].y], p2 = V[F[f].z];
+    Vec3f edge1 = p1 - p0,
+          edge2 = p2 - p0;
+
+    // Möller-Trumbore for all rays of the packet at once; this loop has no
+    // branches so the compiler can vectorize it across the rays
+    float t[RayPacket::MaxSize], u[RayPacket::MaxSize], v[RayPacket::MaxSize];
+    bool valid[RayPacket::MaxSize];
+    for (int i = 0; i < packet.size; ++i)
+    {
+        Vec3f d(packet.d[0][i], packet.d[1][i], packet.d[2][i]);
+        Vec3f tvec = Vec3f(packet.o[0][i], packet.o[1][i], packet.o[2][i]) - p0;
+        Vec3f pvec = cross(d, edge2);
+        Vec3f qvec = cross(tvec, edge1);
+        float det = dot(edge1, pvec);
+        float invDet = 1.0f / det;
+        u[i] = dot(tvec, pvec) * invDet;
+        v[i] = dot(d, qvec) * invDet;
+        t[i] = dot(edge2, qvec) * invDet;
+        valid[i] = (det <= -1e-8f || det >= 1e-8f) &
+                   (u[i] >= 0.f) & (v[i] >= 0.f) & (u[i] + v[i] <= 1.f) &
+                   (t[i] >= packet.mint[i]) & (t[i] <= packet.maxt[i]);
+    }
+
+    uint32_t hitMask = 0;
+    for (int i = 0; i < packet.size; ++i)
+        hitMask |= uint32_t(valid[i]) << i;
+    hitMask &= activeMask;
+    if (!hitMask)
+        return 0;
+
+    for (int i = 0; i < packet.size; ++i)
+    {
+        if (!(hitMask & (1u << i)))
+            continue;
+
+        // the surface finalizes the closest of these hits after traversal
+        hits[i].t = t[i];
+        hits[i].primitive = f;
+        hits[i].coords = Vec2f(u[i], v[i]);
+        hits[i].surface = surface;
+        packet.maxt[i] = t[i];
+    }
+    return hitMask;
+}
+
+bool Mesh::occludedFace(uint32_t f, const Ray3f &ray) const
+{
+    INCREMENT_INTERSECTION_TESTS;
+
+    float t, u, v;
+    if (isQuad(f))
+        return rayPatch(ray, V[F[f].x], V[F[f].y], V[F[f].z], V[Q[f]], t, u, v);
+    return rayTriangle(ray, V[F[f].x], V[F[f].y], V[F[f].z], t, u, v);
+}
+
+bool Mesh::intersectFaces(uint32_t first, uint32_t count, Ray3f &ray, HitInfo &hit) const
+{
+    intersection_tests += count;
+
+    const uint32_t Width = TriangleBlock::Width;
+    float t[Width], u[Width], v[Width];
+    // lanes are counted from the first block of the leaf
+    uint32_t triangles = leafTriangles(first, count);
+    const TriangleBlock * blocks = m_blocks.data() + m_leafLanes[first] / Width;
+    uint32_t lo = m_leafLanes[first] % Width, end = lo + triangles, hitFace = 0;
+    float hitU = 0.f, hitV = 0.f;
+    bool hitSomething = false;
+    for (uint32_t b = 0; triangles && b * Width < end; ++b)
+    {
+        uint32_t mask = rayTriangleBlock(ray, blocks[b], blockLanes(b, lo, end), t, u, v);
+        for (; mask; mask &= mask - 1)
+        {
+            // keep the closest of the lanes that were hit
+            int i = lowestBit(mask);
+            if (t[i] <= ray.maxt)
+            {
+                hitSomething = true;
+                ray.maxt = t[i];
+                hitFace = first + b * Width + i - lo;
+                hitU = u[i];
+                hitV = v[i];
+            }
         }
     }
+
+    // the quads of the leaf follow its triangles
+    for (uint32_t f = first + triangles; f < first + count; ++f)
+    {
+        if (rayPatch(ray, V[F[f].x], V[F[f].y], V[F[f].z], V[Q[f]], t[0], u[0], v[0]))
+        {
+            hitSomething = true;
+            ray.maxt = t[0];
+            hitFace = f;
+            hitU = u[0];
+            hitV = v[0];
+        }
+    }
+
+    if (hitSomething)
+    {
+        hit.t = ray.maxt;
+        hit.primitive = hitFace;
+        hit.coords = Vec2f(hitU, hitV);
+        hit.surface = this;
+    }
+    return hitSomething;
+}
+
+bool Mesh::occludedFaces(uint32_t first, uint32_t count, const Ray3f &ray) const
+{
+    intersection_tests += count;
+
+    const uint32_t Width = TriangleBlock::Width;
+    float t[Width], u[Width], v[Width];
+    uint32_t triangles = leafTriangles(first, count);
+    const TriangleBlock * blocks = m_blocks.data() + m_leafLanes[first] / Width;
+    uint32_t lo = m_leafLanes[first] % Width, end = lo + triangles;
+    for (uint32_t b = 0; triangles && b * Width < end; ++b)
+        if (rayTriangleBlock(ray, blocks[b], blockLanes(b, lo, end), t, u, v))
+            return true;
+    for (uint32_t f = first + triangles; f < first + count; ++f)
+        if (rayPatch(ray, V[F[f].x], V[F[f].y], V[F[f].z], V[Q[f]], t[0], u[0], v[0]))
+            return true;
+    return false;
+}
+
+Box3f Mesh::faceBounds(uint32_t f) const
+{
+    Box3f result;
+    result.enclose(V[F[f].x]);
+    result.enclose(V[F[f].y]);
+    result.enclose(V[F[f].z]);
+    if (isQuad(f))
+        result.enclose(V[Q[f]]);
+    padFlatBounds(result);
     return result;
 }
 
-Box3f Triangle::worldBBox() const
+float Mesh::faceArea(uint32_t f) const
 {
-    // all mesh vertices have already been transformed to world space,
-    // so just bound the triangle vertices
+    Vec3f p0 = V[F[f].x], p1 = V[F[f].y], p2 = V[F[f].z];
+    float area = 0.5f * length(cross(p1 - p0, p2 - p0));
+    if (isQuad(f))
+        area += 0.5f * length(cross(p2 - p0, V[Q[f]] - p0));
+    return area;
+}
+
+void Mesh::splitFace(uint32_t f, int axis, float position, Box3f & left, Box3f & right) const
+{
+    // walk along the edges, adding each vertex to its side of the plane and
+    // the points where edges cross the plane to both sides (and for quads,
+    // where the diagonals do, since a non-planar patch may bulge beyond its
+    // edges, but stays within the hull of its vertices)
+    const Vec3f v[4] = {V[F[f].x], V[F[f].y], V[F[f].z], isQuad(f) ? V[Q[f]] : Vec3f(0.f)};
+    int n = isQuad(f) ? 4 : 3;
+    auto addCrossing = [&](const Vec3f & a, const Vec3f & b)
+    {
+        if ((a[axis] < position && b[axis] > position) || (a[axis] > position && b[axis] < position))
+        {
+            Vec3f p = lerp(a, b, (position - a[axis]) / (b[axis] - a[axis]));
+            p[axis] = position;
+            left.enclose(p);
+            right.enclose(p);
+        }
+    };
+    for (int i = 0; i < n; ++i)
+    {
+        const Vec3f & a = v[i];
+        if (a[axis] <= position)
+            left.enclose(a);
+        if (a[axis] >= position)
+            right.enclose(a);
+        addCrossing(a, v[(i + 1) % n]);
+    }
+    if (n == 4)
+    {
+        addCrossing(v[0], v[2]);
+        addCrossing(v[1], v[3]);
+    }
+
+    if (!left.isEmpty())
+        padFlatBounds(left);
+    if (!right.isEmpty())
+        padFlatBounds(right);
+}
+
+void Mesh::build()
+{
+    // a rebuild after spatial splits starts from the distinct faces again
+    if (!m_faceSlots.empty())
+    {
+        vector<Vec3i> distinct(m_faceSlots.size());
+        vector<int32_t> distinctQ(Q.empty() ? 0 : m_faceSlots.size());
+        for (auto f : range(m_faceSlots.size()))
+        {
+            distinct[f] = F[m_faceSlots[f]];
+            if (!Q.empty())
+                distinctQ[f] = Q[m_faceSlots[f]];
+        }
+        F.swap(distinct);
+        Q.swap(distinctQ);
+    }
+
+    vector<Box3f> bounds(F.size());
+    m_bounds = Box3f();
+    for (auto f : range(F.size()))
+    {
+        bounds[f] = faceBounds(uint32_t(f));
+        m_bounds.enclose(bounds[f]);
+    }
+
+    m_faceSlots.clear();
+    m_leafTriangles.clear();
+    if (!accelerator && Q.empty())
+    {
+        fillBlocks();
+        updateAreas();
+        return;
+    }
+
+    // store the faces in the order the leaves reference them, so that
+    // leaf slot i is simply face i
+    vector<uint32_t> order;
+    vector<std::pair<uint32_t, uint32_t>> leaves;
+    if (accelerator)
+    {
+        accelerator->buildPrimitives(bounds, order,
+            [this](uint32_t f, int axis, float position, Box3f & left, Box3f & right)
+            {
+                splitFace(f, axis, position, left, right);
+            });
+        leaves = accelerator->leafRanges();
+    }
+    else
+    {
+        order.resize(F.size());
+        std::iota(order.begin(), order.end(), 0u);
+        leaves.emplace_back(0u, uint32_t(F.size()));
+    }
+
+    // the triangles of each leaf come first, so that they occupy
+    // consecutive lanes of the blocks, and its quads after them
+    if (!Q.empty())
+    {
+        m_leafTriangles.assign(order.size(), 0);
+        for (auto & leaf : leaves)
+        {
+            auto begin = order.begin() + leaf.first, end = begin + leaf.second;
+            auto quads = std::stable_partition(begin, end, [this](uint32_t f) {return Q[f] < 0;});
+            m_leafTriangles[leaf.first] = uint32_t(quads - begin);
+        }
+    }
+
+    vector<Vec3i> ordered(order.size());
+    vector<int32_t> orderedQ(Q.empty() ? 0 : order.size());
+    for (auto i : range(order.size()))
+    {
+        ordered[i] = F[order[i]];
+        if (!Q.empty())
+            orderedQ[i] = Q[order[i]];
+    }
+
+    // spatial splits store some faces in several slots, so remember one
+    // slot per face to sample from
+    if (order.size() > F.size())
+    {
+        m_faceSlots.assign(F.size(), uint32_t(order.size()));
+        for (auto i : range(uint32_t(order.size())))
+            m_faceSlots[order[i]] = std::min(m_faceSlots[order[i]], i);
+    }
+    F.swap(ordered);
+    Q.swap(orderedQ);
+
+    fillBlocks();
+    updateAreas();
+}
+
+void Mesh::setVertices(const vector<Vec3f> & positions, const vector<Vec3f> & normals)
+{
+    if (positions.size() != V.size() || (!normals.empty() && normals.size() != N.size()))
+        throw DirtException("Mesh::setVertices: expected %d vertices, got %d positions and %d normals.",
+                            V.size(), positions.size(), normals.size());
+
+    V = positions;
+    if (!normals.empty())
+        N = normals;
+
+    // refit the hierarchy over the faces in their current (leaf) order
+    vector<Box3f> bounds(F.size());
+    m_bounds = Box3f();
+    for (auto f : range(F.size()))
+    {
+        bounds[f] = faceBounds(uint32_t(f));
+        m_bounds.enclose(bounds[f]);
+    }
+
+    if (accelerator && !accelerator->refitPrimitives(bounds))
+        build();
+    else
+    {
+        fillBlocks();
+        updateAreas();
+    }
+}
+
+void Mesh::fillBlocks()
+{
+    const uint32_t Width = TriangleBlock::Width;
+    m_blocks.clear();
+    m_leafLanes.assign(F.size(), 0);
+
+    // pack the faces of the leaves into consecutive lanes, but start a new
+    // block for any leaf that would otherwise straddle two blocks without
+    // needing to, so each leaf is tested with as few blocks as possible
+    uint32_t lanes = 0;
+    auto addLeaf = [this, Width, &lanes](uint32_t first, uint32_t count)
+    {
+        if (lanes % Width != 0 && lanes % Width + count > Width)
+            lanes += Width - lanes % Width;
+
+        m_leafLanes[first] = lanes;
+        for (auto f : range(first, first + count))
+        {
+            if (lanes / Width == m_blocks.size())
+                m_blocks.emplace_back();
+
+            TriangleBlock & block = m_blocks[lanes / Width];
+            Vec3f p0 = V[F[f].x], e1 = V[F[f].y] - p0, e2 = V[F[f].z] - p0;
+            for (int a = 0; a < 3; ++a)
+            {
+                block.v0[a][lanes % Width] = p0[a];
+                block.e1[a][lanes % Width] = e1[a];
+                block.e2[a][lanes % Width] = e2[a];
+            }
+            ++lanes;
+        }
+    };
+
+    if (accelerator)
+    {
+        for (auto & leaf : accelerator->leafRanges())
+            addLeaf(leaf.first, leafTriangles(leaf.first, leaf.second));
+    }
+    else if (!F.empty())
+        addLeaf(0, leafTriangles(0, uint32_t(F.size())));
+}
+
+bool Mesh::intersect(const Ray3f &ray, HitInfo &hit) const
+{
+    return intersectAndFinalize(ray, hit);
+}
+
+void Mesh::finalizeHit(const Ray3f &ray, HitInfo &hit) const
+{
+    faceHit(hit.primitive, hit.t, hit.coords.x, hit.coords.y, hit, this);
+}
+
+bool Mesh::intersectCandidate(const Ray3f &ray, HitInfo &hit) const
+{
+    auto intersectLeaf = [this](uint32_t first, uint32_t count, Ray3f & ray, HitInfo & hit)
+    {
+        return intersectFaces(first, count, ray, hit);
+    };
+
+    if (accelerator)
+        return accelerator->intersectLeaves(ray, hit, intersectLeaf);
+
+    Ray3f shortened = ray;
+    return intersectLeaf(0, uint32_t(F.size()), shortened, hit);
+}
+
+bool Mesh::occluded(const Ray3f &ray) const
+{
+    auto occludedLeaf = [this](uint32_t first, uint32_t count, const Ray3f & ray)
+    {
+        return occludedFaces(first, count, ray);
+    };
+
+    if (accelerator)
+        return accelerator->occludedLeaves(ray, occludedLeaf);
+
+    return occludedLeaf(0, uint32_t(F.size()), ray);
+}
+
+uint32_t Mesh::intersectPacketCandidates(RayPacket &packet, uint32_t activeMask, HitInfo *hits) const
+{
+    if (!accelerator)
+        return SurfaceBase::intersectPacketCandidates(packet, activeMask, hits);
+
+    return accelerator->intersectPacketPrimitives(packet, activeMask, hits,
+        [this](uint32_t f, RayPacket & packet, uint32_t mask, HitInfo * hits)
+        {
+            return intersectFacePacket(f, packet, mask, hits, this);
+        },
+        [this](uint32_t f, const Ray3f & ray, HitInfo & hit)
+        {
+            return intersectFaceCandidate(f, ray, hit, this);
+        });
+}
+
+void Mesh::addAccelerationStats(json & stats) const
+{
+    if (!accelerator)
+        return;
+
+    json tree = accelerator->treeStats();
+    tree["surface"] = "mesh";
+    tree["primitives"] = numFaces();
+    stats.push_back(tree);
+}
+
+void Mesh::updateAreas()
+{
+    // accumulate in double precision, so that small faces of large meshes
+    // still get intervals of the right width
+    m_areaCdf.resize(numFaces());
+    double sum = 0.0;
+    for (auto i : range(numFaces()))
+    {
+        sum += faceArea(m_faceSlots.empty() ? i : m_faceSlots[i]);
+        m_areaCdf[i] = float(sum);
+    }
+    m_area = float(sum);
+    for (auto & c : m_areaCdf)
+        c = sum > 0.0 ? float(c / sum) : 0.f;
+}
+
+Vec3f Mesh::samplePoint(uint32_t f, const Vec2f &sample) const
+{
+    Vec3f p0 = V[F[f].x], p1 = V[F[f].y], p2 = V[F[f].z];
+    Vec2f s = sample;
+
+    // a quad is sampled as one of the triangles (p0, p1, p2) and
+    // (p0, p2, p3), chosen proportionally to their areas by remapping s.x
+    if (isQuad(f))
+    {
+        Vec3f p3 = V[Q[f]];
+        float a012 = length(cross(p1 - p0, p2 - p0)), a023 = length(cross(p2 - p0, p3 - p0));
+        float split = a012 + a023 > 0.f ? a012 / (a012 + a023) : 1.f;
+        if (s.x < split)
+            s.x /= split;
+        else
+        {
+            s.x = (s.x - split) / (1.f - split);
+            p1 = p2;
+            p2 = p3;
+        }
+    }
+
+    // uniformly sample a point on the triangle
+    float u = std::sqrt(s.x);
+    float b0 = 1.0f - u;
+    float b1 = s.y * u;
+    return b0 * p0 + b1 * p1 + (1.0f - b0 - b1) * p2;
+}
+
+Vec3f Mesh::sample(const Vec3f &o, const Vec2f &sample) const
+{
+    // pick a face proportionally to its area, and remap sample.x to the
+    // face's interval of the CDF so that it can be reused on the face
+    uint32_t i = uint32_t(std::upper_bound(m_areaCdf.begin(), m_areaCdf.end(), sample.x) - m_areaCdf.begin());
+    i = std::min(i, numFaces() - 1);
+    float cdfMin = i > 0 ? m_areaCdf[i - 1] : 0.f, cdfMax = m_areaCdf[i];
+    Vec2f s(cdfMax > cdfMin ? std::min((sample.x - cdfMin) / (cdfMax - cdfMin), 1.f) : 0.f, sample.y);
+
+    uint32_t f = m_faceSlots.empty() ? i : m_faceSlots[i];
+    return normalize(samplePoint(f, s) - o);
+}
+
+float Mesh::pdf(const Vec3f &o, const Vec3f &dir) const
+{
+    // every face the ray passes through could have generated the direction,
+    // so find all hits by never accepting one (which keeps the ray unshortened)
+    if (m_area <= 0.f)
+        return 0.f;
+    float sum = 0.f;
+    vector<Vec3i> counted;
+    auto addFacePdf = [&](uint32_t f, const Ray3f & ray, HitInfo & hit)
+    {
+        if (!intersectFace(f, ray, hit, this))
+            return false;
+
+        // with spatial splits, the ray may reach the same face through
+        // several leaves, but it only generated the direction once
+        if (!m_faceSlots.empty())
+        {
+            // the first three vertices identify the face, even for quads
+            for (auto & face : counted)
+                if (face.x == F[f].x && face.y == F[f].y && face.z == F[f].z)
+                    return false;
+            counted.push_back(F[f]);
+        }
+
+        // faces are chosen proportionally to their areas, so the density
+        // per unit area is the same on all of them
+        float areaPdf = 1.0f / m_area;
+        float geometryTerm = length2(hit.p - o) / abs(dot(dir, hit.gn));
+        sum += areaPdf * geometryTerm;
+        return false;
+    };
+
+    Ray3f ray(o, dir);
+    HitInfo hit;
+    if (accelerator)
+        accelerator->intersectPrimitives(ray, hit, addFacePdf);
+    else
+        for (auto f : range(uint32_t(F.size())))
+            addFacePdf(f, ray, hit);
+    return sum;
+}
+
+Triangle::Triangle(const Scene & scene, const json & j, shared_ptr<const Mesh> mesh, uint32_t triNumber)
+    : m_mesh(mesh), m_faceIdx(triNumber)
+{
+    
+}
+
+bool Triangle::intersect(const Ray3f &ray, HitInfo &hit) const
+{
+    return intersectAndFinalize(ray, hit);
+}
+
+bool Triangle::intersectCandidate(const Ray3f &ray, HitInfo &hit) const
+{
+    return m_mesh->intersectFaceCandidate(m_faceIdx, ray, hit, this);
+}
+
+void Triangle::finalizeHit(const Ray3f &ray, HitInfo &hit) const
+{
+    m_mesh->faceHit(m_faceIdx, hit.t, hit.coords.x, hit.coords.y, hit, this);
+}
+
+uint32_t Triangle::intersectPacketCandidates(RayPacket &packet, uint32_t activeMask, HitInfo *hits) const
+{
+    return m_mesh->intersectFacePacket(m_faceIdx, packet, activeMask, hits, this);
+}
+
+bool Triangle::occluded(const Ray3f &ray) const
+{
+    return m_mesh->occludedFace(m_faceIdx, ray);
+}
+
+Box3f Triangle::localBBox() const
+{
+	// all mesh vertices have already been transformed to world space,
+	// so we need to transform back to get the local space bounds
+    Transform toLocal = m_mesh->m_xform.inverse();
     Box3f result;
-    result.enclose(vertex(0));
-    result.enclose(vertex(1));
-    result.enclose(vertex(2));
+    result.enclose(toLocal.point(vertex(0)));
+    result.enclose(toLocal.point(vertex(1)));
+    result.enclose(toLocal.point(vertex(2)));
+    if (m_mesh->isQuad(m_faceIdx))
+        result.enclose(toLocal.point(m_mesh->V[m_mesh->Q[m_faceIdx]]));
 
     // if the triangle lies in an axis-aligned plane, expand the box a bit
     auto diag = result.diagonal();
@@ -179,37 +939,32 @@ Box3f Triangle::worldBBox() const
     return result;
 }
 
-Vec3f Triangle::sample(const Vec3f &o, const Vec2f &sample) const
+Box3f Triangle::worldBBox() const
 {
-    // get triangle vertices
-    Vec3f p0 = m_mesh->m_xform.point(vertex(0));
-    Vec3f p1 = m_mesh->m_xform.point(vertex(1));
-    Vec3f p2 = m_mesh->m_xform.point(vertex(2));
-
-    // compute baycentric coordinates
-    float u = std::sqrt(sample.x);
-    float b0 = 1.0f - u;
-    float b1 = sample.y * u;
+    // all mesh vertices have already been transformed to world space,
+    // so just bound the triangle vertices
+    return m_mesh->faceBounds(m_faceIdx);
+}
 
-    // calculate point based on barycentric coordinates
-    Vec3f p = b0 * p0 + b1 * p1 + (1.0f - b0 - b1) * p2;
-    return normalize(p - o);
+Vec3f Triangle::sample(const Vec3f &o, const Vec2f &sample) const
+{
+    // the mesh vertices are already in world space, and quads are sampled
+    // over both of their triangles
+    return normalize(m_mesh->samplePoint(m_faceIdx, sample) - o);
 }
 
 float Triangle::pdf(const Vec3f &o, const Vec3f &dir) const
 {
-    // check that ray intersects triangle
+    // check that ray intersects the face
     Ray3f r(o, dir);
     HitInfo hit;
     if (!intersect(r, hit)) return 0.0f;
 
-    // get triangle vertices
-    Vec3f p0 = m_mesh->m_xform.point(vertex(0));
-    Vec3f p1 = m_mesh->m_xform.point(vertex(1));
-    Vec3f p2 = m_mesh->m_xform.point(vertex(2));   
-
     // compute the pdf
-    float areaPdf = 2.0f / length(cross((p1 - p0), (p2 - p0)));
+    float area = m_mesh->faceArea(m_faceIdx);
+    if (area <= 0.f)
+        return 0.f;
+    float areaPdf = 1.0f / area;
     float geometryTerm = length2(hit.p - o) / abs(dot(dir, hit.gn));
     return areaPdf * geometryTerm;
 }
@@ -107,6 +107,31 @@ struct OBJVertexHash : std::unary_function<OBJVertex, size_t>
     }
 };
 
+/**
+    Whether the quad a, b, c, d (in order around it) is planar and strictly
+    convex, so that the bilinear patch through its vertices is the quad itself.
+ */
+bool isPlanarConvexQuad(const Vec3f & a, const Vec3f & b, const Vec3f & c, const Vec3f & d)
+{
+    // the diagonals of a planar quad intersect, so they span its plane
+    Vec3f n = cross(c - a, d - b);
+    float n2 = length2(n);
+    if (!(n2 > 0.f))
+        return false;
+    n /= std::sqrt(n2);
+
+    // the distance between the diagonals, relative to their length
+    if (std::abs(dot(b - a, n)) > 1e-4f * std::max(length(c - a), length(d - b)))
+        return false;
+
+    // every corner turns the same way (this also rejects repeated vertices)
+    const Vec3f p[4] = {a, b, c, d};
+    for (int i = 0; i < 4; ++i)
+        if (!(dot(cross(p[(i + 1) % 4] - p[i], p[(i + 2) % 4] - p[(i + 1) % 4]), n) > 0.f))
+            return false;
+    return true;
+}
+
 } // namespace
 
 
@@ -125,6 +150,7 @@ Mesh loadWavefrontOBJ(const std::string & filename, const Transform & xform)
     std::vector<Vec2f>    texcoords;
     std::vector<Vec3f>    normals;
     std::vector<uint32_t>   indices;
+    std::vector<uint32_t>   quadIndices;
     std::vector<OBJVertex>  vertices;
     VertexMap vertexMap;
 
@@ -180,7 +206,7 @@ Mesh loadWavefrontOBJ(const std::string & filename, const Transform & xform)
             {
                 std::string v1, v2, v3, v4;
                 line >> v1 >> v2 >> v3 >> v4;
-                OBJVertex verts[6];
+                OBJVertex verts[4];
                 int nVertices = 3;
 
                 verts[0] = OBJVertex(v1);
@@ -189,12 +215,12 @@ Mesh loadWavefrontOBJ(const std::string & filename, const Transform & xform)
 
                 if (!v4.empty())
                 {
-                    // This is a quad, split into two triangles
+                    // This is a quad, which is only split into two triangles
+                    // once its vertices are known (see below)
                     verts[3] = OBJVertex(v4);
-                    verts[4] = verts[0];
-                    verts[5] = verts[2];
-                    nVertices = 6;
+                    nVertices = 4;
                 }
+                auto & faceIndices = nVertices == 4 ? quadIndices : indices;
 
                 // Convert to an indexed vertex list
                 for (auto i : range(nVertices))
@@ -204,22 +230,18 @@ Mesh loadWavefrontOBJ(const std::string & filename, const Transform & xform)
                     if (it == vertexMap.end())
                     {
                         vertexMap[v] = (uint32_t) vertices.size();
-                        indices.push_back((uint32_t) vertices.size());
+                        faceIndices.push_back((uint32_t) vertices.size());
                         vertices.push_back(v);
                     }
                     else
                     {
-                        indices.push_back(it->second);
+                        faceIndices.push_back(it->second);
                     }
                 }
             }
             ++progress;
         }
 
-        mesh.F.resize(indices.size()/3);
-        for (auto i : range(int(mesh.F.size())))
-            mesh.F[i] = Vec3i(indices[3*i], indices[3*i+1], indices[3*i+2]);
-
         mesh.V.resize(vertices.size());
         for (auto i : range(int(vertices.size())))
         {
@@ -227,6 +249,33 @@ Mesh loadWavefrontOBJ(const std::string & filename, const Transform & xform)
             bbox.enclose(mesh.V[i]);
         }
 
+        // planar convex quads are kept whole, the others are split into two
+        // triangles (the bilinear patch through the vertices of a non-planar
+        // quad would be curved)
+        vector<uint32_t> quads;
+        for (size_t q = 0; q < quadIndices.size(); q += 4)
+        {
+            const uint32_t * v = &quadIndices[q];
+            if (isPlanarConvexQuad(mesh.V[v[0]], mesh.V[v[1]], mesh.V[v[2]], mesh.V[v[3]]))
+                quads.insert(quads.end(), v, v + 4);
+            else
+                indices.insert(indices.end(), {v[0], v[1], v[2], v[3], v[0], v[2]});
+        }
+
+        size_t numTriangles = indices.size()/3;
+        mesh.F.resize(numTriangles + quads.size()/4);
+        for (auto i : range(int(numTriangles)))
+            mesh.F[i] = Vec3i(indices[3*i], indices[3*i+1], indices[3*i+2]);
+        if (!quads.empty())
+        {
+            mesh.Q.assign(mesh.F.size(), -1);
+            for (auto i : range(int(quads.size()/4)))
+            {
+                mesh.F[numTriangles + i] = Vec3i(quads[4*i], quads[4*i+1], quads[4*i+2]);
+                mesh.Q[numTriangles + i] = quads[4*i+3];
+            }
+        }
+
         if (!normals.empty())
         {
             mesh.N.resize(vertices.size());
@@ -248,9 +297,10 @@ Mesh loadWavefrontOBJ(const std::string & filename, const Transform & xform)
 
     debug("bounding box: bottom:\n%s;\n", (bbox.pMin+bbox.pMax)/2.f - Vec3f(0, bbox.diagonal()[1]/2.f, 0));
 
-    debug("done. (V=%d, F=%d, took %s and %s)\n",
-            mesh.V.size(), mesh.F.size(), timer.elapsedString(),
-            memString(mesh.F.size() * sizeof(uint32_t) + sizeof(float) *
+    debug("done. (V=%d, F=%d, of which %d quads, took %s and %s)\n",
+            mesh.V.size(), mesh.F.size(), std::count_if(mesh.Q.begin(), mesh.Q.end(), [](int32_t q) {return q >= 0;}),
+            timer.elapsedString(),
+            memString(mesh.F.size() * sizeof(uint32_t) + mesh.Q.size() * sizeof(int32_t) + sizeof(float) *
                       (mesh.V.size() + mesh.N.size() + mesh.UV.size())));
 
     return mesh;
@@ -18,7 +18,12 @@
 
 #include <dirt/parser.h>
 #include <dirt/obj.h>
+#include <dirt/autoaccelerator.h>
 #include <dirt/bbh.h>
+#include <dirt/grid.h>
+#include <dirt/kdtree.h>
+#include <dirt/lbvh.h>
+#include <dirt/instance.h>
 #include <dirt/sphere.h>
 #include <dirt/quad.h>
 #include <dirt/scene.h>
@@ -76,8 +81,16 @@ shared_ptr<SurfaceGroup> parseAccelerator(const Scene & scene, const json & j)
 
     if (type == "bbh" || type == "bvh")
         return make_shared<BBH>(scene, j);
+    else if (type == "lbvh")
+        return make_shared<LBVH>(scene, j);
+    else if (type == "grid")
+        return make_shared<GridAccelerator>(scene, j);
+    else if (type == "kdtree")
+        return make_shared<KdTreeAccelerator>(scene, j);
     else if (type == "group")
         return make_shared<SurfaceGroup>(scene, j);
+    else if (type == "auto")
+        return make_shared<AutoAccelerator>(scene, j);
     else
         throw DirtException("Unknown 'accelerator' type '%s' here:\n%s.", type, j.dump(4));
 }
@@ -216,6 +229,32 @@ shared_ptr<Sampler> parseSampler(const json &j)
     return Sampler::defaultSampler();
 }
 
+// load the OBJ file of a mesh specification and build the hierarchy over its faces
+static shared_ptr<Mesh> parseMesh(const Scene & scene, const json & j)
+{
+    auto xform = Transform();
+    xform = j.value("transform", xform);
+    std::string filename = getKey("filename", "mesh", j);
+
+    auto mesh = make_shared<Mesh>(loadWavefrontOBJ(getFileResolver().resolve(filename).str(), xform));
+
+    mesh->material = scene.findOrCreateMaterial(j);
+    mesh->medium_interface = scene.findOrCreateMediumInterface(j);
+
+    // a "group" accelerator leaves the mesh without a hierarchy, so its faces
+    // are intersected one by one
+    json spec = j.value("accelerator", scene.meshAccelerator());
+    if (spec.value("type", "") == "auto")
+    {
+        spec = AutoAccelerator::heuristic(mesh->numFaces());
+        message("Auto accelerator chose %s for mesh \"%s\" with %d faces\n", spec.dump(), filename, mesh->numFaces());
+    }
+    auto accelerator = parseAccelerator(scene, spec);
+    mesh->accelerator = std::dynamic_pointer_cast<Accelerator>(accelerator);
+    mesh->build();
+    return mesh;
+}
+
 void parseSurface(const Scene & scene, SurfaceBase * parent, const json & j)
 {
     string type = getKey("type", "surface", j);
@@ -226,20 +265,12 @@ void parseSurface(const Scene & scene, SurfaceBase * parent, const json & j)
         parent->addChild(make_shared<Sphere>(scene, j));
     else if (type == "mesh")
     {
-        auto xform = Transform();
-        xform = j.value("transform", xform);
-        std::string filename = j["filename"];
-
-        auto mesh = make_shared<Mesh>(loadWavefrontOBJ(getFileResolver().resolve(filename).str(), xform));
-
-        if (mesh->empty())
-            return;
-
-        mesh->material = scene.findOrCreateMaterial(j);
-        mesh->medium_interface = scene.findOrCreateMediumInterface(j);
-        for (auto index : range(mesh->F.size()))
-            parent->addChild(make_shared<Triangle>(scene, j, mesh, int(index)));
+        auto mesh = parseMesh(scene, j);
+        if (!mesh->empty())
+            parent->addChild(mesh);
     }
+    else if (type == "instance")
+        parent->addChild(make_shared<Instance>(scene, j));
     else
         throw DirtException("Unknown surface type '%s' here:\n%s",
                             type.c_str(), j.dump(5));
@@ -254,8 +285,14 @@ void Scene::parseFromJSON(const json & j)
     if (j.contains("accelerator"))
         m_surfaces = parseAccelerator(*this, j["accelerator"]);
     else
-        // default to a naive accelerator
-        m_surfaces = make_shared<SurfaceGroup>(*this, j["accelerator"]);
+        // let the accelerator pick a structure once all surfaces are known
+        m_surfaces = make_shared<AutoAccelerator>(*this);
+
+    // meshes use the scene's hierarchy settings, unless they specify their own
+    // (an "auto" scene accelerator leaves them with the default hierarchy)
+    if (j.contains("accelerator") && j["accelerator"].value("type", "") != "group" &&
+        j["accelerator"].value("type", "") != "auto")
+        m_meshAccelerator = j["accelerator"];
 
     if (j.contains("sampler"))
         m_sampler = parseSampler(j["sampler"]);
@@ -283,6 +320,10 @@ void Scene::parseFromJSON(const json & j)
         {
             m_imageSamples = it.value();
         }
+        else if (it.key() == "packets")
+        {
+            m_packets = it.value();
+        }
         else if (it.key() == "integrator")
         {
             if (m_integrator)
@@ -311,6 +352,13 @@ void Scene::parseFromJSON(const json & j)
                 m_media[getKey("name", "media", m)] = medium;
             }
         }
+        else if (it.key() == "meshes")
+        {
+            // each named mesh is loaded once (together with its hierarchy),
+            // and shared by all instances of the mesh
+            for (auto & m : it.value())
+                m_meshes[getKey("name", "mesh", m)] = parseMesh(*this, m);
+        }
         else if (it.key() == "surfaces")
         {
             for (auto & s : it.value())
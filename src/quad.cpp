@@ -38,33 +38,54 @@ Quad::Quad(const Scene & scene, const json & j)
 }
 
 bool Quad::intersect(const Ray3f &ray, HitInfo &hit) const
+{
+    return intersectAndFinalize(ray, hit);
+}
+
+bool Quad::intersectCandidate(const Ray3f &ray, HitInfo &hit) const
 {
     INCREMENT_INTERSECTION_TESTS;
 
     // compute ray intersection (and ray parameter), continue if not hit
-    auto tray = m_xform.inverse().ray(ray);
-    if (tray.d.z == 0)
-        return false;
-    auto t = -tray.o.z / tray.d.z;
-    auto p = tray(t);
-
-    if (m_size.x < p.x || -m_size.x > p.x || m_size.y < p.y || -m_size.y > p.y)
+    float t;
+    Vec3f p;
+    if (!rayQuad(m_xform.inverse().ray(ray), m_size, t, p))
         return false;
 
-    // check if computed param is within ray.mint and ray.maxt
-    if (t < tray.mint || t > tray.maxt)
-        return false;
+    // remember the local hit point, from which finalizeHit computes the rest
+    hit.t = t;
+    hit.coords = Vec2f(p.x, p.y);
+    hit.surface = this;
+    return true;
+}
 
+void Quad::finalizeHit(const Ray3f &ray, HitInfo &hit) const
+{
 	// project hitpoint onto plane to reduce floating-point error
-	p.z = 0;
+    Vec3f p(hit.coords.x, hit.coords.y, 0.f);
 
     Vec3f gn = normalize(m_xform.normal({0,0,1}));
 
     Vec2f uv = Vec2f(p.x / (2 * m_size.x) + 0.5f, p.y / (2 * m_size.y) + 0.5f);
 
     // if hit, set intersection record values
-    hit = HitInfo(t, m_xform.point(p), gn, gn, uv, m_material.get(), m_medium_interface.get(), this);
-    return true;
+    hit = HitInfo(hit.t, m_xform.point(p), gn, gn, uv, m_material.get(), m_medium_interface.get(), this);
+}
+
+bool Quad::occluded(const Ray3f &ray) const
+{
+    INCREMENT_INTERSECTION_TESTS;
+
+    float t;
+    Vec3f p;
+    return rayQuad(m_xform.inverse().ray(ray), m_size, t, p);
+}
+
+bool Quad::leafPrimitive(QuadPrimitive & primitive) const
+{
+    primitive.size = m_size;
+    primitive.surface = this;
+    return primitive.worldToLocal.set(m_xform.mInv);
 }
 
 
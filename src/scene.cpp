@@ -110,6 +110,20 @@ shared_ptr<const MediumInterface> Scene::findOrCreateMediumInterface(const json
     return std::make_shared<MediumInterface>(inside, outside);
 }
 
+shared_ptr<const Mesh> Scene::findMesh(const json & jp, const string& key) const
+{
+    auto it = jp.find(key);
+    if (it == jp.end() || !it.value().is_string())
+        throw DirtException("Expecting a mesh name as '%s' here:\n%s", key, jp.dump(4));
+
+    string name = it.value().get<string>();
+    auto i = m_meshes.find(name);
+    if (i != m_meshes.end())
+        return i->second;
+    else
+        throw DirtException("Can't find a mesh with name '%s' here:\n%s", name, jp.dump(4));
+}
+
 // compute the color corresponding to a ray by raytracing
 Color3f Scene::recursiveColor(Sampler &sampler, const Ray3f &ray, int depth) const
 {
@@ -126,7 +140,7 @@ Color3f Scene::recursiveColor(Sampler &sampler, const Ray3f &ray, int depth) con
 	// 		return background color (hint: look at m_background)
     const int maxDepth = 64;
     HitInfo hit;
-    if (intersect(ray, hit))
+    if (intersect(ray, hit, depth == 0 ? RayType::Camera : RayType::Indirect))
     {
         Ray3f scattered;
         Color3f attenuation;
@@ -205,6 +219,9 @@ Image3f Scene::raytrace() const
 
 Image3f Scene::integrateImage() const
 {
+    if (m_packets && m_integrator->acceptsPrimaryHits())
+        return integrateImagePackets();
+
     // allocate an image of the proper size
     auto image = Image3f(m_camera->resolution().x, m_camera->resolution().y);
 
@@ -238,3 +255,78 @@ Image3f Scene::integrateImage() const
 	// return the ray-traced image
     return image;
 }
+
+Image3f Scene::integrateImagePackets() const
+{
+    // camera rays through a TileSize x TileSize tile of pixels form one packet
+    const int TileSize = 4;
+    static_assert(TileSize * TileSize <= RayPacket::MaxSize, "A tile must fit into a single ray packet");
+
+    int width = m_camera->resolution().x, height = m_camera->resolution().y;
+    auto image = Image3f(width, height);
+
+    // each pixel of a tile gets its own copy of the sampler, which continues
+    // the sample sequence the pixel would get when rendering pixel by pixel
+    size_t firstSample = m_sampler->globalSample();
+    vector<shared_ptr<Sampler>> samplers(TileSize * TileSize);
+    for (auto & sampler : samplers)
+        sampler = m_sampler->clone();
+
+    RayPacket packet;
+    Ray3f rays[RayPacket::MaxSize];
+    HitInfo hits[RayPacket::MaxSize];
+    Vec2i pixels[RayPacket::MaxSize];
+
+    Progress progress("Rendering", width*height);
+    // foreach tile
+    for (int y0 = 0; y0 < height; y0 += TileSize)
+    {
+        for (int x0 = 0; x0 < width; x0 += TileSize)
+        {
+            packet.size = 0;
+            for (int j = y0; j < min(y0 + TileSize, height); ++j)
+            {
+                for (int i = x0; i < min(x0 + TileSize, width); ++i)
+                {
+                    int k = packet.size++;
+                    pixels[k] = Vec2i(i, j);
+                    image(i, j) = Color3f(0.f);
+                    samplers[k]->startPixel();
+                    samplers[k]->setGlobalSample(firstSample + (size_t(j) * width + i) * m_imageSamples);
+                }
+            }
+
+            // foreach sample: trace the camera rays of all pixels as one
+            // packet, then let the integrator continue from the primary hits
+            for (int s = 0; s < m_imageSamples; ++s)
+            {
+                for (int k = 0; k < packet.size; ++k)
+                {
+                    INCREMENT_TRACED_RAYS;
+                    Vec2f sample = samplers[k]->next2D();
+                    rays[k] = m_camera->generateRay(pixels[k].x + sample.x, pixels[k].y + sample.y);
+                    packet.set(k, rays[k]);
+                }
+
+                uint32_t hitMask = intersectPacket(packet, packet.fullMask(), hits);
+
+                for (int k = 0; k < packet.size; ++k)
+                {
+                    const HitInfo * hit = (hitMask & (1u << k)) ? &hits[k] : nullptr;
+                    image(pixels[k].x, pixels[k].y) += m_integrator->primaryLi(*this, *samplers[k], rays[k], hit);
+                    samplers[k]->startNextPixelSample();
+                }
+            }
+
+            // scale by the number of samples
+            for (int k = 0; k < packet.size; ++k)
+                image(pixels[k].x, pixels[k].y) /= m_imageSamples;
+
+            progress += packet.size;
+        }
+    }
+    m_sampler->setGlobalSample(firstSample + size_t(width) * height * m_imageSamples);
+
+	// return the ray-traced image
+    return image;
+}
@@ -52,37 +52,35 @@ Box3f Sphere::localBBox() const
 }
 
 bool Sphere::intersect(const Ray3f &ray, HitInfo &hit) const
+{
+    return intersectAndFinalize(ray, hit);
+}
+
+bool Sphere::intersectCandidate(const Ray3f &ray, HitInfo &hit) const
 {
     INCREMENT_INTERSECTION_TESTS;
     // compute ray intersection (and ray parameter), continue if not hit
     // just grab only the first hit
-    auto tray = m_xform.inverse().ray(ray);
-    auto a = length2(tray.d);
-    auto b = 2*dot(tray.d, tray.o);
-    auto c = length2(tray.o) - m_radius*m_radius;
-
-    // solve the quadratic equation using double precision
-    double discrim = (double)b*(double)b - 4*(double)a*(double)c;
-    if (discrim < 0)
+    float t;
+    if (!raySphere(m_xform.inverse().ray(ray), m_radius, t))
         return false;
 
-    double rootDiscrim = std::sqrt(discrim);
-
-    double q = (b < 0) ? -.5 * (b - rootDiscrim) : -.5 * (b + rootDiscrim);
-
-    float t1 = float(q / a);
-    float t2 = float(c / q);
-    if (t1 > t2)
-        std::swap(t1, t2);
-
-    // compute t
-    float t = (t1 < tray.mint) ? t2 : t1;
+    hit.t = t;
+    hit.surface = this;
+    return true;
+}
 
-    // check if computed param is within ray.mint and ray.maxt
-    if (t < tray.mint || t > tray.maxt)
-        return false;
+bool Sphere::leafPrimitive(SpherePrimitive & primitive) const
+{
+    primitive.radius = m_radius;
+    primitive.surface = this;
+    return primitive.worldToLocal.set(m_xform.mInv);
+}
 
-    auto p = tray(t);
+void Sphere::finalizeHit(const Ray3f &ray, HitInfo &hit) const
+{
+    float t = hit.t;
+    auto p = m_xform.inverse().ray(ray)(t);
     p *= m_radius / length(p);
 
     Vec3f gn = normalize(m_xform.normal(p));
@@ -90,8 +88,13 @@ bool Sphere::intersect(const Ray3f &ray, HitInfo &hit) const
 
     // if hit, set intersection record values
     hit = HitInfo(t, m_xform.point(p), gn, gn, uv, m_material.get(), m_medium_interface.get(), this);
+}
 
-    return true;
+bool Sphere::occluded(const Ray3f &ray) const
+{
+    INCREMENT_INTERSECTION_TESTS;
+    float t;
+    return raySphere(m_xform.inverse().ray(ray), m_radius, t);
 }
 
 float Sphere::pdf(const Vec3f& o, const Vec3f& v) const
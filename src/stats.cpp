@@ -0,0 +1,105 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirt/stats.h>
+#include <dirt/scene.h>
+
+RayTypeStats ray_type_stats[int(RayType::Count)];
+
+namespace
+{
+
+const char * rayTypeName(RayType type)
+{
+    switch (type)
+    {
+        case RayType::Camera: return "camera";
+        case RayType::Shadow: return "shadow";
+        default: return "indirect";
+    }
+}
+
+// format a histogram as "value: count" pairs, skipping empty bins
+string histogramString(const json & histogram)
+{
+    string result;
+    for (size_t i = 0; i < histogram.size(); ++i)
+        if (histogram[i].get<int>() > 0)
+            result += tfm::format("%s%d: %d", result.empty() ? "" : ", ", i, histogram[i].get<int>());
+    return result;
+}
+
+} // namespace
+
+
+json renderStats(const Scene & scene)
+{
+    json report;
+    report["accelerators"] = json::array();
+    scene.addAccelerationStats(report["accelerators"]);
+
+    uint64_t totalRays = 0;
+    json traversal;
+    for (int t = 0; t < int(RayType::Count); ++t)
+    {
+        const RayTypeStats & stats = ray_type_stats[t];
+        totalRays += stats.rays;
+        traversal[rayTypeName(RayType(t))] = {
+            {"rays", stats.rays},
+            {"nodes_per_ray", stats.rays ? double(stats.nodes) / stats.rays : 0.0},
+            {"primitives_per_ray", stats.rays ? double(stats.primitives) / stats.rays : 0.0}
+        };
+    }
+    report["traversal"] = traversal;
+    report["queries"] = totalRays;
+    report["intersection_tests_per_ray"] = rays_traced ? double(intersection_tests) / rays_traced : 0.0;
+    return report;
+}
+
+string renderStatsString(const json & report)
+{
+    string result = "Acceleration structures:\n";
+    for (auto & a : report["accelerators"])
+    {
+        // hierarchies describe their split method and width, other structures (e.g. grids) just their type
+        string kind = a.value("type", "");
+        if (a.contains("split"))
+            kind += tfm::format("%s%s split, width %d%s", kind.empty() ? "" : ", ", a["split"].get<string>(),
+                                a["width"].get<int>(), a["quantized"].get<bool>() ? ", quantized" : "");
+        result += tfm::format("  %s (%s) over %d primitives: %d nodes, %d leaves, "
+                              "%d references, SAH cost %.3f, overlap %.3f, %s of nodes\n",
+                              a["surface"].get<string>(), kind,
+                              a["primitives"].get<uint64_t>(), a["nodes"].get<uint64_t>(),
+                              a["leaves"].get<uint64_t>(), a["references"].get<uint64_t>(),
+                              a["sah_cost"].get<float>(), a["overlap"].get<float>(),
+                              memString(a["node_bytes"].get<size_t>()));
+        result += tfm::format("    leaf depths (mean %.1f, max %d): %s\n", a["mean_leaf_depth"].get<float>(),
+                              a["max_depth"].get<int>(), histogramString(a["leaf_depth_histogram"]));
+        result += tfm::format("    leaf sizes: %s\n", histogramString(a["leaf_size_histogram"]));
+    }
+
+    result += "Traversal:     rays     nodes/ray  primitives/ray\n";
+    for (int t = 0; t < int(RayType::Count); ++t)
+    {
+        auto & stats = report["traversal"][rayTypeName(RayType(t))];
+        result += tfm::format("  %-9s %10d %12.2f %15.2f\n", rayTypeName(RayType(t)),
+                              stats["rays"].get<uint64_t>(), stats["nodes_per_ray"].get<float>(),
+                              stats["primitives_per_ray"].get<float>());
+    }
+    return result;
+}
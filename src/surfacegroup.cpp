@@ -17,6 +17,7 @@
 */
 
 #include <dirt/surfacegroup.h>
+#include <unordered_set>
 
 
 Box3f SurfaceGroup::localBBox() const
@@ -31,13 +32,35 @@ void SurfaceGroup::addChild(shared_ptr<SurfaceBase> surface)
     m_localBBox.enclose(surface->worldBBox());
 }
 
+void SurfaceGroup::refit()
+{
+    m_localBBox = Box3f();
+    for (auto surface : m_surfaces)
+        m_localBBox.enclose(surface->worldBBox());
+}
+
+void SurfaceGroup::addAccelerationStats(json & stats) const
+{
+    // children may be referenced more than once (see BBHSettings::spatialSplits)
+    std::unordered_set<const SurfaceBase *> seen;
+    for (auto surface : m_surfaces)
+        if (seen.insert(surface.get()).second)
+            surface->addAccelerationStats(stats);
+}
+
 void SurfaceGroup::clear()
 {
     m_surfaces.clear();
     m_surfaces.shrink_to_fit();
 }
 
-bool SurfaceGroup::intersect(const Ray3f &_ray, HitInfo &hit) const
+bool SurfaceGroup::intersect(const Ray3f &ray, HitInfo &hit) const
+{
+    // only the closest hit gets its attributes computed
+    return intersectAndFinalize(ray, hit);
+}
+
+bool SurfaceGroup::intersectCandidate(const Ray3f &_ray, HitInfo &hit) const
 {
     // copy the ray so we can modify the tmax values as we traverse
     Ray3f ray = _ray;
@@ -50,7 +73,7 @@ bool SurfaceGroup::intersect(const Ray3f &_ray, HitInfo &hit) const
     // foreach primitive
     for (auto surface : m_surfaces)
     {
-        if (surface->intersect(ray, hit))
+        if (surface->intersectCandidate(ray, hit))
         {
             hitSomething = true;
             ray.maxt = hit.t;
@@ -61,6 +84,16 @@ bool SurfaceGroup::intersect(const Ray3f &_ray, HitInfo &hit) const
     return hitSomething;
 }
 
+bool SurfaceGroup::occluded(const Ray3f &ray) const
+{
+    // any hit will do, so stop at the first one
+    for (auto surface : m_surfaces)
+        if (surface->occluded(ray))
+            return true;
+
+    return false;
+}
+
 float SurfaceGroup::pdf(const Vec3f& o, const Vec3f& v) const
 {
     float weight = 1.0f / m_surfaces.size();
@@ -0,0 +1,313 @@
+/*
+    This file is part of Dirt, the Dartmouth introductory ray tracer.
+
+    Copyright (c) 2017-2019 by Wojciech Jarosz
+
+    Dirt is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Dirt is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirt/widebbh.h>
+#include <new>
+#include <queue>
+#if defined(_WIN32)
+#include <malloc.h>
+#else
+#include <stdlib.h>
+#endif
+
+void * allocatePageAligned(size_t bytes)
+{
+    size_t alignment = 64;
+    while (alignment < MemoryPageSize && alignment < bytes)
+        alignment *= 2;
+
+#if defined(_WIN32)
+    void * pointer = _aligned_malloc(std::max(bytes, size_t(1)), alignment);
+#else
+    void * pointer = nullptr;
+    if (posix_memalign(&pointer, alignment, std::max(bytes, size_t(1))) != 0)
+        pointer = nullptr;
+#endif
+    if (!pointer)
+        throw std::bad_alloc();
+    return pointer;
+}
+
+void freePageAligned(void * pointer)
+{
+#if defined(_WIN32)
+    _aligned_free(pointer);
+#else
+    free(pointer);
+#endif
+}
+
+namespace
+{
+
+// recursively collapse the binary subtree below binary node \c binaryIndex
+// into the wide node \c wideIndex
+template <int Width>
+void collapse(const BBHLinearNode * binary, uint32_t binaryIndex,
+              vector<BBHWideNode<Width>> & wide, uint32_t wideIndex)
+{
+    // gather the children of this wide node: start with the binary node
+    // itself and keep opening the interior child with the largest surface
+    // area until the wide node is full
+    vector<uint32_t> children = {binaryIndex};
+    while (int(children.size()) < Width)
+    {
+        int largest = -1;
+        float largestArea = -1.f;
+        for (int i = 0; i < int(children.size()); ++i)
+        {
+            const BBHLinearNode & node = binary[children[i]];
+            float area = node.bounds.surfaceArea();
+            if (!node.isLeaf() && area > largestArea)
+            {
+                largest = i;
+                largestArea = area;
+            }
+        }
+        if (largest < 0)
+            break;
+
+        uint32_t opened = children[largest];
+        children[largest] = opened + 1;
+        children.push_back(binary[opened].secondChildOffset);
+    }
+
+    for (int i = 0; i < int(children.size()); ++i)
+    {
+        const BBHLinearNode & child = binary[children[i]];
+        for (int a = 0; a < 3; ++a)
+        {
+            wide[wideIndex].pMin[a][i] = child.bounds.pMin[a];
+            wide[wideIndex].pMax[a][i] = child.bounds.pMax[a];
+        }
+
+        if (child.isLeaf())
+        {
+            wide[wideIndex].offset[i] = child.primitivesOffset;
+            wide[wideIndex].numPrimitives[i] = child.numPrimitives;
+        }
+        else
+        {
+            uint32_t childIndex = uint32_t(wide.size());
+            wide.emplace_back();
+            // set the offset before recursing, since this may reallocate wide
+            wide[wideIndex].offset[i] = childIndex;
+            collapse(binary, children[i], wide, childIndex);
+        }
+    }
+}
+
+// whether child slot i of a node is an interior node (the root is never a child)
+template <int Width>
+bool isInteriorChild(const BBHWideNode<Width> & node, int i)
+{
+    return node.numPrimitives[i] == 0 && node.offset[i] != 0;
+}
+
+/*
+    Reorder the nodes into treelets of up to treeletSize nodes, each holding
+    the nodes below its root that a ray entering the root is most likely to
+    visit. The conditional probability of visiting a child is the ratio of
+    its surface area to that of its parent. The treelets below each treelet
+    follow it, the most likely one first.
+
+    A treelet that does not fit into the rest of the current block of
+    treeletSize nodes starts the next block instead, and the rest of the
+    current block is filled with unused nodes. With page-sized blocks that
+    start on a page boundary, no treelet straddles two pages, while small
+    treelets near the leaves still share pages.
+*/
+template <int Width>
+void treeletLayout(vector<BBHWideNode<Width>> & nodes, size_t treeletSize)
+{
+    const uint32_t Unused = std::numeric_limits<uint32_t>::max();
+
+    struct Candidate
+    {
+        float probability;
+        uint32_t node;
+        bool operator<(const Candidate & other) const {return probability < other.probability;}
+    };
+
+    auto childBounds = [](const BBHWideNode<Width> & node, int i)
+    {
+        return Box3f(Vec3f(node.pMin[0][i], node.pMin[1][i], node.pMin[2][i]),
+                     Vec3f(node.pMax[0][i], node.pMax[1][i], node.pMax[2][i]));
+    };
+
+    vector<uint32_t> order;
+    order.reserve(nodes.size());
+    vector<Candidate> roots = {{1.f, 0}};
+    while (!roots.empty())
+    {
+        std::priority_queue<Candidate> frontier;
+        frontier.push(roots.back());
+        roots.pop_back();
+
+        // grow the treelet by the most likely node on its frontier
+        vector<uint32_t> treelet;
+        while (!frontier.empty() && treelet.size() < treeletSize)
+        {
+            Candidate current = frontier.top();
+            frontier.pop();
+            treelet.push_back(current.node);
+
+            const BBHWideNode<Width> & node = nodes[current.node];
+            Box3f bounds;
+            for (int i = 0; i < Width; ++i)
+                if (node.pMin[0][i] <= node.pMax[0][i])
+                    bounds.enclose(childBounds(node, i));
+
+            float area = bounds.surfaceArea();
+            for (int i = 0; i < Width; ++i)
+                if (isInteriorChild(node, i))
+                    frontier.push({area > 0.f ? current.probability * childBounds(node, i).surfaceArea() / area
+                                              : current.probability,
+                                   node.offset[i]});
+        }
+
+        size_t used = order.size() % treeletSize;
+        if (used > 0 && used + treelet.size() > treeletSize)
+            order.insert(order.end(), treeletSize - used, Unused);
+        order.insert(order.end(), treelet.begin(), treelet.end());
+
+        // the remaining frontier roots the next treelets
+        vector<Candidate> rest;
+        for (; !frontier.empty(); frontier.pop())
+            rest.push_back(frontier.top());
+        roots.insert(roots.end(), rest.rbegin(), rest.rend());
+    }
+
+    vector<uint32_t> newIndex(nodes.size());
+    for (auto i : range(uint32_t(order.size())))
+        if (order[i] != Unused)
+            newIndex[order[i]] = i;
+
+    // unused nodes keep the empty children of a default node
+    vector<BBHWideNode<Width>> reordered(order.size());
+    for (auto i : range(order.size()))
+    {
+        if (order[i] == Unused)
+            continue;
+        reordered[i] = nodes[order[i]];
+        for (int c = 0; c < Width; ++c)
+            if (isInteriorChild(reordered[i], c))
+                reordered[i].offset[c] = newIndex[reordered[i].offset[c]];
+    }
+    nodes.swap(reordered);
+}
+
+// store the collapsed nodes as they are, or quantize them
+template <typename NodeVector, typename WideNode>
+void storeNodes(const vector<WideNode> & wide, NodeVector & nodes)
+{
+    nodes.reserve(wide.size());
+    for (auto & node : wide)
+        nodes.emplace_back(node);
+}
+
+} // namespace
+
+
+template <int Width>
+BBHQuantizedNode<Width>::BBHQuantizedNode(const BBHWideNode<Width> & node) : BBHQuantizedNode()
+{
+    // children with empty bounds can never be hit, so they are dropped
+    int children[Width];
+    Box3f bounds;
+    for (int i = 0; i < Width; ++i)
+    {
+        bool empty = false;
+        for (int a = 0; a < 3; ++a)
+            empty |= !(node.pMin[a][i] <= node.pMax[a][i]);
+        if (empty)
+            continue;
+
+        children[numChildren++] = i;
+        bounds.enclose(Vec3f(node.pMin[0][i], node.pMin[1][i], node.pMin[2][i]));
+        bounds.enclose(Vec3f(node.pMax[0][i], node.pMax[1][i], node.pMax[2][i]));
+    }
+    if (numChildren == 0)
+        return;
+
+    for (int a = 0; a < 3; ++a)
+    {
+        // the smallest power of two step whose 255 steps span the node
+        origin[a] = bounds.pMin[a];
+        int e;
+        std::frexp((bounds.pMax[a] - bounds.pMin[a]) / 255.f, &e);
+        e = clamp(e, -126, 127);
+        while (e < 127 && origin[a] + 255.f * std::ldexp(1.f, e) < bounds.pMax[a])
+            ++e;
+        exponent[a] = int8_t(e);
+    }
+
+    for (int c = 0; c < numChildren; ++c)
+    {
+        int i = children[c];
+        for (int a = 0; a < 3; ++a)
+        {
+            // round outwards, checking against the decoded coordinates so
+            // that floating point rounding never shrinks the bounds
+            float step = scale(a);
+            int lo = clamp(int(std::floor((node.pMin[a][i] - origin[a]) / step)), 0, 255);
+            int hi = clamp(int(std::ceil((node.pMax[a][i] - origin[a]) / step)), lo, 255);
+            while (lo > 0 && origin[a] + lo * step > node.pMin[a][i])
+                --lo;
+            while (hi < 255 && origin[a] + hi * step < node.pMax[a][i])
+                ++hi;
+            qMin[a][c] = uint8_t(lo);
+            qMax[a][c] = uint8_t(hi);
+        }
+        offset[c] = node.offset[i];
+        numPrimitives[c] = node.numPrimitives[i];
+    }
+}
+
+template <int Width, bool Quantized>
+void BBHWideTree<Width, Quantized>::build(const BBHTree & tree, bool treelets)
+{
+    m_nodes.clear();
+    if (tree.empty())
+        return;
+
+    vector<BBHWideNode<Width>> wide;
+    wide.reserve(tree.numNodes() / (Width - 1) + 1);
+    wide.emplace_back();
+    collapse(tree.nodes(), 0, wide, 0);
+    if (treelets)
+        treeletLayout(wide, std::max<size_t>(1, MemoryPageSize / sizeof(Node)));
+    storeNodes(wide, m_nodes);
+    m_nodes.shrink_to_fit();
+}
+
+template <int Width, bool Quantized>
+void BBHWideTree<Width, Quantized>::leafRanges(vector<std::pair<uint32_t, uint32_t>> & leaves) const
+{
+    for (auto & node : m_nodes)
+        for (int i = 0; i < Width; ++i)
+            if (node.numPrimitives[i] > 0)
+                leaves.emplace_back(node.offset[i], node.numPrimitives[i]);
+}
+
+template struct BBHQuantizedNode<4>;
+template struct BBHQuantizedNode<8>;
+template class BBHWideTree<4, false>;
+template class BBHWideTree<8, false>;
+template class BBHWideTree<4, true>;
+template class BBHWideTree<8, true>;